@@ -8,7 +8,7 @@
 
 using namespace std;
 
-block::block(int id, int leaf, const string& data, bool dummy) {
+block::block(int64_t id, int64_t leaf, const string& data, bool dummy) {
     this->id = id;
     this->leaf = leaf;
     this->data = data;
@@ -0,0 +1,199 @@
+#include "../include/cipher_engine.h"
+#include <openssl/evp.h>
+#include <openssl/rand.h>
+#include <algorithm>
+#include <cstring>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <stdexcept>
+#include <unordered_map>
+#include <utility>
+
+using namespace std;
+
+namespace {
+
+const size_t aes_key_size = 32;
+const size_t gcm_nonce_size = 12;
+const size_t gcm_tag_size = 16;
+const size_t ctr_iv_size = 16;
+
+atomic<uint64_t> next_engine_id(1);
+
+// random bytes for nonces, refilled a few hundred nonces at a time
+const size_t nonce_pool_size = 4096;
+thread_local unsigned char nonce_pool[nonce_pool_size];
+thread_local size_t nonce_pool_left = 0;
+
+void random_nonce(unsigned char* nonce, size_t length) {
+    if (nonce_pool_left < length) {
+        if (RAND_bytes(nonce_pool, nonce_pool_size) != 1) {
+            throw runtime_error("Failed to generate nonces");
+        }
+        nonce_pool_left = nonce_pool_size;
+    }
+    unsigned char* next = nonce_pool + nonce_pool_size - nonce_pool_left;
+    memcpy(nonce, next, length);
+    // used bytes never stay around to be handed out twice
+    memset(next, 0, length);
+    nonce_pool_left -= length;
+}
+
+// pre-keyed contexts of one engine on one thread
+struct CipherContexts {
+    EVP_CIPHER_CTX* enc;
+    EVP_CIPHER_CTX* dec;
+
+    CipherContexts() : enc(EVP_CIPHER_CTX_new()), dec(EVP_CIPHER_CTX_new()) {
+        if (!enc || !dec) {
+            EVP_CIPHER_CTX_free(enc);
+            EVP_CIPHER_CTX_free(dec);
+            throw runtime_error("Failed to create EVP_CIPHER_CTX");
+        }
+    }
+    ~CipherContexts() {
+        EVP_CIPHER_CTX_free(enc);
+        EVP_CIPHER_CTX_free(dec);
+    }
+};
+
+thread_local unordered_map<uint64_t, unique_ptr<CipherContexts> > thread_contexts;
+
+const EVP_CIPHER* evp_cipher(CipherMode mode) {
+    return mode == CIPHER_GCM ? EVP_aes_256_gcm() : EVP_aes_256_ctr();
+}
+
+CipherContexts& contexts_for(uint64_t engine_id, CipherMode mode, const vector<unsigned char>& key) {
+    unique_ptr<CipherContexts>& slot = thread_contexts[engine_id];
+    if (!slot) {
+        unique_ptr<CipherContexts> contexts(new CipherContexts());
+        // key schedule once per thread, every record only sets a new IV
+        if (1 != EVP_EncryptInit_ex(contexts->enc, evp_cipher(mode), NULL, key.data(), NULL) ||
+            1 != EVP_DecryptInit_ex(contexts->dec, evp_cipher(mode), NULL, key.data(), NULL)) {
+            throw runtime_error("Failed to key the cipher contexts");
+        }
+        slot.reset(contexts.release());
+    }
+    return *slot;
+}
+
+}
+
+CipherEngine::CipherEngine(const vector<unsigned char>& key, CipherMode mode)
+    : key(key.begin(), key.begin() + min(key.size(), aes_key_size)), mode(mode),
+      engine_id(next_engine_id++) {
+    if (this->key.size() != aes_key_size) {
+        throw runtime_error("AES-256 needs a 32 byte key");
+    }
+}
+
+size_t cipher_record_size(CipherMode mode, size_t plaintext_length) {
+    if (mode == CIPHER_GCM) return gcm_nonce_size + plaintext_length + gcm_tag_size;
+    return ctr_iv_size + plaintext_length;
+}
+
+size_t CipherEngine::nonce_size() const {
+    return mode == CIPHER_GCM ? gcm_nonce_size : ctr_iv_size;
+}
+
+size_t CipherEngine::tag_size() const {
+    return mode == CIPHER_GCM ? gcm_tag_size : 0;
+}
+
+size_t CipherEngine::record_size(size_t plaintext_length) const {
+    return cipher_record_size(mode, plaintext_length);
+}
+
+// 96 random bits, CTR gets four more zero bytes for its block counter
+void CipherEngine::next_nonce(unsigned char* nonce) {
+    random_nonce(nonce, gcm_nonce_size);
+    if (mode == CIPHER_CTR) {
+        memset(nonce + gcm_nonce_size, 0, ctr_iv_size - gcm_nonce_size);
+    }
+}
+
+void CipherEngine::encrypt(const unsigned char* plaintext, size_t length, unsigned char* record) {
+    encrypt_records(plaintext, 1, length, record);
+}
+
+void CipherEngine::decrypt(const unsigned char* record, size_t length, unsigned char* plaintext) {
+    decrypt_records(record, 1, length, plaintext);
+}
+
+// one record with the context already keyed, plaintext may be the record body itself
+void CipherEngine::seal(EVP_CIPHER_CTX* ctx, unsigned char* record, const unsigned char* plaintext, size_t length) {
+    unsigned char* body = record + nonce_size();
+    next_nonce(record);
+    int len = 0;
+    if (1 != EVP_EncryptInit_ex(ctx, NULL, NULL, NULL, record) ||
+        1 != EVP_EncryptUpdate(ctx, body, &len, plaintext, length) ||
+        1 != EVP_EncryptFinal_ex(ctx, body + len, &len)) {
+        throw runtime_error("Block encryption failed");
+    }
+    if (mode == CIPHER_GCM &&
+        1 != EVP_CIPHER_CTX_ctrl(ctx, EVP_CTRL_GCM_GET_TAG, gcm_tag_size, body + length)) {
+        throw runtime_error("Failed to get the GCM tag");
+    }
+}
+
+void CipherEngine::open(EVP_CIPHER_CTX* ctx, const unsigned char* record, unsigned char* plaintext, size_t length) {
+    const unsigned char* body = record + nonce_size();
+    int len = 0;
+    if (1 != EVP_DecryptInit_ex(ctx, NULL, NULL, NULL, record) ||
+        1 != EVP_DecryptUpdate(ctx, plaintext, &len, body, length)) {
+        throw runtime_error("Block decryption failed");
+    }
+    if (mode == CIPHER_GCM &&
+        1 != EVP_CIPHER_CTX_ctrl(ctx, EVP_CTRL_GCM_SET_TAG, gcm_tag_size, const_cast<unsigned char*>(body + length))) {
+        throw runtime_error("Failed to set the GCM tag");
+    }
+    if (1 != EVP_DecryptFinal_ex(ctx, plaintext + len, &len)) {
+        throw runtime_error("Block failed authentication");
+    }
+}
+
+void CipherEngine::encrypt_records(const unsigned char* plaintext, size_t count, size_t length, unsigned char* records) {
+    EVP_CIPHER_CTX* ctx = contexts_for(engine_id, mode, key).enc;
+    const size_t record_len = record_size(length);
+    for (size_t i = 0; i < count; i++) {
+        seal(ctx, records + i * record_len, plaintext + i * length, length);
+    }
+}
+
+void CipherEngine::decrypt_records(const unsigned char* records, size_t count, size_t length, unsigned char* plaintext) {
+    EVP_CIPHER_CTX* ctx = contexts_for(engine_id, mode, key).dec;
+    const size_t record_len = record_size(length);
+    for (size_t i = 0; i < count; i++) {
+        open(ctx, records + i * record_len, plaintext + i * length, length);
+    }
+}
+
+void CipherEngine::seal_records(unsigned char* records, size_t count, size_t length) {
+    EVP_CIPHER_CTX* ctx = contexts_for(engine_id, mode, key).enc;
+    const size_t record_len = record_size(length);
+    for (size_t i = 0; i < count; i++) {
+        unsigned char* record = records + i * record_len;
+        seal(ctx, record, record + nonce_size(), length);
+    }
+}
+
+void CipherEngine::open_records(unsigned char* records, size_t count, size_t length) {
+    EVP_CIPHER_CTX* ctx = contexts_for(engine_id, mode, key).dec;
+    const size_t record_len = record_size(length);
+    for (size_t i = 0; i < count; i++) {
+        unsigned char* record = records + i * record_len;
+        open(ctx, record, record + nonce_size(), length);
+    }
+}
+
+CipherEngine* cipher_for_key(const vector<unsigned char>& key, CipherMode mode) {
+    static mutex registry_mutex;
+    static map<pair<int, vector<unsigned char> >, CipherEngine*> engines;
+    lock_guard<mutex> lock(registry_mutex);
+    CipherEngine*& engine = engines[make_pair((int)mode, key)];
+    if (engine == nullptr) {
+        engine = new CipherEngine(key, mode);
+    }
+    return engine;
+}
@@ -2,6 +2,7 @@
 #include "../include/oram.h"
 #include "../include/encryption.h"
 #include "../include/server.h" 
+#include "../include/journal.h"
 #include <iostream>
 #include <openssl/rand.h>
 #include <cstring>
@@ -14,36 +15,507 @@
 
 using namespace std;
 
-Client::Client(int num_blocks, Server* server_ptr, const vector<unsigned char>& encryptionKey) 
-    : L(ceil(log2(num_blocks))), server(server_ptr), key(encryptionKey) {
+Client::Client(int64_t num_blocks, Server* server_ptr, const vector<unsigned char>& encryptionKey,
+               const OramConfig& config, int cached_levels, PositionMap* position_map)
+    : key(encryptionKey),
+      stash((config.height + 1) * config.Z + default_stash_blocks, config.block_data_size),
+      position_map(position_map), config(config), L(config.height), server(server_ptr),
+      pending_writes(0), max_pending_writes(0), write_count(0), waited_writes(0),
+      journal_group(0), journal_paths(0), resumed(false) {
+    if (config.num_leaves() < num_blocks) {
+        throw runtime_error("Tree height too small for the number of blocks");
+    }
+    // at least the leaf level stays on the server
+    this->cached_levels = max(0, min(cached_levels, L));
+    treetop.assign(((int64_t)1 << this->cached_levels) - 1, Bucket(config.Z));
     
-    // position map with random leafs
-    for (int i = 0; i < num_blocks; i++) {
-        position_map[i] = getRandomLeaf();
+    if (!this->position_map) {
+        // position map with random leafs
+        PackedPositionMap* packed = new PackedPositionMap(num_blocks, max(L, 1));
+        this->position_map.reset(packed);
+        for (int64_t i = 0; i < num_blocks; i++) {
+            packed->set(i, getRandomLeaf());
+        }
+    }
+    evict_levels.resize(L + 1);
+}
+
+Client::Client(const string& state_path, Server* server_ptr, const vector<unsigned char>& encryptionKey)
+    : key(encryptionKey), stash(1), L(0), server(server_ptr), cached_levels(0),
+      pending_writes(0), max_pending_writes(0), write_count(0), waited_writes(0),
+      journal_group(0), journal_paths(0), resumed(false) {
+    StateReader in(state_path);
+    loadState(in);
+    if (!in.done()) {
+        throw runtime_error("Trailing data in client state " + state_path);
+    }
+}
+
+Client::Client(StateReader& state, Server* server_ptr, const vector<unsigned char>& encryptionKey)
+    : key(encryptionKey), stash(1), L(0), server(server_ptr), cached_levels(0),
+      pending_writes(0), max_pending_writes(0), write_count(0), waited_writes(0),
+      journal_group(0), journal_paths(0), resumed(false) {
+    loadState(state);
+}
+
+Client::~Client() {
+    // the writer finishes its queue before it stops
+    prefetcher.reset();
+    writer.reset();
+}
+
+// stands in for the key in the state file, a wrong key is caught on open
+static vector<unsigned char> keyReference(const vector<unsigned char>& key) {
+    string label = "path oram client state";
+    return create_encrypted_id(key, vector<unsigned char>(label.begin(), label.end()), 32);
+}
+
+static void putBlock(StateWriter& out, const block& b, const OramConfig& config) {
+    string plaintext(config.block_plaintext_size(), '\0');
+    serializeBlock(b, &plaintext[0], config);
+    out.put_bytes(plaintext.data(), plaintext.size());
+}
+
+static block getBlock(StateReader& in, const OramConfig& config) {
+    return deserializeBlock(in.get_bytes(config.block_plaintext_size()), config);
+}
+
+OramConfig Client::saved_config(const string& state_path) {
+    StateReader in(state_path);
+    if (in.get_string() != "path oram client") {
+        throw runtime_error("Not a Path ORAM client state");
+    }
+    if (in.get_u32() != client_state_version) {
+        throw runtime_error("Unknown client state version");
     }
-    stash.reserve(log2(num_blocks));
+    OramConfig config;
+    config.block_data_size = in.get_u32();
+    config.Z = in.get_u32();
+    config.height = in.get_u32();
+    config.cipher = (CipherMode)in.get_u32();
+    validate_config(config);
+    return config;
 }
 
-// Don;t need anymore I think
-bool Client::isOnPath(int blockLeaf, int bucketIndex) {
-    vector<int> blockPath = getPath(blockLeaf);
-    return find(blockPath.begin(), blockPath.end(), bucketIndex) != blockPath.end();
+void Client::save_state(const string& path) {
+    StateWriter out;
+    save_state(out);
+    out.commit(path);
+    // everything in the journal is in the state now
+    if (journal) journal->reset();
 }
 
-int Client::getRandomLeaf() {
-    unsigned char buf[4];
+void Client::save_state(StateWriter& out) {
+    // the state is only valid with every evicted path on disk
+    commit();
+    flush();
+    server->sync();
+    out.put_string("path oram client");
+    out.put_u32(client_state_version);
+    out.put_u32(config.block_data_size);
+    out.put_u32(config.Z);
+    out.put_u32(config.height);
+    out.put_u32(config.cipher);
+    vector<unsigned char> reference = keyReference(key);
+    out.put_bytes(reference.data(), reference.size());
+
+    out.put_u32(cached_levels);
+    for (Bucket& bucket : treetop) {
+        vector<block>& blocks = bucket.getBlocks();
+        out.put_u32(blocks.size());
+        for (const block& b : blocks) putBlock(out, b, config);
+    }
+    out.put_u64(stash.size());
+    for (size_t k = 0; k < stash.size(); k++) {
+        putBlock(out, stash.at(k), config);
+    }
+    position_map->save(out);
+}
+
+void Client::loadState(StateReader& in) {
+    if (in.get_string() != "path oram client") {
+        throw runtime_error("Not a Path ORAM client state");
+    }
+    if (in.get_u32() != client_state_version) {
+        throw runtime_error("Unknown client state version");
+    }
+    config.block_data_size = in.get_u32();
+    config.Z = in.get_u32();
+    config.height = in.get_u32();
+    config.cipher = (CipherMode)in.get_u32();
+    validate_config(config);
+    L = config.height;
+    vector<unsigned char> reference = keyReference(key);
+    if (memcmp(in.get_bytes(reference.size()), reference.data(), reference.size()) != 0) {
+        throw runtime_error("Client state was saved with a different key");
+    }
+
+    cached_levels = in.get_u32();
+    if (cached_levels < 0 || cached_levels > L) {
+        throw runtime_error("Corrupt client state");
+    }
+    treetop.assign(((int64_t)1 << cached_levels) - 1, Bucket(config.Z));
+    for (Bucket& bucket : treetop) {
+        uint32_t count = in.get_u32();
+        if (count > (uint32_t)config.Z) {
+            throw runtime_error("Corrupt client state");
+        }
+        vector<block>& blocks = bucket.getBlocks();
+        blocks.clear();
+        for (uint32_t j = 0; j < count; j++) blocks.push_back(getBlock(in, config));
+    }
+    uint64_t stashed = in.get_u64();
+    stash = Stash(max<uint64_t>((config.height + 1) * config.Z + default_stash_blocks, stashed), config.block_data_size);
+    for (uint64_t k = 0; k < stashed; k++) {
+        stash.insert(getBlock(in, config));
+    }
+    position_map.reset(load_position_map(in, key));
+    evict_levels.resize(L + 1);
+    resumed = true;
+}
+
+void Client::enable_journal(const string& path, size_t group_paths) {
+    if (!dynamic_cast<PackedPositionMap*>(position_map.get())) {
+        throw runtime_error("The journal needs the packed position map");
+    }
+    flush();
+    journal.reset(new Journal(path));
+    journal_group = max<size_t>(group_paths, 1);
+    if (resumed) {
+        // groups committed after the state was saved, the tree may have any of them
+        size_t replayed = journal->replay([this](StateReader& in) { replayRecord(in); });
+        if (replayed > 0) {
+            cout << "Replayed " << replayed << " journal groups from " << path << endl;
+        }
+    } else {
+        journal->reset();
+    }
+    server->hold_writes(true);
+}
+
+int64_t Client::remap(int64_t id, int64_t new_leaf) {
+    if (journal) journal_remaps.push_back(make_pair(id, new_leaf));
+    return position_map->exchange(id, new_leaf);
+}
+
+void Client::journalPaths(size_t paths) {
+    if (!journal) return;
+    journal_paths += paths;
+    if (journal_paths >= journal_group) commit();
+}
+
+// kind of journal record, every record starts with it
+enum { JOURNAL_GROUP = 1, JOURNAL_GROW = 2 };
+
+// A record holds the server buckets the group wrote (still encrypted), the
+// remapped ids, the rewritten treetop buckets and the whole stash, which is
+// everything needed to redo the group on top of the state before it.
+void Client::commit() {
+    if (!journal) return;
+    // the group is complete once every queued write has reached the server
+    flush();
+    vector<int64_t> indices;
+    string buckets;
+    server->held_writes(indices, buckets);
+    if (indices.empty() && journal_remaps.empty() && journal_paths == 0) return;
+
+    StateWriter record;
+    record.put_u32(JOURNAL_GROUP);
+    record.put_u64(indices.size());
+    for (int64_t index : indices) record.put_i64(index);
+    record.put_bytes(buckets.data(), buckets.size());
+    record.put_u64(journal_remaps.size());
+    for (const pair<int64_t, int64_t>& remapped : journal_remaps) {
+        record.put_i64(remapped.first);
+        record.put_i64(remapped.second);
+    }
+    sort(journal_treetop.begin(), journal_treetop.end());
+    journal_treetop.erase(unique(journal_treetop.begin(), journal_treetop.end()), journal_treetop.end());
+    record.put_u64(journal_treetop.size());
+    for (int64_t index : journal_treetop) {
+        vector<block>& blocks = treetop[index].getBlocks();
+        record.put_i64(index);
+        record.put_u32(blocks.size());
+        for (const block& b : blocks) putBlock(record, b, config);
+    }
+    record.put_u64(stash.size());
+    for (size_t k = 0; k < stash.size(); k++) {
+        putBlock(record, stash.at(k), config);
+    }
+    journal->append(record);
+
+    // durable now, the tree file can have the group
+    server->release_writes();
+    journal_remaps.clear();
+    journal_treetop.clear();
+    journal_paths = 0;
+}
+
+void Client::replayRecord(StateReader& in) {
+    uint32_t kind = in.get_u32();
+    if (kind == JOURNAL_GROW) {
+        server->grow();
+        position_map.reset(load_position_map(in, key));
+        grown();
+        return;
+    }
+    if (kind != JOURNAL_GROUP) {
+        throw runtime_error("Corrupt journal record");
+    }
+    size_t bucket_bytes = bucket_byte_size(config);
+    uint64_t count = in.get_u64();
+    vector<int64_t> indices;
+    for (uint64_t k = 0; k < count; k++) {
+        int64_t index = in.get_i64();
+        if (index < (int64_t)treetop.size() || index >= config.num_buckets()) {
+            throw runtime_error("Corrupt journal record");
+        }
+        indices.push_back(index);
+    }
+    vector<Bucket> buckets;
+    for (uint64_t k = 0; k < count; k++) {
+        buckets.push_back(deserialize_bucket(in.get_bytes(bucket_bytes), bucket_bytes, config));
+    }
+    server->write_path(buckets, indices);
+
+    uint64_t remaps = in.get_u64();
+    for (uint64_t k = 0; k < remaps; k++) {
+        int64_t id = in.get_i64();
+        position_map->set(id, in.get_i64());
+    }
+    uint64_t top = in.get_u64();
+    for (uint64_t k = 0; k < top; k++) {
+        int64_t index = in.get_i64();
+        uint32_t blocks_in = in.get_u32();
+        if (index < 0 || index >= (int64_t)treetop.size() || blocks_in > (uint32_t)config.Z) {
+            throw runtime_error("Corrupt journal record");
+        }
+        vector<block>& blocks = treetop[index].getBlocks();
+        blocks.clear();
+        for (uint32_t j = 0; j < blocks_in; j++) blocks.push_back(getBlock(in, config));
+    }
+    // the stash as it was at the end of the group
+    while (!stash.empty()) {
+        stash.erase(stash.at(stash.size() - 1).id);
+    }
+    uint64_t stashed = in.get_u64();
+    for (uint64_t k = 0; k < stashed; k++) {
+        stash.insert(getBlock(in, config));
+    }
+}
+
+void Client::grow() {
+    PackedPositionMap* packed = dynamic_cast<PackedPositionMap*>(position_map.get());
+    if (!packed) {
+        throw runtime_error("Growing the tree needs the packed position map");
+    }
+    // the tree file has every held and queued write before it gets longer
+    commit();
+    flush();
+    int64_t entries = packed->size();
+    vector<unsigned char> coins((entries + 7) / 8);
+    if (!coins.empty() && RAND_bytes(coins.data(), coins.size()) != 1) {
+        throw runtime_error("Failed to generate random bytes");
+    }
+    server->grow();
+    packed->widen(2 * entries, coins.data());
+    grown();
+    // the new ids have no block yet, only a leaf in the taller tree
+    for (int64_t id = entries; id < 2 * entries; id++) {
+        packed->set(id, getRandomLeaf());
+    }
+    if (journal) {
+        // replay grows the tree again and takes this map, the rest follows from it
+        StateWriter record;
+        record.put_u32(JOURNAL_GROW);
+        position_map->save(record);
+        journal->append(record);
+    }
+}
+
+void Client::grown() {
+    config.height++;
+    L = config.height;
+    // stash and treetop blocks are in client memory, they take their new leaf now
+    for (size_t k = 0; k < stash.size(); k++) {
+        block& b = stash.at(k);
+        b.leaf = position_map->get(b.id);
+    }
+    for (Bucket& bucket : treetop) {
+        for (block& b : bucket.getBlocks()) {
+            if (!b.dummy) b.leaf = position_map->get(b.id);
+        }
+    }
+    evict_levels.resize(L + 1);
+    // one bucket more on every path
+    stash.reserve(stash.capacity() + config.Z);
+}
+
+void Client::enable_async_eviction(size_t max_pending) {
+    if (max_pending == 0) {
+        flush();
+        writer.reset();
+        return;
+    }
+    {
+        lock_guard<mutex> lock(pending_mutex);
+        max_pending_writes = max_pending;
+    }
+    pending_cv.notify_all();
+    // one thread, so writes reach the server in the order they were queued
+    if (!writer) writer.reset(new ThreadPool(1));
+}
+
+void Client::flush() {
+    if (!writer) return;
+    {
+        unique_lock<mutex> lock(pending_mutex);
+        pending_cv.wait(lock, [this] { return pending_writes == 0; });
+    }
+    checkWriter();
+}
+
+void Client::checkWriter() {
+    if (!writer) return;
+    exception_ptr error;
+    {
+        lock_guard<mutex> lock(pending_mutex);
+        error = writer_error;
+        writer_error = nullptr;
+    }
+    if (error) rethrow_exception(error);
+}
+
+unordered_map<int64_t, Bucket> Client::pendingCopies(const vector<int64_t>& indices) {
+    unordered_map<int64_t, Bucket> copies;
+    if (!writer) return copies;
+    lock_guard<mutex> lock(pending_mutex);
+    if (pending_buckets.empty()) return copies;
+    for (int64_t index : indices) {
+        unordered_map<int64_t, pair<size_t, Bucket> >::iterator it = pending_buckets.find(index);
+        if (it != pending_buckets.end()) {
+            copies[index] = it->second.second;
+        }
+    }
+    return copies;
+}
+
+void Client::decryptBuckets(vector<Bucket>& buckets, const vector<int64_t>& indices, unordered_map<int64_t, Bucket>& queued,
+                            int64_t ahead_id, int64_t ahead_leaf) {
+    if (queued.empty()) {
+        decrypt_path(buckets, key, config);
+        relabelStale(buckets, ahead_id, ahead_leaf);
+        return;
+    }
+    // the server copy of a queued bucket may be old or half written, it is never decrypted
+    vector<Bucket> sealed;
+    vector<size_t> sealed_at;
+    for (size_t i = 0; i < buckets.size(); i++) {
+        unordered_map<int64_t, Bucket>::iterator it = queued.find(indices[i]);
+        if (it != queued.end()) {
+            buckets[i] = move(it->second);
+        } else {
+            sealed_at.push_back(i);
+            sealed.push_back(move(buckets[i]));
+        }
+    }
+    decrypt_path(sealed, key, config);
+    relabelStale(sealed, ahead_id, ahead_leaf);
+    for (size_t k = 0; k < sealed.size(); k++) {
+        buckets[sealed_at[k]] = move(sealed[k]);
+    }
+}
+
+// The map is widened when the tree grows, so it has the block's leaf in the
+// taller tree, which is under the bucket the block was read from. Ids remapped
+// by the running access get their new leaf from serve or batch_apply anyway
+void Client::relabelStale(vector<Bucket>& buckets, int64_t ahead_id, int64_t ahead_leaf) {
+    for (Bucket& bucket : buckets) {
+        for (block& b : bucket.getBlocks()) {
+            if (b.dummy || b.leaf >= 0) continue;
+            b.leaf = b.id == ahead_id ? ahead_leaf : position_map->get(b.id);
+        }
+    }
+}
+
+void Client::writeBack(vector<Bucket>& buckets, const vector<int64_t>& indices) {
+    if (!writer) {
+        // encrypt at the end, the whole path in one pass
+        encrypt_path(buckets, key, config);
+        // Send encrypted buckets to the server, the whole path as one batch
+        server->write_path(buckets, indices);
+        return;
+    }
+    size_t number;
+    {
+        unique_lock<mutex> lock(pending_mutex);
+        if (pending_writes >= max_pending_writes) {
+            waited_writes++;
+            pending_cv.wait(lock, [this] { return pending_writes < max_pending_writes; });
+        }
+        number = ++write_count;
+        pending_writes++;
+        for (size_t i = 0; i < indices.size(); i++) {
+            pending_buckets[indices[i]] = make_pair(number, buckets[i]);
+        }
+    }
+    shared_ptr<vector<Bucket> > job_buckets(new vector<Bucket>(move(buckets)));
+    vector<int64_t> job_indices = indices;
+    writer->submit([this, job_buckets, job_indices, number]() {
+        exception_ptr error;
+        try {
+            encrypt_path(*job_buckets, key, config);
+            server->write_path(*job_buckets, job_indices);
+        } catch (...) {
+            error = current_exception();
+        }
+        lock_guard<mutex> lock(pending_mutex);
+        if (error) {
+            // the plaintext stays queued so reads still see it, the next access throws
+            if (!writer_error) writer_error = error;
+        } else {
+            for (int64_t index : job_indices) {
+                unordered_map<int64_t, pair<size_t, Bucket> >::iterator it = pending_buckets.find(index);
+                // a later write of the same bucket is still queued
+                if (it != pending_buckets.end() && it->second.first == number) {
+                    pending_buckets.erase(it);
+                }
+            }
+        }
+        pending_writes--;
+        pending_cv.notify_all();
+    });
+}
+
+// Deepest level of the path to pathLeaf that is also on the path to blockLeaf.
+// The two paths share a bucket at level d iff the leaves agree in their top d
+// bits, so it is L minus the bit length of their XOR.
+int Client::deepestLevel(int64_t blockLeaf, int64_t pathLeaf) const {
+    uint64_t diff = static_cast<uint64_t>(blockLeaf ^ pathLeaf);
+    if (diff == 0) return L;
+    return L - (64 - __builtin_clzll(diff));
+}
+
+// bucket index of the level'th bucket on the path to leaf
+int64_t Client::bucketIndex(int64_t leaf, int level) const {
+    return (((int64_t)1 << level) - 1) + (leaf >> (L - level));
+}
+
+int64_t Client::getRandomLeaf() {
+    unsigned char buf[8];
     if (RAND_bytes(buf, sizeof(buf)) != 1) {
         throw runtime_error("Failed to generate random bytes");
     }
-    unsigned int random_value;
+    uint64_t random_value;
     memcpy(&random_value, buf, sizeof(random_value));
-    return random_value % (1 << L);
+    // the leaf count is a power of two, no modulo bias
+    return (int64_t)(random_value & (uint64_t)(config.num_leaves() - 1));
 }
 
 // Compute path from block leaf (in leaf space) to the root - bucket indices).
-vector<int> Client::getPath(int leaf) {
-    vector<int> path;
-    int node = leaf + ((1 << L) - 1);  // leaf space to bucket index.
+vector<int64_t> Client::getPath(int64_t leaf) {
+    vector<int64_t> path;
+    int64_t node = leaf + (config.num_leaves() - 1);  // leaf space to bucket index.
     while (node >= 0) {
         path.push_back(node);
         if (node == 0) break;
@@ -53,128 +525,461 @@ vector<int> Client::getPath(int leaf) {
 }
 
 // Reads a path from the server. The server converts leaf space to bucket space
-vector<Bucket> Client::readPath(int leaf) {
-    vector<Bucket> path_buckets = server->give_path(leaf);
-    for (Bucket &bucket : path_buckets) {
-        for (block &b : bucket.getBlocks()) {
-            //cout << "Decrypting block with data length: " << b.data.size() << " and data: " << b.data << endl; 
-            b = decryptBlock(b, key);
-        }
+vector<int64_t> Client::serverPath(int64_t leaf) const {
+    vector<int64_t> server_path;
+    for (int level = cached_levels; level <= L; level++) {
+        server_path.push_back(bucketIndex(leaf, level));
     }
+    return server_path;
+}
+
+vector<Bucket> Client::readPath(int64_t leaf) {
+    vector<int64_t> server_path = serverPath(leaf);
+    unordered_map<int64_t, Bucket> queued = pendingCopies(server_path);
+    vector<Bucket> path_buckets = server->give_path(leaf, cached_levels);
+    // the whole path in one pass
+    decryptBuckets(path_buckets, server_path, queued);
+    addTreetop(leaf, path_buckets);
     return path_buckets;
 }
 
-void Client::writePath(int leaf, vector<Bucket>& path_buckets) {
-    // get bucket path and ranges for the leafs they can fit to
-    vector<int> global_path = getPath(leaf);
-    // root to leaf
+void Client::addTreetop(int64_t leaf, vector<Bucket>& path_buckets) {
+    // the cached top of the path is already decrypted
+    vector<int64_t> global_path = getPath(leaf);
     reverse(global_path.begin(), global_path.end());
-    vector<pair<int, int>> bucket_ranges;
-    for (int bucketIndex : global_path) {
-        int level = static_cast<int>(floor(log2(bucketIndex + 1)));
-        int leftMost = (bucketIndex - ((1 << level) - 1)) << (L - level);
-        int rightMost = leftMost + (1 << (L - level)) - 1;
-        bucket_ranges.push_back({leftMost, rightMost});
+    vector<Bucket> top;
+    for (int i = 0; i < cached_levels; i++) {
+        top.push_back(treetop[global_path[i]]);
     }
-    
-    // initialize each bucket with dummy blocks
-    for (size_t i = 0; i < path_buckets.size(); i++) {
-        Bucket newBucket(4);
-        for (int j = 0; j < 4; j++) {
-            block dummyBlock(-1, -1, "dummy", true);
-            newBucket.addBlock(dummyBlock);
+    path_buckets.insert(path_buckets.begin(), top.begin(), top.end());
+}
+
+future<vector<Bucket> > Client::prefetchPath(int64_t leaf) {
+    if (!prefetcher) prefetcher.reset(new ThreadPool(1));
+    shared_ptr<promise<vector<Bucket> > > done(new promise<vector<Bucket> >());
+    int first_level = cached_levels;
+    prefetcher->submit([this, done, leaf, first_level]() {
+        try {
+            done->set_value(server->give_path(leaf, first_level));
+        } catch (...) {
+            done->set_exception(current_exception());
+        }
+    });
+    return done->get_future();
+}
+
+void Client::stashPath(vector<Bucket>& path_buckets) {
+    for (Bucket &bucket : path_buckets) {
+        for (block &b : bucket.getBlocks()) {
+            // dummies are skipped, they are recreated on eviction
+            stash.insert(b);
         }
-        path_buckets[i] = newBucket;
     }
-    
-    // Place blocks from stash into the deepest bucket along the path where they fit
-    for (auto it = stash.begin(); it != stash.end(); ) {
-        block b = it->second;
-        int assigned_index = -1;
-        for (int i = static_cast<int>(global_path.size()) - 1; i >= 0; i--) {
-            if (isOnPath(b.leaf,global_path[i])) {
-                assigned_index = i;
-                break;
+}
+
+// Greedy eviction: every stash block is bucketed by the deepest level it may
+// go to (one XOR per block), then the path is filled from the leaf up. A block
+// that fits at level d also fits at every level above it, so whatever does not
+// fit is carried up in the pool. O(stash + L * Z) per access.
+void Client::writePath(int64_t leaf, vector<Bucket>& path_buckets, int64_t keep_leaf, unordered_map<int64_t, Bucket>* kept) {
+    // bucket indices root to leaf
+    vector<int64_t> global_path(L + 1);
+    for (int level = 0; level <= L; level++) {
+        global_path[level] = bucketIndex(leaf, level);
+    }
+
+    for (vector<int64_t>& ids : evict_levels) ids.clear();
+    evict_pool.clear();
+    for (size_t i = 0; i < stash.size(); i++) {
+        const block& b = stash.at(i);
+        evict_levels[deepestLevel(b.leaf, leaf)].push_back(b.id);
+    }
+
+    for (int level = L; level >= 0; level--) {
+        evict_pool.insert(evict_pool.end(), evict_levels[level].begin(), evict_levels[level].end());
+        vector<block>& slots = path_buckets[level].getBlocks();
+        for (size_t j = 0; j < slots.size(); j++) {
+            if (evict_pool.empty()) {
+                slots[j] = block();
+                continue;
             }
-        }
-        if (assigned_index != -1 && path_buckets[assigned_index].hasSpace()) {
-            path_buckets[assigned_index].addBlock(b);
-            it = stash.erase(it); // remove block from stash if placed
-        } else {
-            ++it;
+            int64_t id = evict_pool.back();
+            evict_pool.pop_back();
+            slots[j] = *stash.find(id);
+            stash.erase(id);
         }
     }
     
-    // encrypt at the end;
-    for (Bucket &bucket : path_buckets) {
-        for (block &b : bucket.getBlocks()) {
-            b = encryptBlock(b, key);
-        }
+    // cached levels stay here in the clear
+    for (int i = 0; i < cached_levels; i++) {
+        treetop[global_path[i]] = path_buckets[i];
+        if (journal) journal_treetop.push_back(global_path[i]);
     }
-    
-    // Send encrypted buckets to the server
-    for (size_t i = 0; i < global_path.size(); i++) {
-        //path_buckets[i].print_bucket();
-        server->write_bucket(path_buckets[i], global_path[i]);
+    path_buckets.erase(path_buckets.begin(), path_buckets.begin() + cached_levels);
+    global_path.erase(global_path.begin(), global_path.begin() + cached_levels);
+
+    if (kept && keep_leaf >= 0) {
+        int shared = deepestLevel(keep_leaf, leaf);
+        for (int level = cached_levels; level <= shared; level++) {
+            (*kept)[global_path[level - cached_levels]] = path_buckets[level - cached_levels];
+        }
     }
+    writeBack(path_buckets, global_path);
 }
 
 // op = 1 for write, op = 0 for read.
-block Client::access(int op, int id, const string& data) {
+block Client::access(int op, int64_t id, const string& data) {
+    if (op == 1) {
+        return read_modify_write(id, [&data](string& current) { current = data; });
+    }
+    return read_modify_write(id, function<void(string&)>());
+}
+
+block Client::read_modify_write(int64_t id, const function<void(string&)>& modify) {
+    checkWriter();
     // get current leaf and then assign a new random leaf
-    int leaf = (position_map.count(id)) ? position_map[id] : getRandomLeaf();
-    int new_leaf = getRandomLeaf();
-    position_map[id] = new_leaf;
+    int64_t new_leaf = getRandomLeaf();
+    int64_t leaf = remap(id, new_leaf);
+    if (leaf < 0) leaf = getRandomLeaf();
     
     // get buckets in path
     vector<Bucket> path_buckets = readPath(leaf);
 
     // update stash
-    for (Bucket &bucket : path_buckets) {
-        for (block &b : bucket.getBlocks()) {
-            stash[b.id] = b;
-        }
-    }
+    stashPath(path_buckets);
+    block result = serve(id, new_leaf, modify);
+    
+    // highkey eviction
+    writePath(leaf, path_buckets);
+    stash.record_occupancy();
+    journalPaths(1);
+    
+    return result;
+}
 
+block Client::serve(int64_t id, int64_t new_leaf, const function<void(string&)>& modify) {
     block result = block(-1, -1, "dummy", true);
     
-    auto it = stash.find(id);
-    if (it != stash.end()) {
+    block* found = stash.find(id);
+    if (found) {
         // put new leaf
-        result = it->second;
-        it->second.leaf = new_leaf;
-        if (op == 1) { // for writing
-            it->second.data = data;
-            it->second.dummy = false;
+        result = *found;
+        found->leaf = new_leaf;
+        if (modify) { // for writing
+            modify(found->data);
+            found->dummy = false;
         }
-    } else if (op == 1) {
+    } else if (modify) {
         // in case the id doesn't exist in current stash, make a block
-        block new_block(id, new_leaf, data, false);
-        stash.insert({id, new_block});
+        block new_block(id, new_leaf, "", false);
+        modify(new_block.data);
+        stash.insert(new_block);
         result = new_block;
     }
     
-    // highkey eviction
-    writePath(leaf, path_buckets);
-    
     return result;
 }
 
 //print stash
 void Client::print_stash() {
-    for (auto &pair : stash) {
-        pair.second.print_block();
+    for (size_t i = 0; i < stash.size(); i++) {
+        stash.at(i).print_block();
+    }
+}
+
+void Client::print_stash_stats() {
+    stash.print_stats();
+    if (writer) {
+        lock_guard<mutex> lock(pending_mutex);
+        cout << "Write back: " << write_count << " paths in the background, " << waited_writes
+             << " waited for a full queue of " << max_pending_writes << endl;
+    }
+}
+
+vector<block> Client::batch_access(int op, const vector<int64_t>& ids, const vector<string>& data) {
+    if (op == 1 && data.size() < ids.size()) {
+        throw runtime_error("batch_access needs one data item per id");
+    }
+    vector<block> results(ids.size(), block(-1, -1, "dummy", true));
+    if (ids.empty()) return results;
+    batch_apply(ids, [&](size_t i, block& b) {
+        if (!b.dummy) results[i] = b;
+        if (op == 1) {
+            b.data = data[i];
+            b.dummy = false;
+            // a new block is returned as written
+            if (results[i].dummy) results[i] = b;
+        }
+    });
+    return results;
+}
+
+void Client::batch_apply(const vector<int64_t>& ids, const function<void(size_t, block&)>& modify, int dummy_paths) {
+    if (ids.empty() && dummy_paths <= 0) return;
+    checkWriter();
+
+    // remap every distinct id once, the old leaves are the paths to read. A
+    // repeated id reads a random path instead, so the number of paths never
+    // tells how many ids of the batch were the same
+    unordered_map<int64_t, int64_t> new_leaves;
+    vector<int64_t> leaves;
+    for (int64_t id : ids) {
+        if (new_leaves.count(id)) {
+            leaves.push_back(getRandomLeaf());
+            continue;
+        }
+        int64_t new_leaf = getRandomLeaf();
+        int64_t leaf = remap(id, new_leaf);
+        if (leaf < 0) leaf = getRandomLeaf();
+        new_leaves[id] = new_leaf;
+        leaves.push_back(leaf);
+    }
+    // padding, read and evicted like any other path
+    for (int i = 0; i < dummy_paths; i++) {
+        leaves.push_back(getRandomLeaf());
+    }
+
+    // union of the paths, buckets shared near the root are read once
+    vector<int64_t> touched;
+    touched.reserve(leaves.size() * (L + 1));
+    for (int64_t leaf : leaves) {
+        for (int level = 0; level <= L; level++) {
+            touched.push_back(bucketIndex(leaf, level));
+        }
+    }
+    sort(touched.begin(), touched.end());
+    touched.erase(unique(touched.begin(), touched.end()), touched.end());
+    // the cached top levels are the smallest indices
+    size_t top_count = lower_bound(touched.begin(), touched.end(), ((int64_t)1 << cached_levels) - 1) - touched.begin();
+    vector<int64_t> server_indices(touched.begin() + top_count, touched.end());
+
+    unordered_map<int64_t, Bucket> queued = pendingCopies(server_indices);
+    vector<Bucket> server_buckets = server->give_buckets(server_indices);
+    decryptBuckets(server_buckets, server_indices, queued);
+    stash.reserve(stash.size() + touched.size() * config.Z + new_leaves.size());
+    for (size_t i = 0; i < top_count; i++) {
+        for (block &b : treetop[touched[i]].getBlocks()) {
+            stash.insert(b);
+        }
+    }
+    for (Bucket &bucket : server_buckets) {
+        for (block &b : bucket.getBlocks()) {
+            stash.insert(b);
+        }
+    }
+
+    for (size_t i = 0; i < ids.size(); i++) {
+        int64_t id = ids[i];
+        block* found = stash.find(id);
+        if (found) {
+            found->leaf = new_leaves[id];
+            modify(i, *found);
+        } else {
+            // stays a dummy unless modify writes it
+            block new_block(id, new_leaves[id], "", true);
+            modify(i, new_block);
+            stash.insert(new_block);
+        }
+    }
+
+    // Every stash block starts at the deepest touched bucket on its own path and
+    // moves up to the parent (touched too, the union is closed towards the root)
+    // when that is full. Children have larger indices than their parents, so
+    // walking touched backwards fills the tree bottom up.
+    unordered_map<int64_t, size_t> position;
+    for (size_t i = 0; i < touched.size(); i++) {
+        position[touched[i]] = i;
+    }
+    vector<vector<int64_t> > pending(touched.size());
+    for (size_t i = 0; i < stash.size(); i++) {
+        const block& b = stash.at(i);
+        for (int level = L; level >= 0; level--) {
+            unordered_map<int64_t, size_t>::iterator it = position.find(bucketIndex(b.leaf, level));
+            if (it != position.end()) {
+                pending[it->second].push_back(b.id);
+                break;
+            }
+        }
+    }
+    vector<Bucket> buckets(touched.size(), Bucket(config.Z));
+    for (size_t i = touched.size(); i-- > 0; ) {
+        vector<block>& slots = buckets[i].getBlocks();
+        vector<int64_t>& pool = pending[i];
+        for (size_t j = 0; j < slots.size() && !pool.empty(); j++) {
+            int64_t id = pool.back();
+            pool.pop_back();
+            slots[j] = *stash.find(id);
+            stash.erase(id);
+        }
+        // leftovers at the root stay in the stash
+        if (touched[i] > 0 && !pool.empty()) {
+            vector<int64_t>& up = pending[position[(touched[i] - 1) / 2]];
+            up.insert(up.end(), pool.begin(), pool.end());
+        }
+    }
+
+    for (size_t i = 0; i < top_count; i++) {
+        treetop[touched[i]] = buckets[i];
+        if (journal) journal_treetop.push_back(touched[i]);
+    }
+    vector<Bucket> evicted(buckets.begin() + top_count, buckets.end());
+    writeBack(evicted, server_indices);
+    stash.record_occupancy();
+    journalPaths(leaves.size());
+}
+
+vector<block> Client::pipelined_access(int op, const vector<int64_t>& ids, const vector<string>& data) {
+    if (op == 1 && data.size() < ids.size()) {
+        throw runtime_error("pipelined_access needs one data item per id");
+    }
+    vector<block> results;
+    if (ids.empty()) return results;
+    checkWriter();
+    results.reserve(ids.size());
+
+    // the first path is read before the loop, every access then starts the next one
+    int64_t new_leaf = getRandomLeaf();
+    int64_t leaf = remap(ids[0], new_leaf);
+    if (leaf < 0) leaf = getRandomLeaf();
+    vector<int64_t> server_path = serverPath(leaf);
+    unordered_map<int64_t, Bucket> queued = pendingCopies(server_path);
+    future<vector<Bucket> > reading = prefetchPath(leaf);
+
+    for (size_t i = 0; i < ids.size(); i++) {
+        // remapped now, if it is the same id the old leaf is the one this access gives it
+        int64_t next_new_leaf = -1;
+        int64_t next_leaf = -1;
+        vector<int64_t> next_path;
+        unordered_map<int64_t, Bucket> next_queued;
+        future<vector<Bucket> > next_reading;
+        if (i + 1 < ids.size()) {
+            next_new_leaf = getRandomLeaf();
+            next_leaf = remap(ids[i + 1], next_new_leaf);
+            if (next_leaf < 0) next_leaf = getRandomLeaf();
+            next_path = serverPath(next_leaf);
+            next_queued = pendingCopies(next_path);
+            next_reading = prefetchPath(next_leaf);
+        }
+
+        vector<Bucket> path_buckets = reading.get();
+        // the next id is remapped already, its block has to stay on the path read next
+        if (i + 1 < ids.size()) {
+            decryptBuckets(path_buckets, server_path, queued, ids[i + 1], next_leaf);
+        } else {
+            decryptBuckets(path_buckets, server_path, queued);
+        }
+        addTreetop(leaf, path_buckets);
+        stashPath(path_buckets);
+        if (op == 1) {
+            const string& value = data[i];
+            results.push_back(serve(ids[i], new_leaf, [&value](string& current) { current = value; }));
+        } else {
+            results.push_back(serve(ids[i], new_leaf, function<void(string&)>()));
+        }
+
+        // The next path was read before this eviction, the buckets both paths share
+        // at the top are rewritten here. Their new contents replace whatever the
+        // prefetch got (old, or torn if it raced the write), ahead of older queued copies
+        unordered_map<int64_t, Bucket> rewritten;
+        writePath(leaf, path_buckets, next_leaf, &rewritten);
+        stash.record_occupancy();
+        for (unordered_map<int64_t, Bucket>::iterator it = rewritten.begin(); it != rewritten.end(); ++it) {
+            next_queued[it->first] = move(it->second);
+        }
+
+        new_leaf = next_new_leaf;
+        leaf = next_leaf;
+        server_path.swap(next_path);
+        queued.swap(next_queued);
+        reading = move(next_reading);
     }
+    // not in the loop, the next id is already remapped before this access is evicted
+    journalPaths(ids.size());
+    return results;
 }
 
-vector<block> Client::range_query(int start, int end) {
+void Client::bulk_load(const vector<int64_t>& ids, const vector<string>& data) {
+    if (data.size() < ids.size()) {
+        throw runtime_error("bulk_load needs one data item per id");
+    }
+    if (journal) {
+        throw runtime_error("bulk_load rewrites the whole tree, enable the journal after it");
+    }
+    flush();
+    while (!stash.empty()) {
+        stash.erase(stash.at(stash.size() - 1).id);
+    }
+
+    // slots[b * Z + k] is the ids index in slot k of bucket b, -1 for a dummy
+    int64_t num_buckets = config.num_buckets();
+    vector<int64_t> slots((size_t)num_buckets * config.Z, -1);
+    vector<unsigned char> used(num_buckets, 0);
+    vector<int64_t> leaves(ids.size(), -1);
+    unordered_map<int64_t, size_t> last;
+    for (size_t i = 0; i < ids.size(); i++) {
+        last[ids[i]] = i;
+    }
+    for (size_t i = 0; i < ids.size(); i++) {
+        if (last[ids[i]] != i) continue;
+        int64_t leaf = getRandomLeaf();
+        leaves[i] = leaf;
+        position_map->set(ids[i], leaf);
+        bool placed = false;
+        for (int level = L; level >= 0 && !placed; level--) {
+            int64_t index = bucketIndex(leaf, level);
+            if (used[index] < config.Z) {
+                slots[(size_t)index * config.Z + used[index]++] = i;
+                placed = true;
+            }
+        }
+        if (!placed) {
+            stash.insert(block(ids[i], leaf, data[i], false));
+        }
+    }
+
+    // bucket index order is level order, so the file is written front to back
+    const int chunk_buckets = 256;
+    for (int64_t start = 0; start < num_buckets; start += chunk_buckets) {
+        int count = (int)min<int64_t>(chunk_buckets, num_buckets - start);
+        vector<Bucket> buckets;
+        vector<int64_t> indices;
+        for (int64_t index = start; index < start + count; index++) {
+            Bucket bucket(config.Z);
+            vector<block>& blocks = bucket.getBlocks();
+            for (int k = 0; k < config.Z; k++) {
+                int64_t i = slots[(size_t)index * config.Z + k];
+                if (i >= 0) blocks[k] = block(ids[i], leaves[i], data[i], false);
+            }
+            if (index < (int64_t)treetop.size()) {
+                // cached levels stay here in the clear
+                treetop[index] = bucket;
+            } else {
+                buckets.push_back(bucket);
+                indices.push_back(index);
+            }
+        }
+        if (indices.empty()) continue;
+        encrypt_path(buckets, key, config);
+        server->write_path(buckets, indices);
+    }
+    stash.record_occupancy();
+}
+
+vector<block> Client::range_query(int64_t start, int64_t end, int batch_size) {
     vector<block> results;
-    while (start <= end) {
-        block b = access(0, start, "");
-        if (!b.dummy) {
-            results.push_back(b);
+    if (batch_size < 1) batch_size = 1;
+    for (int64_t first = start; first <= end; first += batch_size) {
+        int64_t last = min(end, first + batch_size - 1);
+        vector<int64_t> ids;
+        for (int64_t id = first; id <= last; id++) {
+            ids.push_back(id);
+        }
+        vector<block> batch = batch_access(0, ids);
+        for (block &b : batch) {
+            if (!b.dummy) {
+                results.push_back(b);
+            }
         }
-        start++;
     }
     return results;
 }
\ No newline at end of file
@@ -2,15 +2,16 @@
 #include <openssl/hmac.h>
 #include <openssl/evp.h>
 #include <openssl/rand.h>
-#include <openssl/err.h>
 #include <vector>
 #include <stdexcept>
 #include <algorithm>
 #include <sstream>
 #include <cstdlib>
 #include <iomanip>
+#include <cstring>
 
 #include "../include/encryption.h"
+#include "../include/cipher_engine.h"
 #include "../include/block.h"
 #include "../include/bucket.h"
 
@@ -59,219 +60,266 @@ vector<unsigned char> create_encrypted_id(const vector<unsigned char>& key, cons
     return output;
 }
 
-// Randomized encryption
+// Randomized encryption, nonce | ciphertext | tag from the key's CipherEngine
 vector<unsigned char> encryptData(const vector<unsigned char>& key, const vector<unsigned char>& plaintext) {
-    EVP_CIPHER_CTX* ctx = EVP_CIPHER_CTX_new();
-    if (!ctx) throw std::runtime_error("Failed to create EVP_CIPHER_CTX");
-
-    const EVP_CIPHER* cipher = EVP_aes_256_cbc();
-    int iv_length = EVP_CIPHER_iv_length(cipher);
-    
-    // Generate a random IV
-    vector<unsigned char> iv(iv_length);
-    if (RAND_bytes(iv.data(), iv_length) != 1) {
-        EVP_CIPHER_CTX_free(ctx);
-        throw std::runtime_error("Failed to generate random IV");
-    }
-    
-    // Initialize encryption with random IV
-    if(1 != EVP_EncryptInit_ex(ctx, cipher, NULL, key.data(), iv.data())) {
-        EVP_CIPHER_CTX_free(ctx);
-        throw std::runtime_error("EVP_EncryptInit_ex failed");
-    }
-    
-    // Output buffer, randomized IV+cipher
-    vector<unsigned char> ciphertext(iv); // Prepend IV.
-    ciphertext.resize(iv_length + plaintext.size() + EVP_CIPHER_block_size(cipher));
-    
-    int len;
-    int ciphertext_len = 0;
-    
-    // Encrypt plaintext
-    if(1 != EVP_EncryptUpdate(ctx, ciphertext.data() + iv_length, &len, plaintext.data(), plaintext.size())) {
-        EVP_CIPHER_CTX_free(ctx);
-        throw std::runtime_error("EVP_EncryptUpdate failed");
-    }
-    ciphertext_len = len;
-    
-    if(1 != EVP_EncryptFinal_ex(ctx, ciphertext.data() + iv_length + len, &len)) {
-        EVP_CIPHER_CTX_free(ctx);
-        throw std::runtime_error("EVP_EncryptFinal_ex failed");
-    }
-    ciphertext_len += len;
-    
-    EVP_CIPHER_CTX_free(ctx);
-    
-    // Resize to the proper output length
-    ciphertext.resize(iv_length + ciphertext_len);
-
+    CipherEngine* engine = cipher_for_key(key);
+    vector<unsigned char> ciphertext(engine->record_size(plaintext.size()));
+    engine->encrypt(plaintext.data(), plaintext.size(), ciphertext.data());
     return ciphertext;
 }
 
-// Decrypt using the IV from ciphertext
+// Decrypt using the nonce from ciphertext, throws if a GCM tag does not match
 vector<unsigned char> decryptData(const vector<unsigned char>& key, const vector<unsigned char>& ciphertext) {
-    const EVP_CIPHER* cipher = EVP_aes_256_cbc();
-    int iv_length = EVP_CIPHER_iv_length(cipher);
-    if (ciphertext.size() < (size_t)iv_length) {
-        throw std::runtime_error("Ciphertext too short, missing IV");
+    CipherEngine* engine = cipher_for_key(key);
+    size_t overhead = engine->record_size(0);
+    if (ciphertext.size() < overhead) {
+        throw std::runtime_error("Ciphertext too short, missing nonce");
     }
-    
-    // Extract IV
-
-    /*
-    // creating stringstream object
-    stringstream ss;
-    // Insert every character of vector into stream
-    for (auto it = ciphertext.begin(); it != ciphertext.end(); it++)
-        ss << *it;
-
-    // converts stream contents into a string
-    cout << ss.str() << endl;
-    */
-    vector<unsigned char> iv(ciphertext.begin(), ciphertext.begin() + iv_length);
-    
-    EVP_CIPHER_CTX* ctx = EVP_CIPHER_CTX_new();
-    if (!ctx) throw std::runtime_error("Failed to create EVP_CIPHER_CTX");
-    
-    if(1 != EVP_DecryptInit_ex(ctx, cipher, NULL, key.data(), iv.data())) {
-        EVP_CIPHER_CTX_free(ctx);
-        throw std::runtime_error("EVP_DecryptInit_ex failed");
-    }
-    
-    // Buffer for plaintext
-    vector<unsigned char> plaintext(ciphertext.size() - iv_length); 
-    int len;
-    int plaintext_len = 0;
-    
-    if(1 != EVP_DecryptUpdate(ctx, plaintext.data(), &len, ciphertext.data() + iv_length, ciphertext.size() - iv_length)) {
-        EVP_CIPHER_CTX_free(ctx);
-        throw std::runtime_error("EVP_DecryptUpdate failed");
-    }
-    plaintext_len = len;
-    
-    if(1 != EVP_DecryptFinal_ex(ctx, plaintext.data() + len, &len)) {
-        unsigned long err = ERR_get_error();
-        char err_buf[256];
-        ERR_error_string_n(err, err_buf, sizeof(err_buf));
-        cout << "Decryption error: " << err_buf << endl;
-        cout << "IV size: " << iv_length << endl;
-        cout << "Ciphertext size: " << ciphertext.size() << endl;
-        
-        // Dump first few bytes of ciphertext
-        cout << "Ciphertext start bytes: ";
-        for (int i = 0; i < std::min(32, (int)ciphertext.size()); i++) {
-            printf("%02x ", ciphertext[i]);
-        }
-        cout << endl;
-        
-        EVP_CIPHER_CTX_free(ctx);
-        throw std::runtime_error("EVP_DecryptFinal_ex failed");
-    }
-    plaintext_len += len;
-    
-    EVP_CIPHER_CTX_free(ctx);
-    
-    plaintext.resize(plaintext_len);
-
+    vector<unsigned char> plaintext(ciphertext.size() - overhead);
+    engine->decrypt(ciphertext.data(), plaintext.size(), plaintext.data());
     return plaintext;
 }
 
-// Serialize block into string format
-string serializeBlock(block &b) {
-    ostringstream oss;
-    oss << b.id << "|" << b.leaf << "|" << (b.dummy ? "1" : "0") << "|";
-    // Pad data to fixed 20 characters
-    string paddedData = b.data;
-    //paddedData.resize(2020, ' ');
-    oss << paddedData;
-    
-    return oss.str();
+// Fixed binary layout, block_header_size bytes of header then the payload
+// zero padded to block_data_size:
+//   int64 id | int64 leaf | uint32 flags (bit 0 = dummy, bits 8-15 = tree height + 1) | uint32 payload length
+void serializeBlock(const block &b, char* out, const OramConfig& config) {
+    if (b.data.size() > (size_t)config.block_data_size) {
+        throw runtime_error("Block data exceeds the configured block_data_size");
+    }
+    int64_t id = b.id;
+    int64_t leaf = b.leaf;
+    // the leaf is only meaningful in a tree of this height
+    uint32_t flags = (b.dummy ? 1 : 0) | (uint32_t)(config.height + 1) << 8;
+    uint32_t length = b.data.size();
+    memcpy(out, &id, 8);
+    memcpy(out + 8, &leaf, 8);
+    memcpy(out + 16, &flags, 4);
+    memcpy(out + 20, &length, 4);
+    memcpy(out + block_header_size, b.data.data(), length);
+    memset(out + block_header_size + length, 0, config.block_data_size - length);
 }
 
-// interpret all block info from the data after it has been serialized
-block deserializeBlock(const string &s) {
-    istringstream iss(s);
-    string token;
-    getline(iss, token, '|');
-    int id = stoi(token);
-    getline(iss, token, '|');
-    int leaf = stoi(token);
-    getline(iss, token, '|');
-    bool dummy = (token == "1");
-    string data;
-    getline(iss, data);
-    // Remove padding spaces
-    while (!data.empty() && data.back() == ' ') {
-        data.pop_back();
+// interpret all block info from the fixed layout, the payload is copied once
+block deserializeBlock(const char* in, const OramConfig& config) {
+    int64_t id, leaf;
+    uint32_t flags, length;
+    memcpy(&id, in, 8);
+    memcpy(&leaf, in + 8, 8);
+    memcpy(&flags, in + 16, 4);
+    memcpy(&length, in + 20, 4);
+    if (length > (uint32_t)config.block_data_size) {
+        throw runtime_error("Corrupt block header");
+    }
+    // written before the tree grew, the leaf is one of the smaller tree and
+    // the client looks the block's leaf up again (0 is a block from before heights were stored)
+    uint32_t height = (flags >> 8) & 0xff;
+    if (height != 0 && height != (uint32_t)config.height + 1) {
+        leaf = -1;
     }
-    return block(id, leaf, data, dummy);
+    return block(id, leaf, string(in + block_header_size, length), (flags & 1) != 0);
 }
 
 // Encrypt the whole block
-block encryptBlock(block &b, const vector<unsigned char>& key) {
+block encryptBlock(block &b, const vector<unsigned char>& key, const OramConfig& config) {
     //cout << "in encrypt block" << endl;
     //b.print_block();
-    string plaintext = serializeBlock(b);
-    plaintext.resize(2028, ' ');
-    vector<unsigned char> plainVec(plaintext.begin(), plaintext.end());
-    vector<unsigned char> cipherVec = encryptData(key, plainVec);
-    string cipherHex = hexEncode(cipherVec);
-    //cout << "size of encrypted block" << cipherHex.size() << endl;
-    return block(-1,-1, cipherHex, false);
+    string plaintext(config.block_plaintext_size(), '\0');
+    serializeBlock(b, &plaintext[0], config);
+    CipherEngine* engine = cipher_for_key(key, config.cipher);
+    // keep the raw nonce+ciphertext+tag bytes, no hex
+    string record(engine->record_size(plaintext.size()), '\0');
+    engine->encrypt(reinterpret_cast<const unsigned char*>(plaintext.data()), plaintext.size(),
+                    reinterpret_cast<unsigned char*>(&record[0]));
+    return block(-1,-1, record, false);
 }
 
 // Decrypt whole block
-block decryptBlock(const block &b, const vector<unsigned char>& key) {
-    vector<unsigned char> cipherVec = hexDecode(b.data);
-    vector<unsigned char> plainVec = decryptData(key, cipherVec);
-    string plainText(plainVec.begin(), plainVec.end());
-    return deserializeBlock(plainText);
+block decryptBlock(const block &b, const vector<unsigned char>& key, const OramConfig& config) {
+    if (b.data.size() != encrypted_block_size(config)) {
+        throw runtime_error("Encrypted block has the wrong size");
+    }
+    string plaintext(config.block_plaintext_size(), '\0');
+    cipher_for_key(key, config.cipher)->decrypt(reinterpret_cast<const unsigned char*>(b.data.data()), plaintext.size(),
+                                 reinterpret_cast<unsigned char*>(&plaintext[0]));
+    return deserializeBlock(plaintext.data(), config);
 }
 
-string serialize_bucket(Bucket bucket){
-    ostringstream oss;
-    for (block b : bucket.getBlocks()){
-        //cout << "data size: " << b.data.size() << endl;
-        oss << b.data;
+// nonce + ciphertext (+ GCM tag) of one padded block
+size_t encrypted_block_size(const OramConfig& config) {
+    return cipher_record_size(config.cipher, config.block_plaintext_size());
+}
+
+size_t bucket_byte_size(const OramConfig& config) {
+    return bucket_header_size + config.Z * encrypted_block_size(config);
+}
+
+void validate_config(const OramConfig& config) {
+    if (config.block_data_size <= 0) {
+        throw runtime_error("block_data_size must be positive");
     }
-    //cout <<  "bucket size: " << oss.str().size() << endl;
-    return oss.str();
+    // Z is stored in one byte of the bucket header
+    if (config.Z <= 0 || config.Z > 255) {
+        throw runtime_error("Z must be between 1 and 255");
+    }
+    // bucket indices and leaf labels are 64-bit
+    if (config.height < 0 || config.height > 62) {
+        throw runtime_error("Tree height out of range");
+    }
+    if (config.cipher != CIPHER_GCM && config.cipher != CIPHER_CTR) {
+        throw runtime_error("Unknown cipher");
+    }
+}
+
+// header is version, Z, cipher, then one reserved byte
+string serialize_bucket(Bucket bucket, const OramConfig& config){
+    const size_t blockSize = encrypted_block_size(config);
+    string out;
+    out.reserve(bucket_byte_size(config));
+    out.push_back(static_cast<char>(bucket_format_version));
+    out.push_back(static_cast<char>(bucket.capacity()));
+    out.push_back(static_cast<char>(config.cipher));
+    out.push_back(0);
+    for (block &b : bucket.getBlocks()){
+        if (b.data.size() != blockSize) {
+            throw runtime_error("Bucket holds a block that is not encrypted");
+        }
+        out += b.data;
+    }
+    if (out.size() != bucket_byte_size(config)) {
+        throw runtime_error("Bucket does not hold exactly Z blocks");
+    }
+    return out;
+}
+
+Bucket deserialize_bucket(string read_string, const OramConfig& config){
+    return deserialize_bucket(read_string.data(), read_string.size(), config);
 }
 
-Bucket deserialize_bucket(string read_string){
-    const size_t blockSize = 4096;
-    const size_t expectedSize = 16384;
-    
-    // Check that the input string is the expected size.
-    if (read_string.size() != expectedSize) {
-        cout << "read_string: " << read_string.size() << endl;
-        throw runtime_error("Bucket data must be exactly 512 characters.");
+// parse straight out of the read buffer, each block copies its record once
+Bucket deserialize_bucket(const char* data, size_t length, const OramConfig& config){
+    if (length < (size_t)bucket_header_size) {
+        throw runtime_error("Bucket data is missing its header");
+    }
+    if (static_cast<unsigned char>(data[0]) != bucket_format_version) {
+        throw runtime_error("Unknown bucket format version");
     }
-    
-    vector<block> blocks;
-    // Loop over the string in increments of 320.
-    for (size_t i = 0; i < expectedSize; i += blockSize) {
-        string blockStr = read_string.substr(i, blockSize);
-        block block_being_deserialized = block(-1,-1, blockStr,false);
-        blocks.push_back(block_being_deserialized);
+    if (static_cast<unsigned char>(data[2]) != config.cipher) {
+        throw runtime_error("Bucket was written with a different cipher");
     }
-    Bucket result = Bucket();
-    for (block b: blocks){
-        result.addBlock(b);
+    int Z = static_cast<unsigned char>(data[1]);
+    const size_t blockSize = encrypted_block_size(config);
+    if (Z != config.Z) {
+        throw runtime_error("Bucket was written with a different Z");
+    }
+    if (length != bucket_byte_size(config)) {
+        cout << "read_string: " << length << endl;
+        throw runtime_error("Bucket data does not match bucket_byte_size");
+    }
+
+    Bucket result = Bucket(Z);
+    vector<block>& blocks = result.getBlocks();
+    for (int i = 0; i < Z; i++) {
+        block& b = blocks[i];
+        b.data.assign(data + bucket_header_size + i * blockSize, blockSize);
+        b.dummy = false;
     }
     return result;
 }
 
-Bucket encrypt_bucket(Bucket bucket_to_encrypt, const vector<unsigned char>& key){
-    for (block &b: bucket_to_encrypt.getBlocks()){
-        b = encryptBlock(b,key);
+// the whole bucket goes through the cipher in one call
+Bucket encrypt_bucket(Bucket bucket_to_encrypt, const vector<unsigned char>& key, const OramConfig& config){
+    vector<block>& blocks = bucket_to_encrypt.getBlocks();
+    const size_t plain_size = config.block_plaintext_size();
+    const size_t record_size = encrypted_block_size(config);
+    string plaintext(blocks.size() * plain_size, '\0');
+    for (size_t i = 0; i < blocks.size(); i++) {
+        serializeBlock(blocks[i], &plaintext[i * plain_size], config);
+    }
+    string records(blocks.size() * record_size, '\0');
+    cipher_for_key(key, config.cipher)->encrypt_records(reinterpret_cast<const unsigned char*>(plaintext.data()), blocks.size(), plain_size,
+                                         reinterpret_cast<unsigned char*>(&records[0]));
+    for (size_t i = 0; i < blocks.size(); i++) {
+        blocks[i] = block(-1,-1, records.substr(i * record_size, record_size), false);
     }
     return bucket_to_encrypt;
 }
 
-Bucket decrypt_bucket(Bucket bucket_to_decrypt, const vector<unsigned char>& key){
-    for (block &b: bucket_to_decrypt.getBlocks()){
-        b = decryptBlock(b,key);
+Bucket decrypt_bucket(Bucket bucket_to_decrypt, const vector<unsigned char>& key, const OramConfig& config){
+    vector<block>& blocks = bucket_to_decrypt.getBlocks();
+    const size_t plain_size = config.block_plaintext_size();
+    const size_t record_size = encrypted_block_size(config);
+    string records;
+    records.reserve(blocks.size() * record_size);
+    for (block &b : blocks) {
+        if (b.data.size() != record_size) {
+            throw runtime_error("Encrypted block has the wrong size");
+        }
+        records += b.data;
+    }
+    string plaintext(blocks.size() * plain_size, '\0');
+    cipher_for_key(key, config.cipher)->decrypt_records(reinterpret_cast<const unsigned char*>(records.data()), blocks.size(), plain_size,
+                                         reinterpret_cast<unsigned char*>(&plaintext[0]));
+    for (size_t i = 0; i < blocks.size(); i++) {
+        blocks[i] = deserializeBlock(plaintext.data() + i * plain_size, config);
     }
     return bucket_to_decrypt;
-}
\ No newline at end of file
+}
+
+// Plaintexts are written straight into their record slots, then the whole
+// path is sealed in place with one context, one pass over the buffer.
+void encrypt_path(vector<Bucket>& path, const vector<unsigned char>& key, const OramConfig& config){
+    CipherEngine* engine = cipher_for_key(key, config.cipher);
+    const size_t plain_size = config.block_plaintext_size();
+    const size_t record_size = encrypted_block_size(config);
+    const size_t nonce_size = engine->nonce_size();
+    size_t count = 0;
+    for (Bucket &bucket : path) count += bucket.getBlocks().size();
+
+    string buffer(count * record_size, '\0');
+    size_t i = 0;
+    for (Bucket &bucket : path) {
+        for (block &b : bucket.getBlocks()) {
+            serializeBlock(b, &buffer[i * record_size + nonce_size], config);
+            i++;
+        }
+    }
+    engine->seal_records(reinterpret_cast<unsigned char*>(&buffer[0]), count, plain_size);
+
+    i = 0;
+    for (Bucket &bucket : path) {
+        for (block &b : bucket.getBlocks()) {
+            b = block(-1,-1, buffer.substr(i * record_size, record_size), false);
+            i++;
+        }
+    }
+}
+
+void decrypt_path(vector<Bucket>& path, const vector<unsigned char>& key, const OramConfig& config){
+    CipherEngine* engine = cipher_for_key(key, config.cipher);
+    const size_t plain_size = config.block_plaintext_size();
+    const size_t record_size = encrypted_block_size(config);
+    const size_t nonce_size = engine->nonce_size();
+    size_t count = 0;
+    for (Bucket &bucket : path) count += bucket.getBlocks().size();
+
+    string buffer;
+    buffer.reserve(count * record_size);
+    for (Bucket &bucket : path) {
+        for (block &b : bucket.getBlocks()) {
+            if (b.data.size() != record_size) {
+                throw runtime_error("Encrypted block has the wrong size");
+            }
+            buffer += b.data;
+        }
+    }
+    engine->open_records(reinterpret_cast<unsigned char*>(&buffer[0]), count, plain_size);
+
+    size_t i = 0;
+    for (Bucket &bucket : path) {
+        for (block &b : bucket.getBlocks()) {
+            b = deserializeBlock(buffer.data() + i * record_size + nonce_size, config);
+            i++;
+        }
+    }
+}
@@ -0,0 +1,111 @@
+#include "../include/frontend.h"
+#include <exception>
+#include <iostream>
+#include <stdexcept>
+#include <unordered_map>
+
+using namespace std;
+
+OramFrontend::OramFrontend(Client* client, size_t batch_size)
+    : client(client), batch_size(batch_size > 0 ? batch_size : 1), stopping(false),
+      batch_count(0), request_count(0), merged_count(0) {
+    scheduler = thread(&OramFrontend::scheduler_loop, this);
+}
+
+OramFrontend::~OramFrontend() {
+    {
+        lock_guard<mutex> lock(queue_mutex);
+        stopping = true;
+    }
+    queue_cv.notify_all();
+    scheduler.join();
+}
+
+future<block> OramFrontend::submit(int op, int64_t id, const string& data) {
+    unique_ptr<Request> request(new Request());
+    request->op = op;
+    request->id = id;
+    request->data = data;
+    request->answered = false;
+    future<block> result = request->result.get_future();
+    {
+        lock_guard<mutex> lock(queue_mutex);
+        if (stopping) {
+            throw runtime_error("ORAM front end is shutting down");
+        }
+        queue.push_back(move(request));
+    }
+    queue_cv.notify_one();
+    return result;
+}
+
+block OramFrontend::access(int op, int64_t id, const string& data) {
+    return submit(op, id, data).get();
+}
+
+void OramFrontend::scheduler_loop() {
+    while (true) {
+        // requests of this batch grouped by id, in submission order
+        vector<int64_t> ids;
+        vector<vector<unique_ptr<Request> > > groups;
+        {
+            unique_lock<mutex> lock(queue_mutex);
+            queue_cv.wait(lock, [this] { return stopping || !queue.empty(); });
+            if (queue.empty()) return;
+
+            unordered_map<int64_t, size_t> group_of;
+            deque<unique_ptr<Request> > later;
+            while (!queue.empty()) {
+                unique_ptr<Request> request = move(queue.front());
+                queue.pop_front();
+                unordered_map<int64_t, size_t>::iterator it = group_of.find(request->id);
+                if (it != group_of.end()) {
+                    groups[it->second].push_back(move(request));
+                    merged_count++;
+                } else if (ids.size() < batch_size) {
+                    group_of[request->id] = ids.size();
+                    ids.push_back(request->id);
+                    groups.push_back(vector<unique_ptr<Request> >());
+                    groups.back().push_back(move(request));
+                } else {
+                    // a full batch, later requests for this id wait behind it too
+                    later.push_back(move(request));
+                }
+            }
+            queue.swap(later);
+            batch_count++;
+            for (vector<unique_ptr<Request> >& group : groups) request_count += group.size();
+        }
+
+        try {
+            client->batch_apply(ids, [&](size_t i, block& b) {
+                vector<block> results;
+                for (unique_ptr<Request>& request : groups[i]) {
+                    if (request->op == 1) {
+                        b.data = request->data;
+                        b.dummy = false;
+                    }
+                    results.push_back(b);
+                }
+                // answered before the eviction
+                for (size_t r = 0; r < results.size(); r++) {
+                    groups[i][r]->result.set_value(results[r]);
+                    groups[i][r]->answered = true;
+                }
+            }, (int)(batch_size - ids.size()));
+        } catch (...) {
+            // a request answered before the failure (say in the eviction) keeps its block
+            for (vector<unique_ptr<Request> >& group : groups) {
+                for (unique_ptr<Request>& request : group) {
+                    if (!request->answered) request->result.set_exception(current_exception());
+                }
+            }
+        }
+    }
+}
+
+void OramFrontend::print_stats() {
+    lock_guard<mutex> lock(queue_mutex);
+    cout << "Front end: " << request_count << " requests in " << batch_count << " batches of "
+         << batch_size << " paths, " << merged_count << " merged into an access to the same id" << endl;
+}
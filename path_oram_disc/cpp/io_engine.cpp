@@ -0,0 +1,212 @@
+#include "../include/io_engine.h"
+#include <algorithm>
+#include <cerrno>
+#include <cstring>
+#include <stdexcept>
+#include <string>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/uio.h>
+
+#if defined(__linux__) && defined(__has_include)
+#if __has_include(<linux/io_uring.h>)
+#include <linux/io_uring.h>
+#include <sys/syscall.h>
+#if defined(__NR_io_uring_setup) && defined(__NR_io_uring_enter)
+#define HAVE_IO_URING 1
+#endif
+#endif
+#endif
+
+using namespace std;
+
+ThreadPoolIoEngine::ThreadPoolIoEngine(StorageBackend* storage, size_t num_threads)
+    : storage(storage), pool(num_threads) {}
+
+void ThreadPoolIoEngine::run(vector<IoRequest>& requests, bool is_write) {
+    if (requests.size() == 1) {
+        // nothing to overlap
+        if (is_write) storage->write(requests[0].offset, requests[0].buffer, requests[0].length);
+        else storage->read(requests[0].offset, requests[0].buffer, requests[0].length);
+        return;
+    }
+    StorageBackend* backend = storage;
+    vector<function<void()> > jobs;
+    for (size_t i = 0; i < requests.size(); i++) {
+        IoRequest r = requests[i];
+        jobs.push_back([backend, r, is_write]() {
+            if (is_write) backend->write(r.offset, r.buffer, r.length);
+            else backend->read(r.offset, r.buffer, r.length);
+        });
+    }
+    pool.run_all(jobs);
+}
+
+UringIoEngine::UringIoEngine(StorageBackend* storage, unsigned queue_depth)
+    : ring_fd(-1), file_fd(storage->file_descriptor()), storage(storage), entries(0),
+      sq_ring(MAP_FAILED), cq_ring(MAP_FAILED), sqes(MAP_FAILED),
+      sq_ring_size(0), cq_ring_size(0), sqes_size(0) {
+#ifdef HAVE_IO_URING
+    if (file_fd < 0) {
+        throw runtime_error("io_uring needs a file descriptor backed tree");
+    }
+    struct io_uring_params params;
+    memset(&params, 0, sizeof(params));
+    ring_fd = syscall(__NR_io_uring_setup, max(queue_depth, 1u), &params);
+    if (ring_fd < 0) {
+        throw runtime_error(string("io_uring_setup failed: ") + strerror(errno));
+    }
+    entries = params.sq_entries;
+
+    sq_ring_size = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+    cq_ring_size = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+    bool single_mmap = params.features & IORING_FEAT_SINGLE_MMAP;
+    if (single_mmap) {
+        sq_ring_size = cq_ring_size = max(sq_ring_size, cq_ring_size);
+    }
+    sq_ring = mmap(nullptr, sq_ring_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring_fd, IORING_OFF_SQ_RING);
+    if (sq_ring != MAP_FAILED) {
+        cq_ring = single_mmap ? sq_ring
+                              : mmap(nullptr, cq_ring_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring_fd, IORING_OFF_CQ_RING);
+    }
+    sqes_size = params.sq_entries * sizeof(struct io_uring_sqe);
+    if (cq_ring != MAP_FAILED) {
+        sqes = mmap(nullptr, sqes_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring_fd, IORING_OFF_SQES);
+    }
+    if (sq_ring == MAP_FAILED || cq_ring == MAP_FAILED || sqes == MAP_FAILED) {
+        teardown();
+        throw runtime_error("Failed to map the io_uring rings");
+    }
+
+    char* sq = static_cast<char*>(sq_ring);
+    char* cq = static_cast<char*>(cq_ring);
+    sq_head = reinterpret_cast<unsigned*>(sq + params.sq_off.head);
+    sq_tail = reinterpret_cast<unsigned*>(sq + params.sq_off.tail);
+    sq_mask = reinterpret_cast<unsigned*>(sq + params.sq_off.ring_mask);
+    sq_array = reinterpret_cast<unsigned*>(sq + params.sq_off.array);
+    cq_head = reinterpret_cast<unsigned*>(cq + params.cq_off.head);
+    cq_tail = reinterpret_cast<unsigned*>(cq + params.cq_off.tail);
+    cq_mask = reinterpret_cast<unsigned*>(cq + params.cq_off.ring_mask);
+    cqes = cq + params.cq_off.cqes;
+#else
+    (void)queue_depth;
+    throw runtime_error("io_uring is not available on this platform");
+#endif
+}
+
+UringIoEngine::~UringIoEngine() {
+    teardown();
+}
+
+void UringIoEngine::teardown() {
+    if (sqes != MAP_FAILED) munmap(sqes, sqes_size);
+    if (cq_ring != MAP_FAILED && cq_ring != sq_ring) munmap(cq_ring, cq_ring_size);
+    if (sq_ring != MAP_FAILED) munmap(sq_ring, sq_ring_size);
+    if (ring_fd >= 0) close(ring_fd);
+    sqes = cq_ring = sq_ring = MAP_FAILED;
+    ring_fd = -1;
+}
+
+// Fills up to `entries` SQEs, submits them with one io_uring_enter and reaps
+// every completion before moving on to the rest of the batch.
+void UringIoEngine::run(vector<IoRequest>& requests, bool is_write) {
+#ifdef HAVE_IO_URING
+    lock_guard<mutex> lock(ring_mutex);
+    vector<struct iovec> iov(requests.size());
+    struct io_uring_sqe* sqe_array = static_cast<struct io_uring_sqe*>(sqes);
+    struct io_uring_cqe* cqe_array = static_cast<struct io_uring_cqe*>(cqes);
+
+    size_t next = 0;
+    while (next < requests.size()) {
+        unsigned batch = min<size_t>(entries, requests.size() - next);
+
+        unsigned tail = *sq_tail;
+        for (unsigned k = 0; k < batch; k++) {
+            size_t r = next + k;
+            unsigned index = tail & *sq_mask;
+            struct io_uring_sqe* sqe = &sqe_array[index];
+            memset(sqe, 0, sizeof(*sqe));
+            iov[r].iov_base = requests[r].buffer;
+            iov[r].iov_len = requests[r].length;
+            sqe->opcode = is_write ? IORING_OP_WRITEV : IORING_OP_READV;
+            sqe->fd = file_fd;
+            sqe->off = requests[r].offset;
+            sqe->addr = reinterpret_cast<unsigned long long>(&iov[r]);
+            sqe->len = 1;
+            sqe->user_data = r;
+            sq_array[index] = index;
+            tail++;
+        }
+        __atomic_store_n(sq_tail, tail, __ATOMIC_RELEASE);
+
+        unsigned submitted = 0;
+        unsigned completed = 0;
+        // the first failure is only thrown once every submitted request is reaped,
+        // a completion left in the ring would be taken for one of the next run
+        string error;
+        while (completed < submitted || (error.empty() && submitted < batch)) {
+            unsigned to_submit = error.empty() ? batch - submitted : 0;
+            unsigned wait_for = (to_submit > 0 ? batch : submitted) - completed;
+            int ret = syscall(__NR_io_uring_enter, ring_fd, to_submit, wait_for,
+                              IORING_ENTER_GETEVENTS, nullptr, 0);
+            if (ret < 0) {
+                if (errno == EINTR) continue;
+                if (error.empty()) error = string("io_uring_enter failed: ") + strerror(errno);
+                // nothing more can be reaped
+                if (to_submit == 0) break;
+                continue;
+            }
+            submitted += ret;
+
+            unsigned head = *cq_head;
+            unsigned ready = __atomic_load_n(cq_tail, __ATOMIC_ACQUIRE);
+            while (head != ready) {
+                struct io_uring_cqe* cqe = &cqe_array[head & *cq_mask];
+                head++;
+                completed++;
+                if (cqe->user_data < next || cqe->user_data >= next + batch) {
+                    if (error.empty()) error = "Unexpected io_uring completion";
+                    continue;
+                }
+                IoRequest& req = requests[cqe->user_data];
+                if (cqe->res < 0) {
+                    if (error.empty()) {
+                        error = string(is_write ? "Write failed: " : "Failed to read the full bucket: ") + strerror(-cqe->res);
+                    }
+                } else if ((size_t)cqe->res < req.length && error.empty()) {
+                    // short transfer, finish it synchronously
+                    size_t done = cqe->res;
+                    try {
+                        if (is_write) storage->write(req.offset + done, req.buffer + done, req.length - done);
+                        else storage->read(req.offset + done, req.buffer + done, req.length - done);
+                    } catch (const exception& e) {
+                        error = e.what();
+                    }
+                }
+            }
+            __atomic_store_n(cq_head, head, __ATOMIC_RELEASE);
+        }
+        if (!error.empty()) {
+            // SQEs the kernel never took are dropped, the next run starts on an empty ring
+            __atomic_store_n(sq_tail, __atomic_load_n(sq_head, __ATOMIC_ACQUIRE), __ATOMIC_RELEASE);
+            throw runtime_error(error);
+        }
+        next += batch;
+    }
+#else
+    (void)requests;
+    (void)is_write;
+#endif
+}
+
+IoEngine* open_io_engine(StorageBackend* storage, IoMode mode, unsigned queue_depth) {
+    if (mode == IO_ASYNC && storage->file_descriptor() >= 0) {
+        try {
+            return new UringIoEngine(storage, queue_depth);
+        } catch (const exception&) {
+            // kernel too old or io_uring blocked, fall back to threads
+        }
+        return new ThreadPoolIoEngine(storage, min(queue_depth, 16u));
+    }
+    return new SyncIoEngine(storage);
+}
@@ -12,10 +12,40 @@
 #include <chrono>
 #include <vector>
 #include <iomanip>
+#include <cstdio>
 
 using namespace std;
 using namespace std::chrono;
 
+// Builds a lazy tree of 2^25 - 1 buckets in tree/large (a sparse file of about
+// 16 GB, so bucket offsets go well past 4 GiB) and reads back blocks written at
+// ids spread over the whole position map. Only the touched paths hit the disk
+static bool check_large_tree(IoMode io_mode) {
+    const int height = 24;
+    const int64_t blocks = (int64_t)1 << 20;
+    OramConfig config(64, 4, height, CIPHER_GCM);
+    vector<unsigned char> key = generateEncryptionKey(64);
+    int bad = 0;
+    size_t checked = 0;
+    {
+        BucketHeap tree(config, key, STORAGE_FILE, io_mode, 0, "tree/large", TREE_LAZY);
+        Server server(config, move(tree));
+        Client client(blocks, &server, key, config);
+        vector<int64_t> ids;
+        for (int64_t id = 0; id < blocks; id += blocks / 256 + 7) ids.push_back(id);
+        ids.push_back(blocks - 1);
+        for (int64_t id : ids) client.access(1, id, "large " + to_string(id));
+        for (int64_t id : ids) {
+            if (client.access(0, id).data != "large " + to_string(id)) bad++;
+        }
+        checked = ids.size();
+    }
+    remove("tree/large");
+    remove("tree/large.written");
+    cout << "Large tree check (2^" << height + 1 << " - 1 buckets): " << checked - bad << "/" << checked << " blocks intact" << endl;
+    return bad == 0;
+}
+
 int main() {
     cout << "=== PATH-ORAM RANGE QUERY PERFORMANCE TEST ===" << endl;
     
@@ -25,65 +55,170 @@ int main() {
     const int num_buckets_low = pow(2,10); 
 
     int bucket_capacity = 4;
+    // payload bytes per block, every block in the tree file is padded to this size
+    int block_data_size = 2000;
+    // CIPHER_GCM authenticates every block, CIPHER_CTR only encrypts it
+    CipherMode cipher = CIPHER_GCM;
+
+    // STORAGE_MMAP maps tree/oram into memory instead of using pread/pwrite,
+    // STORAGE_DIRECT opens it with O_DIRECT so only the bucket cache below holds buckets in memory
+    StorageMode storage_mode = STORAGE_FILE;
+    // IO_ASYNC reads/writes a whole path at once (io_uring or a thread pool), IO_SYNC one bucket after another
+    IoMode io_mode = IO_ASYNC;
+    // recently used buckets kept in memory (0 turns the cache off), ignored for STORAGE_MMAP
+    size_t cache_buckets = 0;
+    // top levels of the tree kept decrypted in client memory (treetop caching), 0 keeps all on the server
+    int cached_levels = 0;
+    // keep the position map in its own recursive Path ORAM (tree/posmap1, 2, ...) instead of a packed array in memory
+    bool recursive_position_map = false;
+    // > 0 encrypts and writes evicted paths on a background thread, with at most this many paths queued
+    size_t async_eviction = 0;
+    // build the tree from the whole dataset in one sequential write instead of one access per line
+    bool bulk_load = false;
+    // TREE_LAZY creates the tree file sparse and skips the dummy fill, unwritten buckets read as dummies
+    TreeInit tree_init = TREE_FILL;
+    // reopen tree/oram with the client state and key of the last run instead of loading the dataset again
+    bool resume = false;
+    // client side files, the key never goes next to the tree
+    string state_path = "client.state";
+    string key_path = "client.key";
+    // > 0 logs every access to client.journal with a group commit every this many
+    // paths, evicted buckets only reach tree/oram once their group is durable
+    size_t journal_group = 0;
+    string journal_path = "client.journal";
+    // first checks a sparse 2^25 bucket tree in tree/large, 64-bit offsets and indices end to end
+    bool large_tree_check = false;
+    // levels added to the tree online once it is loaded, each one doubles the leaves and ids
+    int grow_levels = 0;
     int L = ceil(log2(num_buckets_low));
     
     // Calculate actual number of buckets in ORAM
-    int num_buckets = (1 << (L + 1)) - 1;
+    OramConfig config(block_data_size, bucket_capacity, L, cipher);
+    if (resume) {
+        // the tree may have grown since it was created
+        config = Client::saved_config(state_path);
+    }
+    int64_t num_buckets = config.num_buckets();
     
     cout << "Dataset parameters:" << endl;
     cout << "  Initial buckets: 2^" << log2(num_buckets_low) << " = " << num_buckets_low << endl;
     cout << "  Total buckets in ORAM: " << num_buckets << endl;
     cout << "  Bucket capacity: " << bucket_capacity << endl;
+    cout << "  Block payload: " << block_data_size << " bytes" << endl;
+    if (large_tree_check && !check_large_tree(io_mode)) {
+        cerr << "ERROR: Large tree check failed!" << endl;
+        return 1;
+    }
     
-    // Generate encryption key
-    cout << "Generating encryption key... ";
-    vector<unsigned char> encryptionKey = generateEncryptionKey(64);
+    // Generate encryption key, or read the one the saved state belongs to
+    vector<unsigned char> encryptionKey;
+    if (resume) {
+        cout << "Reading encryption key... ";
+        StateReader key_file(key_path);
+        string stored = key_file.get_string();
+        encryptionKey.assign(stored.begin(), stored.end());
+    } else {
+        cout << "Generating encryption key... ";
+        encryptionKey = generateEncryptionKey(64);
+        StateWriter key_file;
+        key_file.put_string(string(encryptionKey.begin(), encryptionKey.end()));
+        key_file.commit(key_path);
+    }
     cout << "done." << endl;
 
     // Initialize ORAM components
     cout << "Initializing ORAM system... ";
-    BucketHeap oram_tree(num_buckets, bucket_capacity, encryptionKey);
-    Server server(num_buckets_low, bucket_capacity, move(oram_tree));
-    Client client(num_buckets_low, &server, encryptionKey);
+    BucketHeap oram_tree(config, encryptionKey, storage_mode, io_mode, cache_buckets, "tree/oram", resume ? TREE_OPEN : tree_init);
+    Server server(config, move(oram_tree));
+    unique_ptr<Client> client_ptr;
+    if (resume) {
+        // stash, position map and cached levels come back from the state file
+        client_ptr.reset(new Client(state_path, &server, encryptionKey));
+    } else {
+        PositionMap* position_map = nullptr;
+        if (recursive_position_map) {
+            // its trees go next to tree/oram as tree/posmap1, 2, ...
+            position_map = new RecursivePositionMap(num_buckets_low, encryptionKey, storage_mode, io_mode,
+                                                    64, 1 << 16, "tree/posmap");
+        }
+        client_ptr.reset(new Client(num_buckets_low, &server, encryptionKey, config, cached_levels, position_map));
+    }
+    Client& client = *client_ptr;
+    if (async_eviction > 0) {
+        client.enable_async_eviction(async_eviction);
+    }
     cout << "done." << endl;
 
-    // Read dataset file and load data
+    if (resume) {
+        cout << "Resumed from " << state_path << ", dataset not reloaded." << endl << endl;
+    } else {
+        // Read dataset file and load data
     
-    //Update this file path for your computer, and ensure it's for the correct database
-    string datasetPath = "/c/Users/Documents/Path-ORAM/tests/2^10.txt"; //update it for your file path
+        //Update this file path for your computer, and ensure it's for the correct database
+        string datasetPath = "/c/Users/Documents/Path-ORAM/tests/2^10.txt"; //update it for your file path
 
-    cout << "Loading dataset from: " << datasetPath << endl;
+        cout << "Loading dataset from: " << datasetPath << endl;
     
-    ifstream infile(datasetPath);
-    if (!infile) {
-        cerr << "ERROR: Could not open dataset file!" << endl;
-        return 1;
-    }
+        ifstream infile(datasetPath);
+        if (!infile) {
+            cerr << "ERROR: Could not open dataset file!" << endl;
+            return 1;
+        }
     
-    // Count loaded blocks for progress reporting
-    int blocks_loaded = 0;
-    int progress_interval = 100; // Show progress every 100 blocks
+        // Count loaded blocks for progress reporting
+        int blocks_loaded = 0;
+        int progress_interval = 100; // Show progress every 100 blocks
     
-    cout << "Writing blocks to ORAM... ";
-    string line;
-    while(getline(infile, line)) {
-        istringstream iss(line);
-        string id_str, data;
-        if(getline(iss, id_str, ',') && getline(iss, data)) {
-            int id = stoi(id_str);
-            data.erase(0, data.find_first_not_of(" \t"));
-            client.access(1, id, data);
+        // blocks are written a chunk at a time, the next path is read while the last one is evicted
+        const size_t load_chunk = 256;
+        vector<int64_t> chunk_ids;
+        vector<string> chunk_data;
+        cout << "Writing blocks to ORAM... ";
+        string line;
+        while(getline(infile, line)) {
+            istringstream iss(line);
+            string id_str, data;
+            if(getline(iss, id_str, ',') && getline(iss, data)) {
+                int64_t id = stoll(id_str);
+                data.erase(0, data.find_first_not_of(" \t"));
+                chunk_ids.push_back(id);
+                chunk_data.push_back(data);
             
-            blocks_loaded++;
-            if (blocks_loaded % progress_interval == 0) {
-                cout << blocks_loaded << " ";
-                cout.flush();
+                blocks_loaded++;
+                if (!bulk_load && chunk_ids.size() == load_chunk) {
+                    client.pipelined_access(1, chunk_ids, chunk_data);
+                    chunk_ids.clear();
+                    chunk_data.clear();
+                }
+                if (blocks_loaded % progress_interval == 0) {
+                    cout << blocks_loaded << " ";
+                    cout.flush();
+                }
             }
         }
+        if (bulk_load) {
+            client.bulk_load(chunk_ids, chunk_data);
+        } else {
+            client.pipelined_access(1, chunk_ids, chunk_data);
+        }
+        cout << "done." << endl;
+        cout << "Total blocks loaded: " << blocks_loaded << endl << endl;
+        infile.close();
+        if (journal_group > 0) {
+            // the journal starts from a saved state
+            client.save_state(state_path);
+        }
+    }
+    if (journal_group > 0) {
+        // a resumed client first replays the groups committed after its state
+        client.enable_journal(journal_path, journal_group);
+    }
+    for (int level = 0; level < grow_levels; level++) {
+        auto start = high_resolution_clock::now();
+        client.grow();
+        double seconds = duration_cast<duration<double>>(high_resolution_clock::now() - start).count();
+        cout << "Grew the tree to height " << config.height + level + 1 << " in " << fixed << setprecision(6) << seconds << " s" << endl;
     }
-    cout << "done." << endl;
-    cout << "Total blocks loaded: " << blocks_loaded << endl << endl;
-    infile.close();
 
     // Define the range query sizes using exponents: 2^1, 2^4, 2^10
     vector<int> exponents = {1,2,3,4,5,6,7,8,9,10};
@@ -172,6 +307,14 @@ int main() {
     }
     cout << "+---------------+---------------+---------------+---------------+" << endl;
 
+    client.flush();
+    server.print_cache_stats();
+    client.print_stash_stats();
+
+    // the next run can pick up from here with resume = true
+    client.save_state(state_path);
+    cout << "Client state saved to " << state_path << endl;
+
     cout << "\n=== All tests completed ===" << endl;
     return 0;
 }
\ No newline at end of file
@@ -9,104 +9,197 @@
 #include <string>
 #include <iomanip>
 #include <cmath>
+#include <cstring>
+#include <stdexcept>
+#include <cstdio>
+#include <unistd.h>
 using namespace std;
 
-#define bucket_char_size 16384
-
-BucketHeap::BucketHeap(int numBuckets, int bucketCapacity, const vector<unsigned char>& encKey)
-    : bucketCapacity(bucketCapacity), encryptionKey(encKey)
+BucketHeap::BucketHeap(const OramConfig& cfg, const vector<unsigned char>& encKey, StorageMode mode, IoMode io_mode, size_t cache_buckets, const string& file, TreeInit init)
+    : file_path(file), io_mode(io_mode), config(cfg), encryptionKey(encKey)
 {
-    this->file_path = "tree/oram";
-    this->tree_file.open(file_path, std::ios::in | std::ios::out | std::ios::trunc | std::ios::binary);
-
-    Bucket bucket(bucketCapacity);
-    for (int i = 0; i < numBuckets; i++) {
-        
-        // this is dumb but need to clear buckets after they have been initialized - because we are adding dummt bu
-        bucket.clear();
-        //add encrypted dummy blocks to oram buckets
-        for (int j = 0; j < bucketCapacity; j++) {
-            block dummyBlock(-1, -1, "dummy", true);
-            dummyBlock = encryptBlock(dummyBlock, encryptionKey);
-            bucket.startaddblock(dummyBlock);
+    validate_config(config);
+    this->bucket_bytes = bucket_byte_size(config);
+    this->slot_bytes = slot_size(bucket_bytes, mode);
+    int64_t numBuckets = config.num_buckets();
+    // paths are scattered over the whole file
+    this->storage.reset(open_storage(mode, file_path, (uint64_t)numBuckets * slot_bytes, init != TREE_OPEN, ACCESS_RANDOM));
+    // a path is one bucket per level
+    unsigned path_length = config.height + 1;
+    this->io.reset(open_io_engine(storage.get(), io_mode, path_length));
+    this->path_buffers.reset(new BufferPool(path_length * slot_bytes));
+    if (cache_buckets > 0 && mode != STORAGE_MMAP) {
+        // the mapping already is a cache
+        this->cache.reset(new BucketCache(cache_buckets, slot_bytes));
+    }
+
+    string bitmap_path = file_path + ".written";
+    if (init == TREE_OPEN) {
+        // a lazy tree left its bitmap next to the file, without one every bucket has to authenticate
+        if (access(bitmap_path.c_str(), F_OK) == 0) {
+            StateReader in(bitmap_path);
+            this->written.reset(new BucketBitmap(in, numBuckets));
         }
+        // a tree built with another geometry or cipher fails here, not on the first access
+        getBucket(0);
+        return;
+    }
+    if (init == TREE_LAZY) {
+        // the file is one big hole, dummies are made when a bucket is first read
+        this->written.reset(new BucketBitmap(numBuckets));
+        save_written();
+        return;
+    }
+    // a bitmap of an earlier lazy tree would make filled buckets read as holes
+    remove(bitmap_path.c_str());
 
-        tree_file << serialize_bucket(bucket);    
+    // buckets are written a chunk at a time, the padding at the end of each slot stays zero
+    const int chunk_buckets = 64;
+    AlignedBuffer chunk(chunk_buckets * slot_bytes);
+    memset(chunk.data(), 0, chunk.size());
+    for (int64_t start = 0; start < numBuckets; start += chunk_buckets) {
+        int count = (int)min<int64_t>(chunk_buckets, numBuckets - start);
+        for (int i = 0; i < count; i++) {
+            dummy_slot(chunk.data() + i * slot_bytes);
+        }
+        storage->write((uint64_t)start * slot_bytes, chunk.data(), count * slot_bytes);
     }
     //flushCache();
     //cout << "done" << endl;
 }
 
-int BucketHeap::parent(int i) { 
+// Z encrypted dummy blocks, fresh ciphertext every time, in the slot layout
+void BucketHeap::dummy_slot(char* slot) {
+    Bucket bucket(config.Z);
+    // a new bucket holds plaintext dummies, they are replaced by encrypted ones
+    bucket.clear();
+    for (int j = 0; j < config.Z; j++) {
+        block dummyBlock(-1, -1, "dummy", true);
+        dummyBlock = encryptBlock(dummyBlock, encryptionKey, config);
+        bucket.startaddblock(dummyBlock);
+    }
+    string bucket_data = serialize_bucket(bucket, config);
+    memcpy(slot, bucket_data.data(), bucket_bytes);
+    memset(slot + bucket_bytes, 0, slot_bytes - bucket_bytes);
+}
+
+int64_t BucketHeap::parent(int64_t i) { 
     return (i - 1) / 2;  
 }
 
-int BucketHeap::leftChild(int i) { 
+int64_t BucketHeap::leftChild(int64_t i) { 
     return 2 * i + 1;  
 }
 
-int BucketHeap::rightChild(int i) { 
+int64_t BucketHeap::rightChild(int64_t i) { 
     return 2 * i + 2; 
 }
 
-Bucket BucketHeap::getBucket(int index) {
-    //cout << index << endl;
-    tree_file.clear();
-    const std::streamoff offset = index * bucket_char_size;
-    tree_file.seekg(offset, std::ios::beg);
-    if (!tree_file) {
-        reopenFile();
-        if(!tree_file){
-            throw std::runtime_error("Seek failed.");
+bool BucketHeap::held_copy(int64_t index, char* slot) {
+    lock_guard<mutex> lock(held->lock);
+    unordered_map<int64_t, size_t>::iterator it = held->offsets.find(index);
+    if (it == held->offsets.end()) return false;
+    memcpy(slot, held->data.data() + it->second, slot_bytes);
+    return true;
+}
+
+// Fills out with the slots at indices (one slot_bytes slot each, in order).
+// Cached slots are copied, the rest go to the I/O engine as one batch.
+// Buckets of a lazy tree that were never written are not read at all.
+void BucketHeap::read_slots(const vector<int64_t>& indices, char* out) {
+    vector<IoRequest> requests;
+    vector<size_t> missed;
+    uint64_t epoch = cache ? cache->epoch() : 0;
+    for (size_t i = 0; i < indices.size(); i++) {
+        char* slot = out + i * slot_bytes;
+        // a held write is newer than anything in the file or the cache
+        if (held && held_copy(indices[i], slot)) continue;
+        if (written && !written->test(indices[i])) {
+            dummy_slot(slot);
+            continue;
         }
+        if (cache && cache->lookup(indices[i], slot)) continue;
+        IoRequest r = { (uint64_t)indices[i] * slot_bytes, slot, slot_bytes };
+        requests.push_back(r);
+        missed.push_back(i);
     }
-    char buffer[bucket_char_size];
-    tree_file.read(buffer, bucket_char_size);
-    //cout << "in read bucket" << endl;
-    //cout << tree_file.gcount() << endl;
-    if (tree_file.gcount() != bucket_char_size) {
-        throw std::runtime_error("Failed to read the full bucket.");
+    if (requests.empty()) return;
+    io->read_batch(requests);
+    if (cache) {
+        for (size_t i : missed) {
+            cache->fill(indices[i], out + i * slot_bytes, epoch);
+        }
     }
-    string bucket_data(buffer, bucket_char_size);
-    Bucket result = deserialize_bucket(bucket_data);
-    //flushCache();
-    //result.print_bucket();
-    return result;
 }
 
-void BucketHeap::updateBucket(int index, Bucket& bucket) {
-    Bucket bucket_to_update = decrypt_bucket(bucket, encryptionKey);
-
-    tree_file.clear();
-    const std::streamoff offset = index * bucket_char_size;
-    tree_file.seekp(offset, std::ios::beg);
-    if (!tree_file) {
-        reopenFile();
-        if(!tree_file){
-            throw std::runtime_error("Seek failed.");
+void BucketHeap::write_slots(const vector<int64_t>& indices, const char* in) {
+    if (!held) {
+        store_slots(indices, in);
+        return;
+    }
+    lock_guard<mutex> lock(held->lock);
+    for (size_t i = 0; i < indices.size(); i++) {
+        unordered_map<int64_t, size_t>::iterator it = held->offsets.find(indices[i]);
+        if (it != held->offsets.end()) {
+            memcpy(&held->data[it->second], in + i * slot_bytes, slot_bytes);
+        } else {
+            held->offsets[indices[i]] = held->data.size();
+            held->data.append(in + i * slot_bytes, slot_bytes);
         }
     }
+}
 
-    bucket_to_update = encrypt_bucket(bucket_to_update, encryptionKey);
-    std::string bucket_data = serialize_bucket(bucket);
-    //cout << bucket_data.size() << endl;
-    //if (bucket_data.size() != 16384){
-    //    cout << "bucket that is the wrong size" << endl;
-    //    bucket.print_bucket();
-    //}
-    tree_file.write(bucket_data.data(), bucket_char_size);
+// Writes the slots in `in` to indices as one batch, the cache is written through.
+void BucketHeap::store_slots(const vector<int64_t>& indices, const char* in) {
+    vector<IoRequest> requests;
+    for (size_t i = 0; i < indices.size(); i++) {
+        IoRequest r = { (uint64_t)indices[i] * slot_bytes, const_cast<char*>(in) + i * slot_bytes, slot_bytes };
+        requests.push_back(r);
+    }
+    io->write_batch(requests);
+    if (written) {
+        for (int64_t index : indices) {
+            written->mark(index);
+        }
+    }
+    if (cache) {
+        for (size_t i = 0; i < indices.size(); i++) {
+            cache->insert(indices[i], in + i * slot_bytes);
+        }
+    }
+}
 
-    if (!tree_file) {
-        throw std::runtime_error("Write failed.");
+Bucket BucketHeap::getBucket(int64_t index) {
+    //cout << index << endl;
+    const char* mapped = storage->view((uint64_t)index * slot_bytes, bucket_bytes);
+    // an unwritten bucket of a lazy tree is still a hole in the mapping, a held
+    // one is only in memory
+    if (mapped != nullptr && !held && (!written || written->test(index))) {
+        return deserialize_bucket(mapped, bucket_bytes, config);
     }
+    PooledBuffer buffer(*path_buffers);
+    read_slots(vector<int64_t>(1, index), buffer.data());
+    Bucket result = deserialize_bucket(buffer.data(), bucket_bytes, config);
+    //flushCache();
+    //result.print_bucket();
+    return result;
+}
+
+// bucket is already encrypted by the client, it is only serialized and stored
+void BucketHeap::updateBucket(int64_t index, Bucket& bucket) {
+    std::string bucket_data = serialize_bucket(bucket, config);
+    PooledBuffer buffer(*path_buffers);
+    memcpy(buffer.data(), bucket_data.data(), bucket_bytes);
+    memset(buffer.data() + bucket_bytes, 0, slot_bytes - bucket_bytes);
+    write_slots(vector<int64_t>(1, index), buffer.data());
     //flushCache();
 }
 
 
 // Returns a vector containing the path from a leaf bucket to the root.
-vector<block> BucketHeap::getPathFromLeaf(int leafIndex) {
+vector<block> BucketHeap::getPathFromLeaf(int64_t leafIndex) {
     vector<block> path;  // Vector to store blocks along the path.
-    int current = leafIndex;  // Start at the given leaf index.
+    int64_t current = leafIndex;  // Start at the given leaf index.
     while (true) {
         vector<block> blocks = getBucket(current).getBlocks();
         path.insert(path.end(), blocks.begin(), blocks.end());
@@ -117,33 +210,66 @@ vector<block> BucketHeap::getPathFromLeaf(int leafIndex) {
     return path;
 }
 
-vector<Bucket> BucketHeap::getPathBuckets(int leafIndex) {
-    vector<Bucket> path;
-    
-    int current = leafIndex;
-    while (true) {
-        path.push_back(getBucket(current));
-        if (current == 0) break;  
-        current = parent(current);
-    }
-    reverse(path.begin(), path.end());
+vector<Bucket> BucketHeap::getPathBuckets(int64_t leafIndex, int first_level) {
+    // root to leaf, minus the levels the client keeps itself
+    vector<int64_t> indices = getPathIndices(leafIndex);
+    reverse(indices.begin(), indices.end());
+    indices.erase(indices.begin(), indices.begin() + min<size_t>(first_level, indices.size()));
+    return getBuckets(indices);
+}
 
-    //very stupid, hurts performance, but needed right now
-    for(Bucket &bucket : path){
-        bucket = decrypt_bucket(bucket,encryptionKey);
+// Any set of buckets (a path, or the union of several) read as one batch.
+vector<Bucket> BucketHeap::getBuckets(const vector<int64_t>& indices) {
+    vector<Bucket> buckets;
+    if (indices.empty()) return buckets;
+    buckets.reserve(indices.size());
+    if (storage->view(0, bucket_bytes) != nullptr) {
+        // mapped tree, parse the buckets in place
+        for (int64_t index : indices) {
+            buckets.push_back(getBucket(index));
+        }
+        return buckets;
+    }
+    // a path fits one pooled buffer, bigger batches get a buffer of their own
+    PooledBuffer pooled(*path_buffers);
+    unique_ptr<AlignedBuffer> large;
+    char* data = pooled.data();
+    if (indices.size() * slot_bytes > path_buffers->buffer_size()) {
+        large.reset(new AlignedBuffer(indices.size() * slot_bytes));
+        data = large->data();
     }
+    // all buckets in flight together
+    read_slots(indices, data);
+    for (size_t i = 0; i < indices.size(); i++) {
+        buckets.push_back(deserialize_bucket(data + i * slot_bytes, bucket_bytes, config));
+    }
+    // ciphertext goes to the client as read, it does the only decrypt
+    return buckets;
+}
 
-    for (Bucket &bucket : path){
-        bucket = encrypt_bucket(bucket, encryptionKey);
+// Writes a whole path (or any set of buckets) back as one batch.
+void BucketHeap::updatePathBuckets(const vector<int64_t>& indices, vector<Bucket>& buckets) {
+    PooledBuffer pooled(*path_buffers);
+    unique_ptr<AlignedBuffer> large;
+    char* data = pooled.data();
+    if (indices.size() * slot_bytes > path_buffers->buffer_size()) {
+        large.reset(new AlignedBuffer(indices.size() * slot_bytes));
+        data = large->data();
     }
-    return path;
+    for (size_t i = 0; i < indices.size(); i++) {
+        string bucket_data = serialize_bucket(buckets[i], config);
+        char* slot = data + i * slot_bytes;
+        memcpy(slot, bucket_data.data(), bucket_bytes);
+        memset(slot + bucket_bytes, 0, slot_bytes - bucket_bytes);
+    }
+    write_slots(indices, data);
 }
 
 // Returns a vector of indices representing the path from a leaf to the root.
-vector<int> BucketHeap::getPathIndices(int leaf){
-    vector<int> path;
+vector<int64_t> BucketHeap::getPathIndices(int64_t leaf){
+    vector<int64_t> path;
     
-    int current = leaf;
+    int64_t current = leaf;
     // Build path from leaf to root
     while (current >= 0) {
         path.push_back(current);  // Add the current index to the path
@@ -155,28 +281,91 @@ vector<int> BucketHeap::getPathIndices(int leaf){
     return path;
 }
 
-void BucketHeap::clear_bucket(int index) {
-    // Reinitialize bucket with encrypted dummy blocks
-    Bucket newBucket(bucketCapacity);
-    for (int j = 0; j < bucketCapacity; j++) {
-        block dummyBlock(-1, -1, "dummy", true);
-        dummyBlock = encryptBlock(dummyBlock, encryptionKey);
-        newBucket.addBlock(dummyBlock);
+void BucketHeap :: flushCache() {
+    storage->sync();
+    // only after the buckets it marks are on disk
+    if (written) save_written();
+}
+
+void BucketHeap::grow() {
+    if (held && !held->offsets.empty()) {
+        throw runtime_error("Release the held writes before growing the tree");
+    }
+    OramConfig grown = config;
+    grown.height++;
+    validate_config(grown);
+    int64_t oldBuckets = config.num_buckets();
+    config = grown;
+    int64_t numBuckets = config.num_buckets();
+    // bucket i of level d sits at 2^d - 1 + i, the new level goes after the old leaves
+    storage->extend((uint64_t)numBuckets * slot_bytes);
+    if (written) {
+        written->resize(numBuckets);
+    } else {
+        // the new level is a hole, from now on the tree tells holes apart like a lazy one
+        written.reset(new BucketBitmap(numBuckets, oldBuckets));
+        save_written();
+    }
+    // one more bucket per path
+    unsigned path_length = config.height + 1;
+    this->io.reset(open_io_engine(storage.get(), io_mode, path_length));
+    this->path_buffers.reset(new BufferPool(path_length * slot_bytes));
+}
+
+void BucketHeap::hold_writes(bool hold) {
+    if (hold) {
+        if (!held) held.reset(new HeldWrites());
+        return;
     }
-    updateBucket(index, newBucket);
+    release_writes();
+    held.reset();
 }
 
-void BucketHeap::reopenFile() {
-    if (tree_file.is_open()) {
-        tree_file.close();
+void BucketHeap::held_writes(vector<int64_t>& indices, string& buckets) {
+    indices.clear();
+    buckets.clear();
+    if (!held) return;
+    lock_guard<mutex> lock(held->lock);
+    for (unordered_map<int64_t, size_t>::iterator it = held->offsets.begin(); it != held->offsets.end(); ++it) {
+        indices.push_back(it->first);
     }
-    tree_file.open(file_path, std::ios::in | std::ios::out | std::ios::binary);
-    if (!tree_file.is_open()) {
-        throw std::runtime_error("Failed to reopen file");
+    sort(indices.begin(), indices.end());
+    buckets.reserve(indices.size() * bucket_bytes);
+    for (int64_t index : indices) {
+        buckets.append(held->data.data() + held->offsets[index], bucket_bytes);
     }
 }
 
-void BucketHeap :: flushCache() {
-    tree_file.flush();
-    system("sync");
+// Held buckets go to the file front to back a chunk at a time. Reads keep
+// getting the held copies until all of them are written. Only the thread that
+// writes buckets releases them, so nothing is added meanwhile
+void BucketHeap::release_writes() {
+    if (!held || held->offsets.empty()) return;
+    vector<int64_t> indices;
+    {
+        lock_guard<mutex> lock(held->lock);
+        for (unordered_map<int64_t, size_t>::iterator it = held->offsets.begin(); it != held->offsets.end(); ++it) {
+            indices.push_back(it->first);
+        }
+    }
+    sort(indices.begin(), indices.end());
+    const size_t chunk_buckets = 256;
+    AlignedBuffer chunk(chunk_buckets * slot_bytes);
+    for (size_t start = 0; start < indices.size(); start += chunk_buckets) {
+        size_t count = min(chunk_buckets, indices.size() - start);
+        vector<int64_t> part(indices.begin() + start, indices.begin() + start + count);
+        for (size_t k = 0; k < count; k++) {
+            memcpy(chunk.data() + k * slot_bytes, held->data.data() + held->offsets.at(part[k]), slot_bytes);
+        }
+        store_slots(part, chunk.data());
+    }
+    lock_guard<mutex> lock(held->lock);
+    held->offsets.clear();
+    held->data.clear();
+}
+
+void BucketHeap::save_written() {
+    StateWriter out;
+    written->save(out);
+    out.commit(file_path + ".written");
 }
@@ -0,0 +1,202 @@
+#include "../include/position_map.h"
+#include "../include/client.h"
+#include "../include/server.h"
+#include "../include/oram.h"
+#include "../include/config.h"
+#include <cstring>
+#include <stdexcept>
+#include <string>
+
+using namespace std;
+
+// kind of map at the start of its saved state
+enum { SAVED_PACKED_MAP = 1, SAVED_RECURSIVE_MAP = 2 };
+
+PositionMap* load_position_map(StateReader& in, const vector<unsigned char>& encryptionKey) {
+    uint32_t kind = in.get_u32();
+    if (kind == SAVED_PACKED_MAP) return new PackedPositionMap(in);
+    if (kind == SAVED_RECURSIVE_MAP) return new RecursivePositionMap(in, encryptionKey);
+    throw runtime_error("Unknown position map in client state");
+}
+
+PackedPositionMap::PackedPositionMap(size_t entries, int bits)
+    : entries(entries), bits(bits) {
+    if (bits < 1 || bits > 63) {
+        throw runtime_error("Leaf labels must be 1 to 63 bits");
+    }
+    mask = (1ULL << bits) - 1;
+    words.assign((entries * bits + 63) / 64, 0);
+}
+
+void PackedPositionMap::check(int64_t id) const {
+    if (id < 0 || (uint64_t)id >= entries) {
+        throw runtime_error("Block id " + to_string(id) + " is outside the position map");
+    }
+}
+
+int64_t PackedPositionMap::get(int64_t id) {
+    check(id);
+    uint64_t bit = (uint64_t)id * bits;
+    size_t w = bit >> 6;
+    unsigned offset = bit & 63;
+    uint64_t value = words[w] >> offset;
+    // label runs over into the next word
+    if (offset + bits > 64) value |= words[w + 1] << (64 - offset);
+    return (int64_t)(value & mask);
+}
+
+void PackedPositionMap::set(int64_t id, int64_t leaf) {
+    check(id);
+    uint64_t bit = (uint64_t)id * bits;
+    size_t w = bit >> 6;
+    unsigned offset = bit & 63;
+    uint64_t value = (uint64_t)leaf & mask;
+    words[w] = (words[w] & ~(mask << offset)) | (value << offset);
+    if (offset + bits > 64) {
+        unsigned spill = 64 - offset;
+        words[w + 1] = (words[w + 1] & ~(mask >> spill)) | (value >> spill);
+    }
+}
+
+int64_t PackedPositionMap::exchange(int64_t id, int64_t leaf) {
+    int64_t old_leaf = get(id);
+    set(id, leaf);
+    return old_leaf;
+}
+
+void PackedPositionMap::save(StateWriter& out) {
+    out.put_u32(SAVED_PACKED_MAP);
+    out.put_u64(entries);
+    out.put_u32(bits);
+    out.put_u64(words.size());
+    out.put_bytes(words.data(), words.size() * sizeof(uint64_t));
+}
+
+// the words are copied out of the mapped state in one go
+PackedPositionMap::PackedPositionMap(StateReader& in) {
+    entries = in.get_u64();
+    bits = in.get_u32();
+    if (bits < 1 || bits > 63) {
+        throw runtime_error("Corrupt position map in client state");
+    }
+    mask = (1ULL << bits) - 1;
+    uint64_t count = in.get_u64();
+    if (count != (entries * bits + 63) / 64) {
+        throw runtime_error("Corrupt position map in client state");
+    }
+    words.resize(count);
+    memcpy(words.data(), in.get_bytes(count * sizeof(uint64_t)), count * sizeof(uint64_t));
+}
+
+void PackedPositionMap::widen(size_t new_entries, const unsigned char* coins) {
+    if (new_entries < entries) {
+        throw runtime_error("A position map can not shrink");
+    }
+    PackedPositionMap grown(new_entries, bits + 1);
+    for (size_t i = 0; i < entries; i++) {
+        int64_t coin = (coins[i >> 3] >> (i & 7)) & 1;
+        grown.set(i, (get(i) << 1) | coin);
+    }
+    entries = grown.entries;
+    bits = grown.bits;
+    mask = grown.mask;
+    words.swap(grown.words);
+}
+
+// one block of the position ORAM per labels_per_block labels
+static OramConfig position_config(size_t entries, int labels_per_block) {
+    int64_t blocks = (entries + labels_per_block - 1) / labels_per_block;
+    int height = 0;
+    while (((int64_t)1 << height) < blocks) height++;
+    // labels are stored as leaf + 1, so an all zero (never written) label means no leaf yet
+    return OramConfig(labels_per_block * sizeof(int64_t), 4, height);
+}
+
+RecursivePositionMap::RecursivePositionMap(size_t entries, const vector<unsigned char>& encryptionKey,
+                                           StorageMode mode, IoMode io_mode,
+                                           int labels_per_block, size_t packed_limit,
+                                           const string& prefix, int depth)
+    : entries(entries), labels_per_block(labels_per_block), depth(depth), prefix(prefix),
+      mode(mode), io_mode(io_mode) {
+    if (labels_per_block <= 0) {
+        throw runtime_error("labels_per_block must be positive");
+    }
+    int64_t blocks = (entries + labels_per_block - 1) / labels_per_block;
+    OramConfig config = position_config(entries, labels_per_block);
+    // label blocks are only ever written through accesses, so the tree starts out sparse
+    BucketHeap tree(config, encryptionKey, mode, io_mode, 0, prefix + to_string(depth), TREE_LAZY);
+    server.reset(new Server(config, move(tree)));
+
+    PositionMap* inner = nullptr;
+    if ((size_t)blocks > packed_limit) {
+        inner = new RecursivePositionMap(blocks, encryptionKey, mode, io_mode, labels_per_block, packed_limit, prefix, depth + 1);
+    }
+    client.reset(new Client(blocks, server.get(), encryptionKey, config, 0, inner));
+}
+
+RecursivePositionMap::RecursivePositionMap(StateReader& in, const vector<unsigned char>& encryptionKey) {
+    entries = in.get_u64();
+    labels_per_block = in.get_u32();
+    depth = in.get_u32();
+    prefix = in.get_string();
+    mode = (StorageMode)in.get_u32();
+    io_mode = (IoMode)in.get_u32();
+    if (labels_per_block <= 0) {
+        throw runtime_error("Corrupt position map in client state");
+    }
+    OramConfig config = position_config(entries, labels_per_block);
+    BucketHeap tree(config, encryptionKey, mode, io_mode, 0, prefix + to_string(depth), TREE_OPEN);
+    server.reset(new Server(config, move(tree)));
+    client.reset(new Client(in, server.get(), encryptionKey));
+}
+
+void RecursivePositionMap::save(StateWriter& out) {
+    out.put_u32(SAVED_RECURSIVE_MAP);
+    out.put_u64(entries);
+    out.put_u32(labels_per_block);
+    out.put_u32(depth);
+    out.put_string(prefix);
+    out.put_u32(mode);
+    out.put_u32(io_mode);
+    client->save_state(out);
+}
+
+RecursivePositionMap::~RecursivePositionMap() {
+    // the client points at the server, drop it first
+    client.reset();
+}
+
+int64_t RecursivePositionMap::get(int64_t id) {
+    if (id < 0 || (uint64_t)id >= entries) {
+        throw runtime_error("Block id " + to_string(id) + " is outside the position map");
+    }
+    block b = client->access(0, id / labels_per_block);
+    size_t offset = (id % labels_per_block) * sizeof(int64_t);
+    if (b.dummy || b.data.size() < offset + sizeof(int64_t)) return -1;
+    int64_t stored;
+    memcpy(&stored, b.data.data() + offset, sizeof(stored));
+    return stored - 1;
+}
+
+void RecursivePositionMap::set(int64_t id, int64_t leaf) {
+    exchange(id, leaf);
+}
+
+// one access to the position ORAM reads the old label and writes the new one
+int64_t RecursivePositionMap::exchange(int64_t id, int64_t leaf) {
+    if (id < 0 || (uint64_t)id >= entries) {
+        throw runtime_error("Block id " + to_string(id) + " is outside the position map");
+    }
+    size_t offset = (id % labels_per_block) * sizeof(int64_t);
+    size_t block_bytes = labels_per_block * sizeof(int64_t);
+    int64_t old_leaf = -1;
+    client->read_modify_write(id / labels_per_block, [&](string& data) {
+        if (data.size() < block_bytes) data.resize(block_bytes, '\0');
+        int64_t stored;
+        memcpy(&stored, &data[offset], sizeof(stored));
+        old_leaf = stored - 1;
+        stored = leaf + 1;
+        memcpy(&data[offset], &stored, sizeof(stored));
+    });
+    return old_leaf;
+}
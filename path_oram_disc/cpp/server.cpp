@@ -6,30 +6,64 @@
 #include <iostream>
 #include <cmath>
 #include <algorithm>
+#include <iomanip>
 
 using namespace std;
 
-Server::Server(int num_blocks, int bucket_size, BucketHeap initialized_tree)
-    : Z(bucket_size),
-      L(ceil(log2(num_blocks))),
-      oram(move(initialized_tree)) {}
-
-vector<Bucket> Server::give_path(int leaf) {
-    int bucket_index = leaf + ((1 << L) - 1);
-    
-    // Get the indices first
-    vector<int> pathIndices = oram.getPathIndices(bucket_index);
-    vector<Bucket> path = oram.getPathBuckets(bucket_index);
+Server::Server(const OramConfig& config, BucketHeap initialized_tree)
+    : oram(move(initialized_tree)),
+      L(config.height),
+      Z(config.Z) {}
+
+// The server only moves ciphertext. The path is not cleared here, the client
+// always writes every bucket of it back in writePath.
+vector<Bucket> Server::give_path(int64_t leaf, int first_level) {
+    int64_t bucket_index = leaf + (((int64_t)1 << L) - 1);
+    vector<Bucket> path = oram.getPathBuckets(bucket_index, first_level);
     //for (Bucket bucket: path){
     //    bucket.print_bucket();
     //}
-
-    for (int id : pathIndices) {
-        oram.clear_bucket(id);  
-    }
     return path;
 }
 
-void Server::write_bucket(Bucket& path, int bucket_index) {
+vector<Bucket> Server::give_buckets(const vector<int64_t>& bucket_indices) {
+    return oram.getBuckets(bucket_indices);
+}
+
+void Server::write_bucket(Bucket& path, int64_t bucket_index) {
     oram.updateBucket(bucket_index, path);
 }
+
+void Server::write_path(vector<Bucket>& path, const vector<int64_t>& bucket_indices) {
+    if (bucket_indices.empty()) return;
+    oram.updatePathBuckets(bucket_indices, path);
+}
+
+void Server::sync() {
+    oram.flushCache();
+}
+
+void Server::hold_writes(bool hold) {
+    oram.hold_writes(hold);
+}
+
+void Server::held_writes(vector<int64_t>& bucket_indices, string& buckets) {
+    oram.held_writes(bucket_indices, buckets);
+}
+
+void Server::release_writes() {
+    oram.release_writes();
+}
+
+void Server::grow() {
+    oram.grow();
+    L++;
+}
+
+void Server::print_cache_stats() {
+    size_t hits = oram.cache_hits();
+    size_t misses = oram.cache_misses();
+    if (hits + misses == 0) return;
+    cout << "Bucket cache: " << hits << " hits, " << misses << " misses ("
+         << fixed << setprecision(1) << 100.0 * hits / (hits + misses) << "% hit rate)" << endl;
+}
\ No newline at end of file
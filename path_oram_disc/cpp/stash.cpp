@@ -0,0 +1,129 @@
+#include "../include/stash.h"
+#include <cstdint>
+#include <iostream>
+
+using namespace std;
+
+Stash::Stash(size_t capacity, size_t payload_bytes)
+    : table_mask(0), payload_bytes(payload_bytes), peak(0), overflows(0) {
+    rebuild(capacity > 0 ? capacity : 1);
+}
+
+size_t Stash::home(int64_t id) const {
+    // fibonacci hashing, consecutive ids spread over the table and the high
+    // half is folded in so ids that differ only above bit 32 do too
+    uint64_t h = (uint64_t)id * 11400714819323198485ull;
+    return (size_t)((h ^ (h >> 32)) & table_mask);
+}
+
+size_t Stash::probe(int64_t id) const {
+    size_t i = home(id);
+    while (table[i] >= 0 && arena[table[i]].id != id) {
+        i = (i + 1) & table_mask;
+    }
+    return i;
+}
+
+// grows the arena to capacity slots and rehashes every stored block
+void Stash::rebuild(size_t capacity) {
+    size_t old_capacity = arena.size();
+    arena.resize(capacity);
+    live_pos.resize(capacity, -1);
+    for (size_t slot = capacity; slot-- > old_capacity; ) {
+        arena[slot].data.reserve(payload_bytes);
+        free_slots.push_back((int)slot);
+    }
+
+    size_t table_size = 1;
+    while (table_size < 2 * capacity) table_size <<= 1;
+    table.assign(table_size, -1);
+    table_mask = table_size - 1;
+    for (int slot : live) {
+        table[probe(arena[slot].id)] = slot;
+    }
+}
+
+void Stash::reserve(size_t capacity) {
+    if (capacity > arena.size()) rebuild(capacity);
+}
+
+block* Stash::find(int64_t id) {
+    int slot = table[probe(id)];
+    return slot >= 0 ? &arena[slot] : nullptr;
+}
+
+void Stash::insert(const block& b) {
+    if (b.dummy) return;
+    size_t i = probe(b.id);
+    if (table[i] >= 0) {
+        arena[table[i]] = b;
+        return;
+    }
+    if (free_slots.empty()) {
+        overflows++;
+        rebuild(arena.size() * 2);
+        i = probe(b.id);
+    }
+    int slot = free_slots.back();
+    free_slots.pop_back();
+    // copy assignment keeps the slot's reserved payload buffer
+    arena[slot] = b;
+    table[i] = slot;
+    live_pos[slot] = live.size();
+    live.push_back(slot);
+    if (live.size() > peak) peak = live.size();
+}
+
+bool Stash::erase(int64_t id) {
+    size_t i = probe(id);
+    int slot = table[i];
+    if (slot < 0) return false;
+
+    // swap the last live slot into this one's place
+    int moved = live.back();
+    live[live_pos[slot]] = moved;
+    live_pos[moved] = live_pos[slot];
+    live.pop_back();
+    live_pos[slot] = -1;
+    free_slots.push_back(slot);
+
+    // backward shift deletion, no tombstones
+    table[i] = -1;
+    size_t j = i;
+    while (true) {
+        j = (j + 1) & table_mask;
+        if (table[j] < 0) break;
+        size_t k = home(arena[table[j]].id);
+        // entry stays if its home is cyclically in (i, j]
+        bool stays = (i <= j) ? (i < k && k <= j) : (i < k || k <= j);
+        if (stays) continue;
+        table[i] = table[j];
+        table[j] = -1;
+        i = j;
+    }
+    return true;
+}
+
+void Stash::record_occupancy() {
+    if (histogram.size() <= live.size()) histogram.resize(live.size() + 1, 0);
+    histogram[live.size()]++;
+}
+
+void Stash::print_stats() {
+    size_t samples = 0;
+    for (size_t count : histogram) samples += count;
+    cout << "Stash: peak " << peak << " blocks, capacity " << arena.size()
+         << ", " << overflows << " overflows" << endl;
+    if (samples == 0) return;
+    // sizes left behind after eviction
+    size_t seen = 0;
+    size_t p50 = 0, p99 = 0;
+    bool have_p50 = false, have_p99 = false;
+    for (size_t s = 0; s < histogram.size(); s++) {
+        seen += histogram[s];
+        if (!have_p50 && seen * 2 >= samples) { p50 = s; have_p50 = true; }
+        if (!have_p99 && seen * 100 >= samples * 99) { p99 = s; have_p99 = true; }
+    }
+    cout << "  after eviction: median " << p50 << ", p99 " << p99
+         << ", max " << histogram.size() - 1 << " over " << samples << " accesses" << endl;
+}
@@ -0,0 +1,106 @@
+#include "../include/state_file.h"
+#include <cerrno>
+#include <cstring>
+#include <stdexcept>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+using namespace std;
+
+void StateWriter::put_bytes(const void* bytes, size_t length) {
+    data.append(static_cast<const char*>(bytes), length);
+}
+
+void StateWriter::put_string(const string& s) {
+    put_u64(s.size());
+    data.append(s);
+}
+
+void StateWriter::commit(const string& path) {
+    string tmp = path + ".tmp";
+    int fd = ::open(tmp.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0600);
+    if (fd < 0) {
+        throw runtime_error("Failed to create state file " + tmp + ": " + strerror(errno));
+    }
+    size_t done = 0;
+    while (done < data.size()) {
+        ssize_t n = ::write(fd, data.data() + done, data.size() - done);
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0) {
+            ::close(fd);
+            throw runtime_error("Failed to write state file " + tmp + ": " + strerror(errno));
+        }
+        done += n;
+    }
+    if (::fsync(fd) != 0) {
+        ::close(fd);
+        throw runtime_error("Failed to sync state file " + tmp);
+    }
+    ::close(fd);
+    if (::rename(tmp.c_str(), path.c_str()) != 0) {
+        throw runtime_error("Failed to replace state file " + path + ": " + strerror(errno));
+    }
+}
+
+StateReader::StateReader(const string& path) : path(path), fd(-1), map(nullptr), length(0), pos(0) {
+    fd = ::open(path.c_str(), O_RDONLY);
+    if (fd < 0) {
+        throw runtime_error("Failed to open state file " + path + ": " + strerror(errno));
+    }
+    struct stat st;
+    if (::fstat(fd, &st) != 0 || st.st_size == 0) {
+        ::close(fd);
+        throw runtime_error("State file " + path + " is empty");
+    }
+    length = st.st_size;
+    void* p = ::mmap(nullptr, length, PROT_READ, MAP_PRIVATE, fd, 0);
+    if (p == MAP_FAILED) {
+        ::close(fd);
+        throw runtime_error("Failed to map state file " + path + ": " + strerror(errno));
+    }
+    map = static_cast<const char*>(p);
+}
+
+StateReader::StateReader(const char* bytes, size_t length)
+    : path("buffer"), fd(-1), map(bytes), length(length), pos(0) {
+}
+
+StateReader::~StateReader() {
+    if (fd >= 0 && map != nullptr) ::munmap(const_cast<char*>(map), length);
+    if (fd >= 0) ::close(fd);
+}
+
+const char* StateReader::get_bytes(size_t count) {
+    if (count > length - pos) {
+        throw runtime_error("State file " + path + " is truncated");
+    }
+    const char* p = map + pos;
+    pos += count;
+    return p;
+}
+
+uint32_t StateReader::get_u32() {
+    uint32_t value;
+    memcpy(&value, get_bytes(sizeof(value)), sizeof(value));
+    return value;
+}
+
+uint64_t StateReader::get_u64() {
+    uint64_t value;
+    memcpy(&value, get_bytes(sizeof(value)), sizeof(value));
+    return value;
+}
+
+int64_t StateReader::get_i64() {
+    int64_t value;
+    memcpy(&value, get_bytes(sizeof(value)), sizeof(value));
+    return value;
+}
+
+string StateReader::get_string() {
+    uint64_t size = get_u64();
+    const char* p = get_bytes(size);
+    return string(p, size);
+}
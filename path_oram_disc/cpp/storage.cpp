@@ -0,0 +1,279 @@
+#include "../include/storage.h"
+#include <algorithm>
+#include <cerrno>
+#include <cstdlib>
+#include <cstring>
+#include <stdexcept>
+#include <climits>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/uio.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+using namespace std;
+
+#ifndef IOV_MAX
+#define IOV_MAX 1024
+#endif
+
+void StorageBackend::read_batch(vector<IoRequest>& requests) {
+    for (IoRequest& r : requests) {
+        read(r.offset, r.buffer, r.length);
+    }
+}
+
+void StorageBackend::write_batch(vector<IoRequest>& requests) {
+    for (IoRequest& r : requests) {
+        write(r.offset, r.buffer, r.length);
+    }
+}
+
+// a file that is already long enough (grown further in an earlier run) is left as it is
+static void extend_file(int fd, const string& path, uint64_t length) {
+    struct stat st;
+    if (::fstat(fd, &st) != 0) {
+        throw runtime_error("Failed to stat tree file " + path);
+    }
+    if ((uint64_t)st.st_size < length && ::ftruncate(fd, length) != 0) {
+        throw runtime_error("Failed to extend tree file " + path + ": " + strerror(errno));
+    }
+}
+
+size_t slot_size(size_t bucket_bytes, StorageMode mode) {
+    if (mode != STORAGE_DIRECT) return bucket_bytes;
+    return (bucket_bytes + direct_io_alignment - 1) / direct_io_alignment * direct_io_alignment;
+}
+
+FileStorage::FileStorage(const string& path, bool truncate, bool direct, uint64_t length) : path(path), direct(direct) {
+    int flags = O_RDWR | O_CREAT;
+    if (truncate) flags |= O_TRUNC;
+#ifdef O_DIRECT
+    if (direct) flags |= O_DIRECT;
+#else
+    if (direct) throw runtime_error("O_DIRECT is not supported on this platform");
+#endif
+    fd = ::open(path.c_str(), flags, 0644);
+    if (fd < 0) {
+        throw runtime_error("Failed to open tree file " + path + ": " + strerror(errno));
+    }
+    // a fresh file gets its full size as a hole, blocks are only allocated once written
+    if (truncate && length > 0 && ::ftruncate(fd, length) != 0) {
+        ::close(fd);
+        throw runtime_error("Failed to size tree file " + path);
+    }
+}
+
+void FileStorage::check_aligned(uint64_t offset, const char* buffer, size_t length) {
+    if (offset % direct_io_alignment != 0 || length % direct_io_alignment != 0 ||
+        reinterpret_cast<uintptr_t>(buffer) % direct_io_alignment != 0) {
+        throw runtime_error("Unaligned request on O_DIRECT tree file " + path);
+    }
+}
+
+FileStorage::~FileStorage() {
+    if (fd >= 0) ::close(fd);
+}
+
+void FileStorage::read(uint64_t offset, char* buffer, size_t length) {
+    if (direct) check_aligned(offset, buffer, length);
+    size_t done = 0;
+    while (done < length) {
+        ssize_t n = ::pread(fd, buffer + done, length - done, offset + done);
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0) {
+            throw runtime_error("Failed to read the full bucket.");
+        }
+        done += n;
+    }
+}
+
+void FileStorage::write(uint64_t offset, const char* buffer, size_t length) {
+    if (direct) check_aligned(offset, buffer, length);
+    size_t done = 0;
+    while (done < length) {
+        ssize_t n = ::pwrite(fd, buffer + done, length - done, offset + done);
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0) {
+            throw runtime_error("Write failed.");
+        }
+        done += n;
+    }
+}
+
+// Requests that sit back to back in the file go out as one preadv/pwritev.
+// A Path ORAM path is mostly scattered so that is about one call per bucket,
+// rORAM level ranges are contiguous so they become a single call.
+void FileStorage::vectored(vector<IoRequest>& requests, bool is_write) {
+    vector<IoRequest*> sorted;
+    for (IoRequest& r : requests) sorted.push_back(&r);
+    sort(sorted.begin(), sorted.end(), [](const IoRequest* a, const IoRequest* b) {
+        return a->offset < b->offset;
+    });
+
+    size_t i = 0;
+    while (i < sorted.size()) {
+        size_t end = i + 1;
+        while (end < sorted.size() && end - i < IOV_MAX &&
+               sorted[end]->offset == sorted[end - 1]->offset + sorted[end - 1]->length) {
+            end++;
+        }
+        if (end - i == 1) {
+            if (is_write) write(sorted[i]->offset, sorted[i]->buffer, sorted[i]->length);
+            else read(sorted[i]->offset, sorted[i]->buffer, sorted[i]->length);
+            i = end;
+            continue;
+        }
+
+        vector<struct iovec> iov(end - i);
+        size_t total = 0;
+        for (size_t k = i; k < end; k++) {
+            iov[k - i].iov_base = sorted[k]->buffer;
+            iov[k - i].iov_len = sorted[k]->length;
+            total += sorted[k]->length;
+        }
+        ssize_t n;
+        do {
+            n = is_write ? ::pwritev(fd, iov.data(), iov.size(), sorted[i]->offset)
+                         : ::preadv(fd, iov.data(), iov.size(), sorted[i]->offset);
+        } while (n < 0 && errno == EINTR);
+        if (n < 0 || (size_t)n != total) {
+            // short transfer, finish the run one request at a time
+            for (size_t k = i; k < end; k++) {
+                if (is_write) write(sorted[k]->offset, sorted[k]->buffer, sorted[k]->length);
+                else read(sorted[k]->offset, sorted[k]->buffer, sorted[k]->length);
+            }
+        }
+        i = end;
+    }
+}
+
+void FileStorage::read_batch(vector<IoRequest>& requests) {
+    vectored(requests, false);
+}
+
+void FileStorage::write_batch(vector<IoRequest>& requests) {
+    vectored(requests, true);
+}
+
+void FileStorage::sync() {
+    if (::fsync(fd) != 0) {
+        throw runtime_error("fsync failed on " + path);
+    }
+}
+
+void FileStorage::extend(uint64_t length) {
+    extend_file(fd, path, length);
+}
+
+MmapStorage::MmapStorage(const string& path, uint64_t length, bool truncate, AccessHint hint)
+    : path(path), map(nullptr), length(length), hint(hint) {
+    int flags = O_RDWR | O_CREAT;
+    if (truncate) flags |= O_TRUNC;
+    fd = ::open(path.c_str(), flags, 0644);
+    if (fd < 0) {
+        throw runtime_error("Failed to open tree file " + path + ": " + strerror(errno));
+    }
+    try {
+        // a reopened file may be longer, from a tree that grew after it was saved
+        extend_file(fd, path, length);
+        map_file();
+    } catch (...) {
+        ::close(fd);
+        throw;
+    }
+}
+
+void MmapStorage::map_file() {
+    void* p = ::mmap(nullptr, length, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    if (p == MAP_FAILED) {
+        throw runtime_error("Failed to map tree file " + path + ": " + strerror(errno));
+    }
+    map = static_cast<char*>(p);
+    // Path ORAM jumps all over the file, rORAM walks level ranges front to back
+    ::madvise(map, length, hint == ACCESS_SEQUENTIAL ? MADV_SEQUENTIAL : MADV_RANDOM);
+}
+
+MmapStorage::~MmapStorage() {
+    if (map != nullptr) ::munmap(map, length);
+    if (fd >= 0) ::close(fd);
+}
+
+void MmapStorage::check_range(uint64_t offset, size_t len) {
+    if (offset + len > length) {
+        throw runtime_error("Access past the end of the mapped tree file " + path);
+    }
+}
+
+void MmapStorage::read(uint64_t offset, char* buffer, size_t len) {
+    check_range(offset, len);
+    memcpy(buffer, map + offset, len);
+}
+
+void MmapStorage::write(uint64_t offset, const char* buffer, size_t len) {
+    check_range(offset, len);
+    memcpy(map + offset, buffer, len);
+}
+
+const char* MmapStorage::view(uint64_t offset, size_t len) {
+    check_range(offset, len);
+    return map + offset;
+}
+
+void MmapStorage::sync() {
+    if (::msync(map, length, MS_SYNC) != 0) {
+        throw runtime_error("msync failed on " + path);
+    }
+}
+
+void MmapStorage::extend(uint64_t new_length) {
+    extend_file(fd, path, new_length);
+    // the old mapping is shared, what was written through it is in the file
+    ::munmap(map, length);
+    map = nullptr;
+    length = new_length;
+    map_file();
+}
+
+StorageBackend* open_storage(StorageMode mode, const string& path, uint64_t length, bool truncate, AccessHint hint) {
+    if (mode == STORAGE_MMAP) {
+        return new MmapStorage(path, length, truncate, hint);
+    }
+    return new FileStorage(path, truncate, mode == STORAGE_DIRECT, length);
+}
+
+AlignedBuffer::AlignedBuffer(size_t length, size_t alignment) : ptr(nullptr), length(length) {
+    size_t rounded = (length + alignment - 1) / alignment * alignment;
+    void* p = nullptr;
+    if (posix_memalign(&p, alignment, rounded == 0 ? alignment : rounded) != 0) {
+        throw runtime_error("Failed to allocate aligned buffer");
+    }
+    ptr = static_cast<char*>(p);
+}
+
+AlignedBuffer::~AlignedBuffer() {
+    free(ptr);
+}
+
+BufferPool::~BufferPool() {
+    for (AlignedBuffer* buffer : free_buffers) {
+        delete buffer;
+    }
+}
+
+AlignedBuffer* BufferPool::acquire() {
+    {
+        lock_guard<mutex> lock(pool_mutex);
+        if (!free_buffers.empty()) {
+            AlignedBuffer* buffer = free_buffers.back();
+            free_buffers.pop_back();
+            return buffer;
+        }
+    }
+    return new AlignedBuffer(buffer_bytes, direct_io_alignment);
+}
+
+void BufferPool::release(AlignedBuffer* buffer) {
+    lock_guard<mutex> lock(pool_mutex);
+    free_buffers.push_back(buffer);
+}
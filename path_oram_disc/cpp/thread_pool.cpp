@@ -0,0 +1,77 @@
+#include "../include/thread_pool.h"
+#include <exception>
+#include <memory>
+
+using namespace std;
+
+ThreadPool::ThreadPool(size_t num_threads) : stopping(false) {
+    if (num_threads == 0) num_threads = 1;
+    for (size_t i = 0; i < num_threads; i++) {
+        workers.push_back(thread(&ThreadPool::worker_loop, this));
+    }
+}
+
+ThreadPool::~ThreadPool() {
+    {
+        lock_guard<mutex> lock(queue_mutex);
+        stopping = true;
+    }
+    queue_cv.notify_all();
+    for (thread& t : workers) {
+        t.join();
+    }
+}
+
+void ThreadPool::worker_loop() {
+    while (true) {
+        function<void()> task;
+        {
+            unique_lock<mutex> lock(queue_mutex);
+            queue_cv.wait(lock, [this] { return stopping || !tasks.empty(); });
+            if (tasks.empty()) return;
+            task = move(tasks.front());
+            tasks.pop_front();
+        }
+        task();
+    }
+}
+
+void ThreadPool::submit(function<void()> task) {
+    {
+        lock_guard<mutex> lock(queue_mutex);
+        tasks.push_back(move(task));
+    }
+    queue_cv.notify_one();
+}
+
+namespace {
+struct JobGroup {
+    mutex m;
+    condition_variable done_cv;
+    size_t remaining;
+    exception_ptr error;
+};
+}
+
+void ThreadPool::run_all(vector<function<void()> >& jobs) {
+    if (jobs.empty()) return;
+    shared_ptr<JobGroup> group(new JobGroup());
+    group->remaining = jobs.size();
+    for (function<void()>& job : jobs) {
+        function<void()> work = job;
+        submit([group, work]() {
+            exception_ptr error;
+            try {
+                work();
+            } catch (...) {
+                error = current_exception();
+            }
+            lock_guard<mutex> lock(group->m);
+            if (error && !group->error) group->error = error;
+            if (--group->remaining == 0) group->done_cv.notify_all();
+        });
+    }
+    unique_lock<mutex> lock(group->m);
+    group->done_cv.wait(lock, [&group] { return group->remaining == 0; });
+    if (group->error) rethrow_exception(group->error);
+}
@@ -2,18 +2,19 @@
 #define BLOCK_H
 
 #include "config.h"
+#include <cstdint>
 #include <string>
 
 using namespace std;
 
 
 struct block {
-    int leaf;
-    int id;
+    int64_t leaf;
+    int64_t id;
     string data;
     bool dummy;
 
-    block(int id = -1, int leaf = -1, const string& data = "dummy", bool dummy = true);
+    block(int64_t id = -1, int64_t leaf = -1, const string& data = "dummy", bool dummy = true);
     void print_block();
 };
 
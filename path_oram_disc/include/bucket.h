@@ -15,7 +15,7 @@ public:
     explicit Bucket(int capacity = 4);
     bool addBlock(const block& block);
     vector<block> removeAllBlocks();
-    block remove_block(int);
+    block remove_block(int64_t id);
     vector<block>& getBlocks();
     bool hasSpace();
     size_t size() const { return blocks.size(); }
@@ -0,0 +1,43 @@
+#ifndef BUCKET_BITMAP_H
+#define BUCKET_BITMAP_H
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include "state_file.h"
+
+using namespace std;
+
+// One bit per bucket of a tree file, set once the bucket has been written.
+// A lazily created tree starts out as a sparse file with every bit clear, and
+// a bucket whose bit is clear is read as Z dummies. Bits are atomic so path
+// reads and write-backs on other threads need no lock. The bits are kept in
+// <tree file>.written next to the tree, so a reopened tree still knows its holes.
+class BucketBitmap {
+private:
+    size_t entries;
+    size_t word_count;
+    unique_ptr<atomic<uint64_t>[]> words;
+
+    BucketBitmap(const BucketBitmap&);
+    BucketBitmap& operator=(const BucketBitmap&);
+public:
+    // the first `marked` buckets start out written
+    explicit BucketBitmap(size_t entries, size_t marked = 0);
+    // bits written by save, a longer saved bitmap (the tree grew after the
+    // state was saved) is cut to entries
+    BucketBitmap(StateReader& in, size_t entries);
+    size_t size() const { return entries; }
+    size_t memory_bytes() const { return word_count * sizeof(uint64_t); }
+    bool test(uint64_t index) const;
+    void mark(uint64_t index);
+    // number of buckets written so far
+    size_t count() const;
+    // grows to entries buckets, the new ones start out unwritten. Not atomic,
+    // nothing may test or mark meanwhile
+    void resize(size_t entries);
+    void save(StateWriter& out) const;
+};
+
+#endif
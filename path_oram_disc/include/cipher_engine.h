@@ -0,0 +1,65 @@
+#ifndef CIPHER_ENGINE_H
+#define CIPHER_ENGINE_H
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+#include "config.h"
+
+// from openssl/types.h, keeps OpenSSL out of this header
+typedef struct evp_cipher_ctx_st EVP_CIPHER_CTX;
+
+using namespace std;
+
+// AES-256 in GCM (authenticated) or CTR mode. A record is
+// nonce | ciphertext | tag, the ciphertext is as long as the plaintext and the
+// tag is only there for GCM. Every thread keeps its own pre-keyed EVP contexts,
+// so a record costs one IV reset instead of a context allocation and key schedule.
+// Nonces are 96 random bits, taken from a per-thread pool of random bytes so a
+// record is not a RAND_bytes call. Keys outlive the process (client.key), so no
+// nonce may depend on process state; as for any random GCM nonce, a key is good
+// for 2^32 records.
+class CipherEngine {
+private:
+    vector<unsigned char> key;
+    CipherMode mode;
+    uint64_t engine_id;
+
+    void next_nonce(unsigned char* nonce);
+    void seal(EVP_CIPHER_CTX* ctx, unsigned char* record, const unsigned char* plaintext, size_t length);
+    void open(EVP_CIPHER_CTX* ctx, const unsigned char* record, unsigned char* plaintext, size_t length);
+
+    CipherEngine(const CipherEngine&);
+    CipherEngine& operator=(const CipherEngine&);
+public:
+    // only the first 32 bytes of key are used
+    CipherEngine(const vector<unsigned char>& key, CipherMode mode = CIPHER_GCM);
+    CipherMode cipher_mode() const { return mode; }
+    size_t nonce_size() const;
+    size_t tag_size() const;
+    size_t record_size(size_t plaintext_length) const;
+
+    void encrypt(const unsigned char* plaintext, size_t length, unsigned char* record);
+    // throws if a GCM record fails authentication
+    void decrypt(const unsigned char* record, size_t length, unsigned char* plaintext);
+
+    // count records of the same plaintext length, back to back, in one call
+    void encrypt_records(const unsigned char* plaintext, size_t count, size_t length, unsigned char* records);
+    void decrypt_records(const unsigned char* records, size_t count, size_t length, unsigned char* plaintext);
+
+    // in place over a contiguous buffer of count records: seal expects each
+    // plaintext already sitting where its ciphertext goes (after the nonce),
+    // open leaves the plaintext there
+    void seal_records(unsigned char* records, size_t count, size_t length);
+    void open_records(unsigned char* records, size_t count, size_t length);
+};
+
+// nonce + plaintext + tag bytes of one record
+size_t cipher_record_size(CipherMode mode, size_t plaintext_length);
+
+// One engine per key and mode for the whole process, shared by everything using
+// that key so every thread keeps one set of keyed contexts per key.
+CipherEngine* cipher_for_key(const vector<unsigned char>& key, CipherMode mode = CIPHER_GCM);
+
+#endif
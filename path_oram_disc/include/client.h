@@ -6,8 +6,19 @@
 #include "oram.h"
 #include "server.h"
 #include "encryption.h"
-#include <map>
+#include "config.h"
+#include "journal.h"
+#include "position_map.h"
+#include "stash.h"
+#include "state_file.h"
+#include "thread_pool.h"
+#include <condition_variable>
+#include <cstdint>
+#include <exception>
+#include <future>
 #include <memory>
+#include <mutex>
+#include <functional>
 #include <random>
 #include <string>
 #include <vector>
@@ -19,22 +30,152 @@ using namespace std;
 class Client {
 private:
     vector<unsigned char> key;
-    unordered_map<int, block> stash;
-    map<int, int> position_map;
+    Stash stash;
+    unique_ptr<PositionMap> position_map;
+    OramConfig config;
     int L;
     Server* server;  
+    // top levels of the tree, kept decrypted here and never sent to the server
+    int cached_levels;
+    vector<Bucket> treetop;
+    // eviction scratch, stash ids by the deepest level they may go to on the
+    // current path, kept between accesses so eviction does not allocate
+    vector<vector<int64_t> > evict_levels;
+    vector<int64_t> evict_pool;
+    // background write back, see enable_async_eviction. Buckets whose write is
+    // still queued are kept here in the clear with the number of their write
+    unique_ptr<ThreadPool> writer;
+    mutex pending_mutex;
+    condition_variable pending_cv;
+    unordered_map<int64_t, pair<size_t, Bucket> > pending_buckets;
+    size_t pending_writes;
+    size_t max_pending_writes;
+    size_t write_count;
+    size_t waited_writes;
+    exception_ptr writer_error;
+    // reads the next path of pipelined_access
+    unique_ptr<ThreadPool> prefetcher;
+    // write-ahead log, see enable_journal. What the open group changed on the
+    // client side: remapped ids with their new leaf and rewritten treetop buckets
+    unique_ptr<Journal> journal;
+    size_t journal_group;
+    size_t journal_paths;
+    vector<pair<int64_t, int64_t> > journal_remaps;
+    vector<int64_t> journal_treetop;
+    // opened from a saved state, so the journal applies on top of it
+    bool resumed;
     
-    bool isOnPath(int blockLeaf, int bucketIndex);
-    vector<Bucket> readPath(int leaf);
-    void writePath(int leaf, vector<Bucket>& path_buckets);
+    int deepestLevel(int64_t blockLeaf, int64_t pathLeaf) const;
+    int64_t bucketIndex(int64_t leaf, int level) const;
+    // bucket indices of the levels kept on the server, root side first
+    vector<int64_t> serverPath(int64_t leaf) const;
+    vector<Bucket> readPath(int64_t leaf);
+    // puts the cached levels in front of the server part of a path
+    void addTreetop(int64_t leaf, vector<Bucket>& path_buckets);
+    // server buckets of the path that are also on the path to keep_leaf are copied
+    // to kept in the clear before they are written
+    void writePath(int64_t leaf, vector<Bucket>& path_buckets, int64_t keep_leaf = -1, unordered_map<int64_t, Bucket>* kept = nullptr);
+    // server part of a path, read on the prefetch thread
+    future<vector<Bucket> > prefetchPath(int64_t leaf);
+    // real blocks of the path into the stash
+    void stashPath(vector<Bucket>& path_buckets);
+    // finds id in the stash, moves it to new_leaf and applies modify
+    block serve(int64_t id, int64_t new_leaf, const function<void(string&)>& modify);
+    // queued plaintext of these buckets, taken before they are read from the server
+    unordered_map<int64_t, Bucket> pendingCopies(const vector<int64_t>& indices);
+    // decrypts buckets read from the server, ones with a queued write use that instead.
+    // ahead_id is remapped already (pipelined_access), ahead_leaf is the leaf it had
+    void decryptBuckets(vector<Bucket>& buckets, const vector<int64_t>& indices, unordered_map<int64_t, Bucket>& queued,
+                        int64_t ahead_id = -1, int64_t ahead_leaf = -1);
+    // encrypts and stores evicted server buckets, inline or on the writer thread
+    void writeBack(vector<Bucket>& buckets, const vector<int64_t>& indices);
+    void checkWriter();
+    void loadState(StateReader& in);
+    // new leaf for id, returns the old one
+    int64_t remap(int64_t id, int64_t new_leaf);
+    // counts evicted paths towards the open group, commits a full one
+    void journalPaths(size_t paths);
+    void replayRecord(StateReader& in);
+    // the tree is one level taller now: height, leaves and client side blocks follow it
+    void grown();
+    // blocks read back from before the tree grew come without a leaf, see deserializeBlock
+    void relabelStale(vector<Bucket>& buckets, int64_t ahead_id, int64_t ahead_leaf);
     
 public:
-    vector<int> getPath(int leaf);
-    int getRandomLeaf();
-    Client(int num_blocks, Server* server_ptr, const vector<unsigned char>& encryptionKey);
-    block access(int op, int id, const string& data = "");
-    vector<block> range_query(int start, int end);
+    vector<int64_t> getPath(int64_t leaf);
+    int64_t getRandomLeaf();
+    // cached_levels = k keeps the top k levels (2^k - 1 buckets) in client memory,
+    // config must be the one the server's tree was built with. The client takes
+    // position_map over, without one every block gets a random leaf in a packed map
+    Client(int64_t num_blocks, Server* server_ptr, const vector<unsigned char>& encryptionKey,
+           const OramConfig& config, int cached_levels = 0, PositionMap* position_map = nullptr);
+    // Picks up where save_state left off, the server's tree has to be the one the
+    // state was saved against (opened with TREE_OPEN) and the key the same. Only
+    // client state is read, so this takes time in the size of the stash and map
+    Client(const string& state_path, Server* server_ptr, const vector<unsigned char>& encryptionKey);
+    Client(StateReader& state, Server* server_ptr, const vector<unsigned char>& encryptionKey);
+    ~Client();
+    // geometry a state was saved with, to open the tree that belongs to it
+    static OramConfig saved_config(const string& state_path);
+    // Accesses return once the block is served and evicted from the stash, the
+    // encryption and write of the path happen on a background thread. At most
+    // max_pending paths wait to be written, past that an access waits for the
+    // oldest write, which is the synchronous behaviour again
+    void enable_async_eviction(size_t max_pending = 4);
+    // waits until every queued write is on the server
+    void flush();
+    // Logs every access to a write-ahead journal at path. Evicted buckets are
+    // held back from the tree file until the group they belong to is in the
+    // journal, a group being group_paths evicted paths with one fdatasync, and
+    // a crash loses at most the open group. The journal only holds what came
+    // after the last save_state: a client opened from a state replays it, a new
+    // client empties it (save the state first). Needs the packed position map
+    void enable_journal(const string& path, size_t group_paths = 16);
+    // ends the open group, every access so far survives a crash
+    void commit();
+    block access(int op, int64_t id, const string& data = "");
+    // one access that hands the block's data to modify before it is evicted again,
+    // a missing block starts out empty. Returns the block as it was before
+    block read_modify_write(int64_t id, const function<void(string&)>& modify);
+    // reads (op = 0) or writes (op = 1, data[i] goes to ids[i]) a whole batch with one
+    // read of the union of their paths and one eviction over all of them. One result
+    // per id, as from access. Every id costs one path, a repeated one a random path,
+    // so only the batch size shows
+    vector<block> batch_access(int op, const vector<int64_t>& ids, const vector<string>& data = vector<string>());
+    // the batch underneath batch_access: modify(i, b) gets ids[i]'s block already
+    // on its new leaf (a dummy if it does not exist yet, kept only if modify clears
+    // dummy) and runs before the eviction. dummy_paths more random paths are read
+    // and evicted with the batch so batches can be padded to a fixed size
+    void batch_apply(const vector<int64_t>& ids, const function<void(size_t, block&)>& modify, int dummy_paths = 0);
+    // ids start..end, batch_size blocks per batch_access
+    vector<block> range_query(int64_t start, int64_t end, int batch_size = 256);
+    // the accesses of batch_access, but done one after another exactly like access.
+    // The path of access i + 1 is read while access i is decrypted, served and
+    // evicted, so the disk always has a read in flight
+    vector<block> pipelined_access(int op, const vector<int64_t>& ids, const vector<string>& data = vector<string>());
+    // Builds the whole tree from these blocks instead of one access per block.
+    // Every block gets a random leaf and goes to the deepest bucket on its path
+    // with room, whatever does not fit starts out in the stash. The tree is then
+    // encrypted and written front to back, level after level, in large chunks.
+    // Replaces everything the tree and stash held before, a repeated id keeps its last data
+    void bulk_load(const vector<int64_t>& ids, const vector<string>& data);
+    // Grows the tree online by one level, doubling the leaves and the ids the
+    // position map holds. Every leaf label gets a random bit appended, which
+    // names a leaf under the old one, so no block has to move: the new level
+    // starts out empty and blocks sink into it as their paths are evicted.
+    // A block still in the tree with a label of the smaller tree takes its new
+    // label from the map when its path is read. Takes time in the size of the
+    // map, not the tree. Needs the packed position map, with a journal the
+    // growth is logged like a group
+    void grow();
+    // Writes the tree geometry, a fingerprint of the key (not the key), the
+    // cached levels, the stash and the position map. Queued writes are flushed
+    // and the tree synced first, the journal is emptied after. Treetop and stash are stored in the clear, the
+    // file belongs on the client like the key. Call it between accesses
+    void save_state(const string& path);
+    void save_state(StateWriter& out);
     void print_stash();
+    void print_stash_stats();
 };
 
 #endif
\ No newline at end of file
@@ -1,7 +1,39 @@
 #ifndef CONFIG_H
 #define CONFIG_H
 
-const int bucket_size = 4;
-const int block_size = 2;
+#include <cstddef>
+#include <cstdint>
 
-#endif
\ No newline at end of file
+// binary header in front of every block's payload
+// (64-bit id and leaf, 32-bit flags and payload length)
+const int block_header_size = 24;
+
+// on disk every bucket is a small header followed by Z raw nonce+ciphertext(+tag) records
+const unsigned char bucket_format_version = 4;
+const int bucket_header_size = 4;
+
+// version of the file written by Client::save_state
+const uint32_t client_state_version = 2;
+
+// stash slots on top of one full path, using more than that counts as an overflow
+const int default_stash_blocks = 128;
+
+// AES-256-GCM authenticates every block, AES-256-CTR only encrypts it
+enum CipherMode { CIPHER_GCM = 1, CIPHER_CTR = 2 };
+
+// Geometry of the ORAM, picked at runtime. Block and bucket serialization and
+// all tree file offsets are derived from it.
+struct OramConfig {
+    int block_data_size;    // payload bytes per block
+    int Z;                  // blocks per bucket
+    int height;             // leaves sit at depth height, 2^(height+1) - 1 buckets (at most 62)
+    CipherMode cipher;
+
+    OramConfig(int block_data_size = 2000, int Z = 4, int height = 10, CipherMode cipher = CIPHER_GCM)
+        : block_data_size(block_data_size), Z(Z), height(height), cipher(cipher) {}
+    size_t block_plaintext_size() const { return block_header_size + block_data_size; }
+    int64_t num_leaves() const { return (int64_t)1 << height; }
+    int64_t num_buckets() const { return ((int64_t)1 << (height + 1)) - 1; }
+};
+
+#endif
@@ -24,16 +24,27 @@ vector<unsigned char> decryptData(
 
 string hexEncode(const vector<unsigned char>& data);
 vector<unsigned char> hexDecode(const string &hex);
-string serializeBlock(const block &b);
-block deserializeBlock(const string &s);
+// fixed binary layout, out/in hold config.block_plaintext_size() bytes
+void serializeBlock(const block &b, char* out, const OramConfig& config);
+block deserializeBlock(const char* in, const OramConfig& config);
 
-string serialize_bucket(Bucket bucket);
-Bucket deserialize_bucket(string read_string);
+size_t encrypted_block_size(const OramConfig& config);
+size_t bucket_byte_size(const OramConfig& config);
+// throws if the geometry can not be stored
+void validate_config(const OramConfig& config);
 
-block encryptBlock(block &b, const vector<unsigned char>& key);
-block decryptBlock(const block &b, const vector<unsigned char>& key);
+string serialize_bucket(Bucket bucket, const OramConfig& config);
+Bucket deserialize_bucket(string read_string, const OramConfig& config);
+Bucket deserialize_bucket(const char* data, size_t length, const OramConfig& config);
 
-Bucket encrypt_bucket(Bucket bucket_to_encrypt, const vector<unsigned char>& key);
-Bucket decrypt_bucket(Bucket bucket_to_encrypt, const vector<unsigned char>& key);
+block encryptBlock(block &b, const vector<unsigned char>& key, const OramConfig& config);
+block decryptBlock(const block &b, const vector<unsigned char>& key, const OramConfig& config);
+
+Bucket encrypt_bucket(Bucket bucket_to_encrypt, const vector<unsigned char>& key, const OramConfig& config);
+Bucket decrypt_bucket(Bucket bucket_to_encrypt, const vector<unsigned char>& key, const OramConfig& config);
+
+// every block of every bucket in one contiguous buffer, encrypted/decrypted in place in one pass
+void encrypt_path(vector<Bucket>& path, const vector<unsigned char>& key, const OramConfig& config);
+void decrypt_path(vector<Bucket>& path, const vector<unsigned char>& key, const OramConfig& config);
 
 #endif
\ No newline at end of file
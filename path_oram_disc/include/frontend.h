@@ -0,0 +1,67 @@
+#ifndef FRONTEND_H
+#define FRONTEND_H
+
+#include "block.h"
+#include "client.h"
+#include <condition_variable>
+#include <cstdint>
+#include <deque>
+#include <future>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+using namespace std;
+
+// Thread safe front end for one Client. Any number of threads submit requests,
+// one scheduler thread takes up to batch_size distinct ids off the queue at a
+// time, merges the requests for the same id into one ORAM access and runs them
+// as one batch_apply, so their paths are read in parallel as one I/O batch.
+// Every batch is padded with random paths to batch_size paths, the server sees
+// the same batches no matter how many requests (or repeats of an id) came in.
+// A request completes as soon as its block is served from the stash, the
+// eviction then runs on the scheduler thread behind the caller's back. One
+// batch is in flight at a time and the next one waits for that eviction, only
+// the encryption and write of the evicted paths can go to the client's writer
+// thread (Client::enable_async_eviction).
+class OramFrontend {
+private:
+    struct Request {
+        int op;
+        int64_t id;
+        string data;
+        promise<block> result;
+        bool answered;
+    };
+
+    Client* client;
+    size_t batch_size;
+    deque<unique_ptr<Request> > queue;
+    mutex queue_mutex;
+    condition_variable queue_cv;
+    bool stopping;
+    size_t batch_count;
+    size_t request_count;
+    size_t merged_count;
+    thread scheduler;
+
+    void scheduler_loop();
+
+    OramFrontend(const OramFrontend&);
+    OramFrontend& operator=(const OramFrontend&);
+public:
+    // the client must not be used directly while the front end is running
+    OramFrontend(Client* client, size_t batch_size = 16);
+    // serves whatever is still queued, then stops the scheduler
+    ~OramFrontend();
+    // op = 1 for write, op = 0 for read. Requests for the same id are applied in
+    // the order they were submitted, a read gets the block as of its turn and a
+    // write gets the block as written
+    future<block> submit(int op, int64_t id, const string& data = "");
+    block access(int op, int64_t id, const string& data = "");
+    void print_stats();
+};
+
+#endif
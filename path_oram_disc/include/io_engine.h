@@ -0,0 +1,92 @@
+#ifndef IO_ENGINE_H
+#define IO_ENGINE_H
+
+#include <memory>
+#include <mutex>
+#include <vector>
+#include "storage.h"
+#include "thread_pool.h"
+
+using namespace std;
+
+// IO_SYNC hands batches straight to the storage backend, IO_ASYNC puts every
+// bucket of a batch in flight at once (io_uring, thread pool if that is unavailable).
+enum IoMode { IO_SYNC, IO_ASYNC };
+
+// Runs a whole batch of bucket reads or writes and returns when all are done.
+class IoEngine {
+public:
+    virtual ~IoEngine() {}
+    virtual void read_batch(vector<IoRequest>& requests) = 0;
+    virtual void write_batch(vector<IoRequest>& requests) = 0;
+    virtual const char* name() const = 0;
+};
+
+class SyncIoEngine : public IoEngine {
+private:
+    StorageBackend* storage;
+public:
+    explicit SyncIoEngine(StorageBackend* storage) : storage(storage) {}
+    void read_batch(vector<IoRequest>& requests) { storage->read_batch(requests); }
+    void write_batch(vector<IoRequest>& requests) { storage->write_batch(requests); }
+    const char* name() const { return "sync"; }
+};
+
+// One bucket per task, spread over a small pool of threads.
+class ThreadPoolIoEngine : public IoEngine {
+private:
+    StorageBackend* storage;
+    ThreadPool pool;
+
+    void run(vector<IoRequest>& requests, bool is_write);
+public:
+    ThreadPoolIoEngine(StorageBackend* storage, size_t num_threads);
+    void read_batch(vector<IoRequest>& requests) { run(requests, false); }
+    void write_batch(vector<IoRequest>& requests) { run(requests, true); }
+    const char* name() const { return "thread pool"; }
+};
+
+// io_uring through the raw syscalls, one submission for the whole batch.
+// There is one ring, batches from different threads take turns on it.
+class UringIoEngine : public IoEngine {
+private:
+    int ring_fd;
+    int file_fd;
+    StorageBackend* storage;
+    unsigned entries;
+
+    void* sq_ring;
+    void* cq_ring;
+    void* sqes;
+    size_t sq_ring_size;
+    size_t cq_ring_size;
+    size_t sqes_size;
+
+    unsigned* sq_head;
+    unsigned* sq_tail;
+    unsigned* sq_mask;
+    unsigned* sq_array;
+    unsigned* cq_head;
+    unsigned* cq_tail;
+    unsigned* cq_mask;
+    void* cqes;
+    mutex ring_mutex;
+
+    void run(vector<IoRequest>& requests, bool is_write);
+    void teardown();
+
+    UringIoEngine(const UringIoEngine&);
+    UringIoEngine& operator=(const UringIoEngine&);
+public:
+    UringIoEngine(StorageBackend* storage, unsigned queue_depth);
+    ~UringIoEngine();
+    void read_batch(vector<IoRequest>& requests) { run(requests, false); }
+    void write_batch(vector<IoRequest>& requests) { run(requests, true); }
+    const char* name() const { return "io_uring"; }
+};
+
+// Picks the engine for a backend. Mapped trees have nothing to wait on, so they
+// always get the sync engine.
+IoEngine* open_io_engine(StorageBackend* storage, IoMode mode, unsigned queue_depth);
+
+#endif
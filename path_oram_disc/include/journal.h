@@ -0,0 +1,43 @@
+#ifndef JOURNAL_H
+#define JOURNAL_H
+
+#include <cstddef>
+#include <cstdint>
+#include <functional>
+#include <string>
+#include "state_file.h"
+
+using namespace std;
+
+// Write-ahead log kept next to the client state. Every record is one group
+// commit: what the group changed, built in a StateWriter, behind a small header
+// (magic, sequence number, length, checksum). A record is appended at the end
+// and made durable with a single fdatasync, so a group costs one sequential
+// write and one sync however many buckets it covers. A record cut short by a
+// crash fails its checksum and ends the replay.
+class Journal {
+private:
+    string path;
+    int fd;
+    uint64_t end;           // where the next record goes
+    uint64_t sequence;      // of the next record
+    size_t records;
+
+    Journal(const Journal&);
+    Journal& operator=(const Journal&);
+public:
+    // opens path, creating it if needed, the records in it are kept for replay
+    explicit Journal(const string& path);
+    ~Journal();
+    // appends one record and syncs the log
+    void append(const StateWriter& record);
+    // hands every complete record to apply in order, apply has to read all of it.
+    // Whatever follows the last complete record is cut off. Returns the count
+    size_t replay(const function<void(StateReader&)>& apply);
+    // drops every record, once what they hold is in a checkpoint
+    void reset();
+    uint64_t size() const { return end; }
+    size_t record_count() const { return records; }
+};
+
+#endif
@@ -1,40 +1,109 @@
 #ifndef BUCKET_HEAP_H
 #define BUCKET_HEAP_H
 
+#include <cstdint>
 #include <vector>
-#include <fstream>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <unordered_map>
 #include "bucket.h"
 #include "block.h"
+#include "storage.h"
+#include "io_engine.h"
+#include "bucket_cache.h"
+#include "bucket_bitmap.h"
+#include "config.h"
 
 using namespace std;
 
+// How a tree file is set up when it is opened. TREE_FILL writes Z encrypted
+// dummies into every bucket, TREE_LAZY creates the file sparse and makes the
+// dummies when an unwritten bucket is read, TREE_OPEN keeps the file of an
+// earlier run as it is. Only a lazy tree (one with a <file>.written bitmap)
+// has holes, in any other tree a zeroed bucket fails to authenticate.
+enum TreeInit { TREE_FILL, TREE_LAZY, TREE_OPEN };
+
+// bucket writes kept back from the tree file, see BucketHeap::hold_writes
+struct HeldWrites {
+    mutex lock;
+    unordered_map<int64_t, size_t> offsets;     // bucket index to its slot in data
+    string data;
+};
+
 class BucketHeap {
 private:
-    fstream tree_file;
+    unique_ptr<StorageBackend> storage;
+    unique_ptr<IoEngine> io;
     string file_path;
-    int bucketCapacity;
+    IoMode io_mode;
+    OramConfig config;
+    size_t bucket_bytes;
+    size_t slot_bytes;      // bucket_bytes rounded up to 4 KiB with O_DIRECT
     vector<unsigned char> encryptionKey;
+    unique_ptr<BucketCache> cache;
+    unique_ptr<BufferPool> path_buffers;
+    // buckets written so far, only for a lazily created or grown tree
+    unique_ptr<BucketBitmap> written;
+    unique_ptr<HeldWrites> held;
     
-    int parent(int i);
-    int leftChild(int i);
-    int rightChild(int i);
+    void dummy_slot(char* slot);
+    // commits the bitmap to <file_path>.written
+    void save_written();
+    // copies a held bucket into slot, false if it is not held
+    bool held_copy(int64_t index, char* slot);
+    void read_slots(const vector<int64_t>& indices, char* out);
+    void write_slots(const vector<int64_t>& indices, const char* in);
+    // write_slots straight to the file
+    void store_slots(const vector<int64_t>& indices, const char* in);
+    int64_t parent(int64_t i);
+    int64_t leftChild(int64_t i);
+    int64_t rightChild(int64_t i);
 public:
-    BucketHeap(int numBuckets, int bucketCapacity, const vector<unsigned char>& encryptionKey);
+    // tree/oram is opened with the chosen backend (pread/pwrite file, O_DIRECT file or mmap),
+    // path reads and writes go through the chosen I/O engine. cache_buckets > 0 keeps
+    // that many recently used buckets in memory, not used for mmap. The bucket count,
+    // slot size and block layout all come from config. A bucket the bitmap of a
+    // lazy tree has as never written reads as Z freshly encrypted dummies.
+    // TREE_OPEN needs the config the file was built with
+    BucketHeap(const OramConfig& config, const vector<unsigned char>& encryptionKey,
+               StorageMode mode = STORAGE_FILE, IoMode io_mode = IO_ASYNC, size_t cache_buckets = 0,
+               const string& file_path = "tree/oram", TreeInit init = TREE_FILL);
     void addBucket(const Bucket& bucket);
     Bucket removeBucket();
-    Bucket getBucket(int index);
-    void updateBucket(int index, Bucket& bucket);
-    bool addBlockToBucket(int bucketIndex, const block& b);
+    Bucket getBucket(int64_t index);
+    void updateBucket(int64_t index, Bucket& bucket);
+    bool addBlockToBucket(int64_t bucketIndex, const block& b);
     void printHeap();
     size_t size() const;
     bool empty() const;
-    vector<block> getPathFromLeaf(int leafIndex);
-    vector<int> getPathIndices(int leaf);
-    vector<Bucket> getPathBuckets(int leafIndex);
-    void clear_bucket(int index);
+    vector<block> getPathFromLeaf(int64_t leafIndex);
+    vector<int64_t> getPathIndices(int64_t leaf);
+    // buckets root to leaf, starting at first_level
+    vector<Bucket> getPathBuckets(int64_t leafIndex, int first_level = 0);
+    vector<Bucket> getBuckets(const vector<int64_t>& indices);
+    void updatePathBuckets(const vector<int64_t>& indices, vector<Bucket>& buckets);
 
-    void reopenFile();
+    // syncs the file, then saves the bitmap of a lazy tree
     void flushCache();
+    // While writes are held every written bucket stays in memory, where reads
+    // find it, until release_writes puts them all in the file. A journal makes
+    // them durable in between, so the file never has half of a group
+    void hold_writes(bool hold);
+    // the held buckets in index order, bucket_size() bytes each back to back
+    void held_writes(vector<int64_t>& indices, string& buckets);
+    void release_writes();
+    // Adds a leaf level under the current one, 2^(height+1) buckets at the end
+    // of the file, so every bucket keeps its index and nothing is copied. The
+    // new level is a hole in the file and reads as dummies until written, a
+    // filled tree gets a bitmap for it. No access may run meanwhile and no
+    // writes may be held
+    void grow();
+    size_t bucket_size() const { return bucket_bytes; }
+    size_t cache_hits() const { return cache ? cache->hits() : 0; }
+    size_t cache_misses() const { return cache ? cache->misses() : 0; }
+    bool lazy() const { return written != nullptr; }
+    size_t written_buckets() const { return written ? written->count() : (size_t)config.num_buckets(); }
 };
 
 #endif
\ No newline at end of file
@@ -0,0 +1,93 @@
+#ifndef POSITION_MAP_H
+#define POSITION_MAP_H
+
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <string>
+#include <vector>
+#include "storage.h"
+#include "io_engine.h"
+#include "state_file.h"
+
+using namespace std;
+
+class Server;
+class Client;
+
+// Current leaf of every block id 0 .. size() - 1.
+class PositionMap {
+public:
+    virtual ~PositionMap() {}
+    virtual size_t size() const = 0;
+    // -1 if the id was never given a leaf (recursive map only, the packed map
+    // has no spare label for it and every id starts out at leaf 0)
+    virtual int64_t get(int64_t id) = 0;
+    virtual void set(int64_t id, int64_t leaf) = 0;
+    // stores the new leaf and returns the old one in a single lookup
+    virtual int64_t exchange(int64_t id, int64_t leaf) = 0;
+    // appends the map to a client state file
+    virtual void save(StateWriter& out) = 0;
+};
+
+// reads back a map written by save
+PositionMap* load_position_map(StateReader& in, const vector<unsigned char>& encryptionKey);
+
+// Leaf labels packed back to back in one flat array, `bits` bits per block
+// (the tree height), so a map of N blocks takes N * L / 8 bytes. Every id
+// starts out at leaf 0, never at -1, the client gives each one a random leaf
+// before its first access.
+class PackedPositionMap : public PositionMap {
+private:
+    size_t entries;
+    int bits;
+    uint64_t mask;
+    vector<uint64_t> words;
+
+    void check(int64_t id) const;
+public:
+    PackedPositionMap(size_t entries, int bits);
+    explicit PackedPositionMap(StateReader& in);
+    size_t size() const { return entries; }
+    size_t memory_bytes() const { return words.size() * sizeof(uint64_t); }
+    int64_t get(int64_t id);
+    void set(int64_t id, int64_t leaf);
+    int64_t exchange(int64_t id, int64_t leaf);
+    void save(StateWriter& out);
+    // One more bit per label, for a tree grown by a level: the label of id i
+    // becomes label * 2 + bit i of coins (one bit per current id). The map then
+    // holds `entries` ids, the added ones at leaf 0
+    void widen(size_t entries, const unsigned char* coins);
+};
+
+// Position map stored in its own smaller Path ORAM (<prefix><depth>). Every
+// block of that ORAM holds labels_per_block leaf labels, and its position map is
+// recursive again until at most packed_limit blocks are left, which are packed
+// in memory. Client memory is then the last small map plus one stash per level.
+class RecursivePositionMap : public PositionMap {
+private:
+    size_t entries;
+    int labels_per_block;
+    int depth;
+    string prefix;
+    StorageMode mode;
+    IoMode io_mode;
+    unique_ptr<Server> server;
+    unique_ptr<Client> client;
+public:
+    RecursivePositionMap(size_t entries, const vector<unsigned char>& encryptionKey,
+                         StorageMode mode = STORAGE_FILE, IoMode io_mode = IO_ASYNC,
+                         int labels_per_block = 64, size_t packed_limit = 1 << 16,
+                         const string& prefix = "tree/posmap", int depth = 1);
+    // reopens <prefix><depth> as it was when the map was saved
+    RecursivePositionMap(StateReader& in, const vector<unsigned char>& encryptionKey);
+    ~RecursivePositionMap();
+    size_t size() const { return entries; }
+    int64_t get(int64_t id);
+    void set(int64_t id, int64_t leaf);
+    int64_t exchange(int64_t id, int64_t leaf);
+    // the client of the position ORAM saves its own stash and map after this
+    void save(StateWriter& out);
+};
+
+#endif
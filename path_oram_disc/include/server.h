@@ -3,6 +3,9 @@
 
 #include "bucket.h"
 #include "oram.h"
+#include "config.h"
+#include <cstdint>
+#include <string>
 #include <vector>
 
 using namespace std;
@@ -13,10 +16,23 @@ private:
     int L;
     int Z;
 public:
-    Server(int num_blocks, int bucket_size, BucketHeap initialized_tree);
-    vector<Bucket> give_path(int leaf);
-    void write_bucket( Bucket& path, int bucket_index);
+    Server(const OramConfig& config, BucketHeap initialized_tree);
+    // path buckets root to leaf, levels above first_level stay with the client
+    vector<Bucket> give_path(int64_t leaf, int first_level = 0);
+    // any set of buckets by index, e.g. the union of several paths
+    vector<Bucket> give_buckets(const vector<int64_t>& bucket_indices);
+    void write_bucket( Bucket& path, int64_t bucket_index);
+    void write_path(vector<Bucket>& path, const vector<int64_t>& bucket_indices);
+    // everything written so far is on disk when this returns
+    void sync();
+    // see BucketHeap::hold_writes
+    void hold_writes(bool hold);
+    void held_writes(vector<int64_t>& bucket_indices, string& buckets);
+    void release_writes();
+    // see BucketHeap::grow, leaves are numbered for the taller tree after it
+    void grow();
     void printHeap();
+    void print_cache_stats();
 };
 
 #endif 
\ No newline at end of file
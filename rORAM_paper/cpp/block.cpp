@@ -7,14 +7,14 @@
 
 using namespace std;
 
-block::block(int id, const string& data, bool dummy, const vector<int>& paths) {
+block::block(int64_t id, const string& data, bool dummy, const vector<int64_t>& paths) {
     this->id = id;
     this->data = data;
     this->dummy = dummy;
     this->paths = paths;
 }
 
-block::block() : id(-1), data(""), dummy(true), paths(vector<int>()) {}
+block::block() : id(-1), data(""), dummy(true), paths(vector<int64_t>()) {}
 
 void block::print_block() {
     cout << "Block ID: " << id;
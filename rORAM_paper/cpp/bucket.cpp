@@ -45,7 +45,7 @@ vector<block> Bucket::removeAllBlocks() {
     return removed;
 }
 
-block Bucket::remove_block(int id) {
+block Bucket::remove_block(int64_t id) {
     for (int i = 0; i < blocks.size(); i++) {
         if (blocks[i].id == id) {
             block removed = blocks[i];
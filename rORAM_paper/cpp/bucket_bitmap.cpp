@@ -0,0 +1,78 @@
+#include "../include/bucket_bitmap.h"
+#include <cstring>
+#include <stdexcept>
+#include <string>
+
+using namespace std;
+
+BucketBitmap::BucketBitmap(size_t entries, size_t marked)
+    : entries(entries), word_count((entries + 63) / 64), words(new atomic<uint64_t>[(entries + 63) / 64]) {
+    if (marked > entries) {
+        throw runtime_error("More written buckets than the bitmap holds");
+    }
+    for (size_t w = 0; w < word_count; w++) {
+        uint64_t value = 0;
+        if ((w + 1) * 64 <= marked) value = ~0ULL;
+        else if (w * 64 < marked) value = (1ULL << (marked & 63)) - 1;
+        words[w].store(value, memory_order_relaxed);
+    }
+}
+
+BucketBitmap::BucketBitmap(StateReader& in, size_t entries)
+    : entries(entries), word_count((entries + 63) / 64), words(new atomic<uint64_t>[(entries + 63) / 64]) {
+    uint64_t saved = in.get_u64();
+    if (saved < entries) {
+        throw runtime_error("Bucket bitmap is smaller than its tree");
+    }
+    const char* bytes = in.get_bytes((saved + 63) / 64 * sizeof(uint64_t));
+    for (size_t w = 0; w < word_count; w++) {
+        uint64_t value;
+        memcpy(&value, bytes + w * sizeof(uint64_t), sizeof(value));
+        // bits of a level the tree does not have yet stay clear
+        if ((w + 1) * 64 > entries) value &= (1ULL << (entries & 63)) - 1;
+        words[w].store(value, memory_order_relaxed);
+    }
+}
+
+bool BucketBitmap::test(uint64_t index) const {
+    if (index >= entries) {
+        throw runtime_error("Bucket " + to_string(index) + " is outside the bitmap");
+    }
+    return (words[index >> 6].load(memory_order_acquire) >> (index & 63)) & 1;
+}
+
+void BucketBitmap::mark(uint64_t index) {
+    if (index >= entries) {
+        throw runtime_error("Bucket " + to_string(index) + " is outside the bitmap");
+    }
+    words[index >> 6].fetch_or(1ULL << (index & 63), memory_order_release);
+}
+
+size_t BucketBitmap::count() const {
+    size_t total = 0;
+    for (size_t w = 0; w < word_count; w++) {
+        total += __builtin_popcountll(words[w].load(memory_order_relaxed));
+    }
+    return total;
+}
+
+void BucketBitmap::resize(size_t new_entries) {
+    if (new_entries < entries) {
+        throw runtime_error("A bucket bitmap only grows");
+    }
+    size_t new_words = (new_entries + 63) / 64;
+    unique_ptr<atomic<uint64_t>[]> grown(new atomic<uint64_t>[new_words]);
+    for (size_t w = 0; w < new_words; w++) {
+        grown[w].store(w < word_count ? words[w].load(memory_order_relaxed) : 0, memory_order_relaxed);
+    }
+    words.swap(grown);
+    entries = new_entries;
+    word_count = new_words;
+}
+
+void BucketBitmap::save(StateWriter& out) const {
+    out.put_u64(entries);
+    for (size_t w = 0; w < word_count; w++) {
+        out.put_u64(words[w].load(memory_order_acquire));
+    }
+}
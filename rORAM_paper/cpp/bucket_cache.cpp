@@ -0,0 +1,66 @@
+#include "../include/bucket_cache.h"
+#include <cstring>
+
+using namespace std;
+
+BucketCache::BucketCache(size_t capacity, size_t slot_bytes)
+    : capacity(capacity), slot_bytes(slot_bytes), arena(capacity * slot_bytes, direct_io_alignment),
+      lru_pos(capacity), slot_owner(capacity), hit_count(0), miss_count(0), write_count(0) {
+    slots.reserve(capacity);
+}
+
+bool BucketCache::lookup(uint64_t index, char* out) {
+    lock_guard<mutex> lock(cache_mutex);
+    unordered_map<uint64_t, size_t>::iterator it = slots.find(index);
+    if (it == slots.end()) {
+        miss_count++;
+        return false;
+    }
+    size_t slot = it->second;
+    memcpy(out, arena.data() + slot * slot_bytes, slot_bytes);
+    lru.splice(lru.begin(), lru, lru_pos[slot]);
+    hit_count++;
+    return true;
+}
+
+// write-through: callers insert every slot they write so the cache never goes stale
+void BucketCache::insert(uint64_t index, const char* data) {
+    if (capacity == 0) return;
+    lock_guard<mutex> lock(cache_mutex);
+    write_count++;
+    store(index, data);
+}
+
+uint64_t BucketCache::epoch() {
+    lock_guard<mutex> lock(cache_mutex);
+    return write_count;
+}
+
+void BucketCache::fill(uint64_t index, const char* data, uint64_t seen_epoch) {
+    if (capacity == 0) return;
+    lock_guard<mutex> lock(cache_mutex);
+    if (write_count != seen_epoch) return;
+    store(index, data);
+}
+
+void BucketCache::store(uint64_t index, const char* data) {
+    size_t slot;
+    unordered_map<uint64_t, size_t>::iterator it = slots.find(index);
+    if (it != slots.end()) {
+        slot = it->second;
+        lru.splice(lru.begin(), lru, lru_pos[slot]);
+    } else if (slots.size() < capacity) {
+        slot = slots.size();
+        lru.push_front(slot);
+        lru_pos[slot] = lru.begin();
+        slots[index] = slot;
+    } else {
+        // evict the least recently used bucket and reuse its slot
+        slot = lru.back();
+        slots.erase(slot_owner[slot]);
+        lru.splice(lru.begin(), lru, lru_pos[slot]);
+        slots[index] = slot;
+    }
+    slot_owner[slot] = index;
+    memcpy(arena.data() + slot * slot_bytes, data, slot_bytes);
+}
@@ -4,6 +4,7 @@
 #include "../include/server.h"
 #include "../include/helper.h"
 #include <iostream>
+#include <iomanip>
 #include <chrono>
 #include <thread>
 #include <openssl/rand.h>
@@ -21,145 +22,153 @@
 
 using namespace std;
 
-#define bucket_char_size 16384
+// stands in for the key in the state file, a wrong key is caught on open
+static vector<unsigned char> keyReference(const vector<unsigned char>& key) {
+    string label = "rORAM client state";
+    return create_encrypted_id(key, vector<unsigned char>(label.begin(), label.end()), 32);
+}
+
+static void putBlock(StateWriter& out, const block& b, const OramConfig& config) {
+    string plaintext(config.block_plaintext_size(), '\0');
+    serializeBlock(b, &plaintext[0], config);
+    out.put_bytes(plaintext.data(), plaintext.size());
+}
+
+static block getBlock(StateReader& in, const OramConfig& config) {
+    return deserializeBlock(in.get_bytes(config.block_plaintext_size()), config);
+}
 
-Client::Client(vector<pair<int,string>> data_to_add, int bucket_capacity, int max_range) {
+Client::Client(vector<pair<int64_t,string>> data_to_add, const OramConfig& config, int max_range, StorageMode storage_mode, size_t cache_buckets, int cached_levels, size_t worker_threads) {
     this->key = generateEncryptionKey(64);
     this->num_blocks = data_to_add.size();
+    this->journal_group = 0;
+    this->journal_accesses = 0;
+    this->resumed = false;
 
     //int height = ceil(log2(num_blocks + 1));
     //this->num_buckets = (1 << height) - 1;
     
-    int target_buckets = ceil(num_blocks / 4.0);
-    int height = ceil(log2(target_buckets + 1));
-    this->num_buckets = (1 << height) - 1;
+    this->config = config;
+    if (this->config.height == 0) {
+        int64_t target_buckets = ceil(num_blocks / (double)config.Z);
+        this->config.height = ceil(log2(target_buckets + 1));
+    }
+    int height = this->config.height;
+    this->num_buckets = this->config.num_buckets();
     
     this->L = height;  
     this->max_range = max_range;
-    this->bucket_capacity = bucket_capacity;
     this->num_trees = ceil(log2(max_range));
+    start_workers(worker_threads);
 
     // Initialize stashes and position maps for all trees before processing any data
     for (int l = 0; l < num_trees; l++) {
-        stashes.push_back(unordered_map<int, block>());
-        position_maps.push_back(map<int, int>());
+        // a range access stashes up to two ranges plus what one eviction reads back
+        stashes.push_back(Stash(2 * max_range + L * config.Z + default_stash_blocks, config.block_data_size));
+        // one spare range, simple_access also reads the range after the last one
+        size_t ranges = ((num_blocks + ((int64_t)1 << l) - 1) >> l) + 1;
+        position_maps.push_back(PackedPositionMap(ranges, max(L - 1, 1)));
         evict_counter.push_back(0);
     }
 
     //turn input into blocks
     vector<block> blocks_to_add;
-    for (pair<int,string> data: data_to_add){
-        blocks_to_add.push_back(block(data.first, data.second, false, vector<int>(num_trees, -1)));
+    for (pair<int64_t,string> data: data_to_add){
+        blocks_to_add.push_back(block(data.first, data.second, false, vector<int64_t>(num_trees, -1)));
     }
 
     //horrendous naming conventions
     for (int l = 0; l<num_trees;  l++){
-        int current_leaf;
+        int64_t current_leaf;
         for (block& block_to_add: blocks_to_add){
-            if (block_to_add.id % (1<<l)==0){
+            if (block_to_add.id % ((int64_t)1 << l)==0){
                 current_leaf = getRandomLeaf();
                 block_to_add.paths[l] = current_leaf;
             } else {
-                block_to_add.paths[l] = getRandomLeafInRange(current_leaf, 1<<l);
+                block_to_add.paths[l] = getRandomLeafInRange(current_leaf, (int64_t)1 << l);
             }
         }
     }
 
     for (int l = 0; l < num_trees; l++){
         int tree_range = 1 << l;
-        ORAM* tree = new ORAM(num_buckets, bucket_capacity, key, tree_range, to_string(l));
+        // no dummy fill, bulk_load below only writes the buckets that get blocks
+        ORAM* tree = new ORAM(this->config, key, tree_range, to_string(l), storage_mode, cache_buckets, cached_levels, TREE_LAZY);
         oram_trees.push_back(tree);
-        //cout << "pausing for 5 seconds" << endl;
-        //std::chrono::seconds dura( 5);
-        //std::this_thread::sleep_for( dura );
-        //cout << "pause finished" << endl;
 
-        //cout << "adding" << endl;
-        map<int,int>& position_map = position_maps[l];
+        PackedPositionMap& position_map = position_maps[l];
         for (block& block_to_add: blocks_to_add){
-            if (block_to_add.id % (1<<l) == 0){
-                position_map[block_to_add.id] = block_to_add.paths[l];
+            if (block_to_add.id % ((int64_t)1 << l) == 0){
+                position_map.set(block_to_add.id >> l, block_to_add.paths[l]);
             }
-            block add_test_block = tree->writeBlockToPath(block_to_add, block_to_add.paths[l],key);
-            if (!add_test_block.dummy){
-                cerr<< "block failed to add in initialization" << endl;
-                return;
-            };
         }
-        //cout << "done adding" << endl;
     }
+
+    // every tree is placed in memory and written in one pass instead of a path
+    // read and write per block, blocks that do not fit start in the stash
+    vector<function<void()> > jobs;
+    for (int l = 0; l < num_trees; l++) {
+        jobs.push_back([this, l, &blocks_to_add]() {
+            vector<block> left = oram_trees[l]->bulk_load(blocks_to_add, l);
+            for (block& b : left) {
+                stashes[l].insert(b);
+            }
+        });
+    }
+    run_jobs(jobs);
 }
 
-tuple<vector<block>, int> Client::simple_read_range(int range_power, int id) {
-    unordered_map<int, block> &stash = stashes[range_power];
-    map<int, int> &position_map = position_maps[range_power];
+tuple<vector<block>, int64_t> Client::simple_read_range(int range_power, int64_t id) {
+    Stash &stash = stashes[range_power];
+    PackedPositionMap &position_map = position_maps[range_power];
     ORAM* tree = oram_trees[range_power];
 
-    pair<int, int> range = {id, id + (1 << range_power)};
+    pair<int64_t, int64_t> range = {id, id + ((int64_t)1 << range_power)};
     vector<block> result;
     
     // go through stash
-    try {
-        vector<int> stash_keys;
-        for (const auto& pair : stash) {
-            stash_keys.push_back(pair.first);
-        }
-        
-        for (int key : stash_keys) {
-            if (stash.find(key) != stash.end()) {
-                if (key >= range.first && key < range.second) {
-                    result.push_back(stash[key]);
-                }
-            }
+    for (size_t k = 0; k < stash.size(); k++) {
+        const block& b = stash.at(k);
+        if (b.id >= range.first && b.id < range.second) {
+            result.push_back(b);
         }
-    } catch (const exception& e) {
-        cout << "Exception during stash iteration: " << e.what() << endl;
-    } catch (...) {
-        cout << "Unknown exception during stash iteration" << endl;
     }
 
-    // Check if range exists in position_map
-    int p;
-    auto it = position_map.find(range.first);
-    p = it->second;  
-    int p_prime = getRandomLeaf();
-    position_map[range.first] = p_prime;
+    int64_t p_prime = getRandomLeaf();
+    int64_t p;
+    {
+        lock_guard<mutex> lock(position_mutex);
+        p = position_map.exchange(range.first >> range_power, p_prime);
+        if (journal) journal_remaps.push_back(make_tuple(range_power, range.first >> range_power, p_prime));
+    }
 
     //cout << "reading leaf: " << p << "for range power: " << range_power << endl;
     // Read all buckets along path p
+    // a record that fails to authenticate throws, a tampered bucket must not read as absent blocks
     for (int j = 0; j < L; j++) {
-        try {
-            //cout << "reading range at level " << j << " for path " << p << endl;
-            vector<Bucket> levelBuckets = tree->try_buckets_at_level(j, p, range_power);
-            for (Bucket &bucket : levelBuckets) {
-                for (block &b : bucket.getBlocks()) {
-                    if (!b.data.empty()) {
-                        try {
-                            // Decrypt the block 
-                            block decrypted_b = decryptBlock(b, key);
-                            //cout << "decrypted block" << endl;
-                            //decrypted_b.print_block();
-                            
-                            // Only add non-dummy blocks in range to the result
-                            if (!decrypted_b.dummy && decrypted_b.id >= range.first && decrypted_b.id < range.second) {
-                                auto it = find_if(result.begin(), result.end(), [&](const block &blk) {
-                                    return blk.id == decrypted_b.id;
-                                });
-                                if (it == result.end()) {
-                                    result.push_back(decrypted_b);
-                                }
-                            }
-                        } catch (const exception& e) {
-                            // Skip blocks that fail decryp - for debbuggin, shouldn't be necessary right now
-                            // cout << "Skipping block that couldn't be decrypted: " << e.what() << endl;
+        //cout << "reading range at level " << j << " for path " << p << endl;
+        vector<Bucket> levelBuckets = tree->try_buckets_at_level(j, p, range_power);
+        bool cached = tree->level_cached(j);
+        for (Bucket &bucket : levelBuckets) {
+            for (block &b : bucket.getBlocks()) {
+                if (!b.data.empty()) {
+                    // Decrypt the block, cached levels are already plaintext
+                    block decrypted_b = cached ? b : decryptBlock(b, key, config);
+                    relabelStale(decrypted_b);
+                    //cout << "decrypted block" << endl;
+                    //decrypted_b.print_block();
+                    
+                    // Only add non-dummy blocks in range to the result
+                    if (!decrypted_b.dummy && decrypted_b.id >= range.first && decrypted_b.id < range.second) {
+                        auto it = find_if(result.begin(), result.end(), [&](const block &blk) {
+                            return blk.id == decrypted_b.id;
+                        });
+                        if (it == result.end()) {
+                            result.push_back(decrypted_b);
                         }
                     }
                 }
             }
-        } catch (const exception& e) {
-            cout << "Exception reading level buckets: " << e.what() << endl;
-        } catch (...) {
-            cout << "Unknown exception reading level buckets" << endl;
         }
     }
     //for (block b: result){
@@ -170,105 +179,102 @@ tuple<vector<block>, int> Client::simple_read_range(int range_power, int id) {
 }
 
 void Client::simple_batch_evict(int eviction_number, int range_power) {
-    unordered_map<int, block> &stash = stashes[range_power];
+    Stash &stash = stashes[range_power];
     ORAM* tree = oram_trees[range_power];
-    int evict_global = evict_counter[range_power];
+    int64_t evict_global = evict_counter[range_power];
     int height = this->L;  
 
     for (int j = height-1; j >= 0; j--) {
-        int levelSize = (1 << j);
-        int levelStartLogical = (1 << j) - 1;
+        int64_t levelSize = ((int64_t)1 << j);
+        int64_t levelStartLogical = ((int64_t)1 << j) - 1;
 
         // Determine the target logical bucket indices for eviction.
-        set<int> targetLogicalIndices;
-        for (int t = evict_global; t < evict_global + eviction_number; t++) {
-            int offset = t % levelSize;
-            int targetLogical = levelStartLogical + offset;
+        set<int64_t> targetLogicalIndices;
+        for (int64_t t = evict_global; t < evict_global + eviction_number; t++) {
+            int64_t offset = t % levelSize;
+            int64_t targetLogical = levelStartLogical + offset;
             targetLogicalIndices.insert(targetLogical);
         }
 
         // Map these logical indices to their physical indices.
-        vector<int> targetPhysicalIndices;
-        for (int logical : targetLogicalIndices) {
-            int phys = tree->toPhysicalIndex(logical);
+        vector<int64_t> targetPhysicalIndices;
+        for (int64_t logical : targetLogicalIndices) {
+            int64_t phys = tree->toPhysicalIndex(logical);
             targetPhysicalIndices.push_back(phys);
         }
 
         // Compute the minimum and maximum physical indices for one disc seek
-        int minPhysical = *min_element(targetPhysicalIndices.begin(), targetPhysicalIndices.end());
-        int maxPhysical = *max_element(targetPhysicalIndices.begin(), targetPhysicalIndices.end());
-        int count = maxPhysical - minPhysical + 1;
+        int64_t minPhysical = *min_element(targetPhysicalIndices.begin(), targetPhysicalIndices.end());
+        int64_t maxPhysical = *max_element(targetPhysicalIndices.begin(), targetPhysicalIndices.end());
+        int64_t count = maxPhysical - minPhysical + 1;
 
         vector<Bucket> buckets = tree->read_bucket_physical_consecutive(minPhysical, count);
-
-        // Using offset in the read buffer.
-        for (int targetLogical : targetLogicalIndices) {
-            int phys = tree->toPhysicalIndex(targetLogical);
-            int pos = phys - minPhysical;
-            if (pos < 0 || pos >= (int)buckets.size()) continue;
-            Bucket &bucket = buckets[pos];
-            for (const block &blk : bucket.getBlocks()) {
-                if (!blk.data.empty()) {
-                    try {
-                        block decrypted_blk = decryptBlock(blk, key);
-                        if (!decrypted_blk.dummy) {
-                            if (stash.find(decrypted_blk.id) == stash.end()) {
-                                stash[decrypted_blk.id] = decrypted_blk;
-                            }
-                        }
-                    } catch (const exception &e) {
-                        cout << "Skipping block during eviction read at level " << j 
-                             << ": " << e.what() << endl;
-                    }
+        bool cached = tree->level_cached(j);
+
+        // Using offset in the read buffer, the targets of the level are decrypted in one pass.
+        vector<int64_t> targetPositions;
+        vector<Bucket> targetBuckets;
+        for (int64_t targetLogical : targetLogicalIndices) {
+            int64_t phys = tree->toPhysicalIndex(targetLogical);
+            int64_t pos = phys - minPhysical;
+            if (pos < 0 || pos >= (int64_t)buckets.size()) continue;
+            targetPositions.push_back(pos);
+            targetBuckets.push_back(buckets[pos]);
+        }
+        // a record that fails to authenticate throws here, before the level is
+        // rebuilt from the stash, so its real blocks are never overwritten
+        if (!cached) decrypt_path(targetBuckets, key, config);
+        for (Bucket &bucket : targetBuckets) {
+            for (block &decrypted_blk : bucket.getBlocks()) {
+                if (!decrypted_blk.dummy && !stash.find(decrypted_blk.id)) {
+                    relabelStale(decrypted_blk);
+                    stash.insert(decrypted_blk);
                 }
             }
         }
 
         // make buckets from the stash.
-        for (int targetLogical : targetLogicalIndices) {
-            int phys = tree->toPhysicalIndex(targetLogical);
-            int pos = phys - minPhysical;
-            if (pos < 0 || pos >= (int)buckets.size()) continue;
-            Bucket newBucket(bucket_capacity);
+        vector<Bucket> newBuckets;
+        for (int64_t pos : targetPositions) {
+            int64_t targetLogical = tree->toNormalIndex(minPhysical + pos);
+            Bucket newBucket(config.Z);
             int prefix_bits = (height - 1) - j;
-            int targetOffset = targetLogical - levelStartLogical;
-            for (auto it = stash.begin(); it != stash.end(); ) {
-                int tag = it->second.paths[range_power];
-                int bucket_index = (prefix_bits >= 0 ? (tag >> prefix_bits) : tag);
-                if (bucket_index == targetOffset) {
-                    bool added = newBucket.addBlock(it->second);
-                    if (added)
-                        it = stash.erase(it);
-                    else
-                        ++it;
-                    if (!newBucket.hasSpace())
-                        break;
-                } else {
-                    ++it;
+            int64_t targetOffset = targetLogical - levelStartLogical;
+            for (size_t k = stash.size(); k-- > 0 && newBucket.hasSpace(); ) {
+                const block& b = stash.at(k);
+                int64_t tag = b.paths[range_power];
+                int64_t bucket_index = (prefix_bits >= 0 ? (tag >> prefix_bits) : tag);
+                if (bucket_index == targetOffset && newBucket.addBlock(b)) {
+                    stash.erase(b.id);
                 }
             }
-            // Encrypt the updated bucket.
-            Bucket encryptedBucket(bucket_capacity);
-            for (block &b : newBucket.getBlocks()) {
-                block encrypted_blk = encryptBlock(b, key);
-                encryptedBucket.addBlock(encrypted_blk);
-            }
-            buckets[pos] = encryptedBucket;
+            newBuckets.push_back(newBucket);
+        }
+        // Encrypt the updated buckets, the whole level in one pass.
+        if (!cached) encrypt_path(newBuckets, key, config);
+        for (size_t k = 0; k < targetPositions.size(); k++) {
+            buckets[targetPositions[k]] = newBuckets[k];
+        }
+
+        if (cached) {
+            tree->writeCachedLevel(minPhysical, buckets);
+            continue;
         }
 
         // Write the entire thing with one write
         string levelData;
-        levelData.resize(count * bucket_char_size, ' ');
-        for (int i = 0; i < count; i++) {
-            string serialized = serialize_bucket(buckets[i]);
-            memcpy(&levelData[i * bucket_char_size], serialized.data(), bucket_char_size);
+        levelData.resize(count * tree->bucket_bytes, ' ');
+        for (int64_t i = 0; i < count; i++) {
+            string serialized = serialize_bucket(buckets[i], tree->config);
+            memcpy(&levelData[i * tree->bucket_bytes], serialized.data(), tree->bucket_bytes);
         }
         tree->writeContiguousLevel(minPhysical, count, levelData);
     }
+    stash.record_occupancy();
 }
 
 
-vector<block> Client::simple_access(int id, int range, int op, vector<string> data) {
+vector<block> Client::simple_access(int64_t id, int range, int op, vector<string> data) {
     int i = -1;
     for (int c = 0; c < max_range; c++) {
         if (range > (1 << (c-1)) && range <= (1 << c)) {
@@ -277,19 +283,18 @@ vector<block> Client::simple_access(int id, int range, int op, vector<string> da
         }
     }
     
+    // an empty result would look like a read of absent blocks
     if (i == -1) {
-        cerr << "Range " << range << " exceeds maximum supported range" << endl;
-        return {};
+        throw invalid_argument("Range " + to_string(range) + " exceeds maximum supported range");
     }
     
     // in case
     if (i >= num_trees) {
-        cerr << "Calculated range power " << i << " exceeds number of trees " << num_trees << endl;
-        return {};
+        throw invalid_argument("Range power " + to_string(i) + " exceeds number of trees " + to_string(num_trees));
     }
     
-    int a_zero = floor(id / (1 << i)) * (1 << i);
-    map<int, block> combined_read;
+    int64_t a_zero = (id >> i) << i;
+    map<int64_t, block> combined_read;
     vector<block> D;  
 
     if (op == 0) {
@@ -298,43 +303,40 @@ vector<block> Client::simple_access(int id, int range, int op, vector<string> da
     
     //std::cout << "Before read range: a_zero=" << a_zero << ", i=" << i << ", range=" << range << std::endl;
     //std::cout << "reading range" << endl;
-    // two read range
+    // the two ranges are both in tree i, they are read one after the other so
+    // its ORAM, cache and stash are only used by one thread at a time
     //cout << "ranges being read: " << a_zero << ", " << a_zero + (1 << i) << " in tree " << i << endl;
-    for (int a_prime : {a_zero, a_zero + (1 << i)}) {
+    int64_t starts[2] = {a_zero, a_zero + ((int64_t)1 << i)};
+    for (int k = 0; k < 2; k++) {
+        int64_t a_prime = starts[k];
         //std::cout << "Processing range starting at " << a_prime << std::endl;
         
-        try {
-            auto [blocks, p_prime] = simple_read_range(i, a_prime);
-            
-            // probably not necessary
-            sort(blocks.begin(), blocks.end(), [](const block &a, const block &b) {
-                return a.id < b.id;
-            });
-            
-            // Update path tags for tree i
-            for (block &b : blocks) {
-                if (b.id >= a_prime && b.id < a_prime + (1 << i)) {
-                    b.paths[i] = getRandomLeafInRange(p_prime, 1<<i);
-                }
-                // If reading, get data into D
-                if (op == 0 && b.id >= id && b.id < id + range) {
-                    int idx = b.id - id;
-                    if (idx >= 0 && idx < D.size()) {
-                        D[idx] = b;
-                    }
-                }
+        // a failed read throws before anything is evicted, the blocks it
+        // missed would otherwise be erased from every stash
+        auto [blocks, p_prime] = simple_read_range(i, a_prime);
+        
+        // probably not necessary
+        sort(blocks.begin(), blocks.end(), [](const block &a, const block &b) {
+            return a.id < b.id;
+        });
+        
+        // Update path tags for tree i
+        for (block &b : blocks) {
+            if (b.id >= a_prime && b.id < a_prime + ((int64_t)1 << i)) {
+                b.paths[i] = getRandomLeafInRange(p_prime, (int64_t)1 << i);
             }
-            
-            // Merge blocks into combined_read map
-            for (block &b : blocks) {
-                combined_read[b.id] = b;
+            // If reading, get data into D
+            if (op == 0 && b.id >= id && b.id < id + range) {
+                int64_t idx = b.id - id;
+                if (idx >= 0 && idx < D.size()) {
+                    D[idx] = b;
+                }
             }
         }
-        catch (const exception& e) {
-            cerr << "Exception during simple_read_range for a_prime=" << a_prime << ": " << e.what() << endl;
-        }
-        catch (...) {
-            cerr << "Unknown exception during simple_read_range for a_prime=" << a_prime << endl;
+        
+        // Merge blocks into combined_read map
+        for (block &b : blocks) {
+            combined_read[b.id] = b;
         }
     }
     
@@ -347,7 +349,7 @@ vector<block> Client::simple_access(int id, int range, int op, vector<string> da
         }
         
         // Update existing blocks
-        map<int, int> block_index;
+        map<int64_t, int64_t> block_index;
         vector<block> combined_blocks;
         combined_blocks.reserve(combined_read.size());
         
@@ -356,46 +358,64 @@ vector<block> Client::simple_access(int id, int range, int op, vector<string> da
             block_index[bid] = combined_blocks.size() - 1;
         }
         
-        for (int j = id; j < id + range && j < id + data.size(); j++) {
+        for (int64_t j = id; j < id + range && j - id < (int64_t)data.size(); j++) {
             auto it = block_index.find(j);
-                combined_blocks[it->second].data = data[j - id];
-                combined_read[j] = combined_blocks[it->second];
+            if (it == block_index.end()) {
+                // not read back, the write makes the block again in its ranges' windows
+                if (j >= num_blocks) {
+                    throw runtime_error("Block " + to_string(j) + " is outside the client's blocks");
+                }
+                block b(j, data[j - id], false, vector<int64_t>(num_trees, -1));
+                newPaths(b);
+                combined_read[j] = b;
+                continue;
+            }
+            combined_blocks[it->second].data = data[j - id];
+            combined_read[j] = combined_blocks[it->second];
         }
     }
     
     //std::cout << "Before batch evict" << endl;
     
-    // evict
+    // evict, one job per tree, each only touches its own stash, counter and tree file
+    vector<function<void()> > evict_jobs;
+    vector<exception_ptr> evict_errors(num_trees);
     for (int j = 0; j < num_trees; j++) {
-        try {
-            unordered_map<int, block> &stash = stashes[j];
-            // remove stash blocks in range
-            for (auto it = stash.begin(); it != stash.end(); ) {
-                if (it->first >= a_zero && it->first < a_zero + (1 << (i+1))) {
-                    it = stash.erase(it);
-                } else {
-                    ++it;
+        evict_jobs.push_back([this, j, i, a_zero, &combined_read, &evict_errors]() {
+            try {
+                Stash &stash = stashes[j];
+                // remove stash blocks in range
+                for (size_t k = stash.size(); k-- > 0; ) {
+                    int64_t bid = stash.at(k).id;
+                    if (bid >= a_zero && bid < a_zero + ((int64_t)1 << (i+1))) {
+                        stash.erase(bid);
+                    }
                 }
-            }
             
-            // Add/overwrite blocks from combined_read
-            for (auto &[bid, blk] : combined_read) {
-                stash[bid] = blk;
-            }
+                // Add/overwrite blocks from combined_read
+                for (auto &entry : combined_read) {
+                    stash.insert(entry.second);
+                }
             
-            // Perform batch evict
-            simple_batch_evict((1 << (i+1)), j);
+                // Perform batch evict
+                simple_batch_evict((1 << (i+1)), j);
             
-            // Update eviction counter
-            int total_leaves = 1 << (L - 1);
-            evict_counter[j] = (evict_counter[j] + (1 << (i+1))) % total_leaves;
-        }
-        catch (const exception& e) {
-            cerr << "Exception during eviction for tree " << j << ": " << e.what() << endl;
-        }
-        catch (...) {
-            cerr << "Unknown exception during eviction for tree " << j << endl;
-        }
+                // Update eviction counter
+                int64_t total_leaves = (int64_t)1 << (L - 1);
+                evict_counter[j] = (evict_counter[j] + (1 << (i+1))) % total_leaves;
+            }
+            catch (...) {
+                evict_errors[j] = current_exception();
+            }
+        });
+    }
+    run_jobs(evict_jobs);
+    // a failed eviction must not be journaled, its blocks are still in the stash
+    for (exception_ptr& error : evict_errors) {
+        if (error) rethrow_exception(error);
+    }
+    if (journal && ++journal_accesses >= journal_group) {
+        commit();
     }
 
     if (op == 0) {
@@ -405,39 +425,368 @@ vector<block> Client::simple_access(int id, int range, int op, vector<string> da
     return {};  
 }
 
-int Client::getRandomLeaf() {
-    unsigned char buf[4];
+Client::Client(const string& state_path, const vector<unsigned char>& key, StorageMode storage_mode, size_t cache_buckets, size_t worker_threads) {
+    this->key = key;
+    this->journal_group = 0;
+    this->journal_accesses = 0;
+    this->resumed = true;
+    StateReader in(state_path);
+    if (in.get_string() != "rORAM client") {
+        throw runtime_error("Not an rORAM client state");
+    }
+    if (in.get_u32() != client_state_version) {
+        throw runtime_error("Unknown client state version");
+    }
+    config.block_data_size = in.get_u32();
+    config.Z = in.get_u32();
+    config.height = in.get_u32();
+    config.cipher = (CipherMode)in.get_u32();
+    validate_config(config);
+    vector<unsigned char> reference = keyReference(key);
+    if (memcmp(in.get_bytes(reference.size()), reference.data(), reference.size()) != 0) {
+        throw runtime_error("Client state was saved with a different key");
+    }
+    this->L = config.height;
+    this->num_buckets = config.num_buckets();
+    this->num_blocks = in.get_i64();
+    this->max_range = in.get_u32();
+    this->num_trees = in.get_u32();
+    int cached_levels = in.get_u32();
+    if (num_trees < 1 || num_trees > max_block_paths || cached_levels < 0 || cached_levels > L) {
+        throw runtime_error("Corrupt client state");
+    }
+    start_workers(worker_threads);
+
+    for (int l = 0; l < num_trees; l++) {
+        ORAM* tree = new ORAM(config, key, 1 << l, to_string(l), storage_mode, cache_buckets, cached_levels, TREE_OPEN);
+        oram_trees.push_back(tree);
+        evict_counter.push_back(in.get_i64());
+        for (Bucket& bucket : tree->top_buckets) {
+            uint32_t count = in.get_u32();
+            if (count > (uint32_t)config.Z) {
+                throw runtime_error("Corrupt client state");
+            }
+            vector<block>& blocks = bucket.getBlocks();
+            blocks.clear();
+            for (uint32_t j = 0; j < count; j++) blocks.push_back(getBlock(in, config));
+        }
+        uint64_t stashed = in.get_u64();
+        stashes.push_back(Stash(max<uint64_t>(2 * max_range + L * config.Z + default_stash_blocks, stashed), config.block_data_size));
+        for (uint64_t k = 0; k < stashed; k++) {
+            stashes[l].insert(getBlock(in, config));
+        }
+        position_maps.push_back(PackedPositionMap(in));
+    }
+    if (!in.done()) {
+        throw runtime_error("Trailing data in client state " + state_path);
+    }
+}
+
+void Client::save_state(const string& path) {
+    // the state is only valid with every evicted bucket on disk
+    commit();
+    for (ORAM* tree : oram_trees) {
+        tree->flushCache();
+    }
+    StateWriter out;
+    out.put_string("rORAM client");
+    out.put_u32(client_state_version);
+    out.put_u32(config.block_data_size);
+    out.put_u32(config.Z);
+    out.put_u32(config.height);
+    out.put_u32(config.cipher);
+    vector<unsigned char> reference = keyReference(key);
+    out.put_bytes(reference.data(), reference.size());
+    out.put_i64(num_blocks);
+    out.put_u32(max_range);
+    out.put_u32(num_trees);
+    // every tree clamps the cached levels the same way
+    out.put_u32(oram_trees[0]->cached_levels);
+
+    for (int l = 0; l < num_trees; l++) {
+        out.put_i64(evict_counter[l]);
+        for (Bucket& bucket : oram_trees[l]->top_buckets) {
+            vector<block>& blocks = bucket.getBlocks();
+            out.put_u32(blocks.size());
+            for (const block& b : blocks) putBlock(out, b, config);
+        }
+        out.put_u64(stashes[l].size());
+        for (size_t k = 0; k < stashes[l].size(); k++) {
+            putBlock(out, stashes[l].at(k), config);
+        }
+        position_maps[l].save(out);
+    }
+    out.commit(path);
+    // everything in the journal is in the state now
+    if (journal) journal->reset();
+}
+
+void Client::enable_journal(const string& path, size_t group_accesses) {
+    journal.reset(new Journal(path));
+    journal_group = max<size_t>(group_accesses, 1);
+    if (resumed) {
+        // groups committed after the state was saved, the trees may have any of them
+        size_t replayed = journal->replay([this](StateReader& in) { replayRecord(in); });
+        if (replayed > 0) {
+            cout << "Replayed " << replayed << " journal groups from " << path << endl;
+        }
+    } else {
+        journal->reset();
+    }
+    for (ORAM* tree : oram_trees) {
+        tree->hold_writes(true);
+    }
+}
+
+// kind of journal record, every record starts with it
+enum { JOURNAL_GROUP = 1, JOURNAL_GROW = 2 };
+
+// A record holds the remapped ranges and, per tree, the eviction counter, the
+// buckets the group wrote (still encrypted), the rewritten cached buckets and
+// the whole stash, which is everything needed to redo the group on top of the
+// state before it.
+void Client::commit() {
+    if (!journal || (journal_accesses == 0 && journal_remaps.empty())) return;
+    StateWriter record;
+    record.put_u32(JOURNAL_GROUP);
+    record.put_u64(journal_remaps.size());
+    for (const tuple<int, int64_t, int64_t>& remapped : journal_remaps) {
+        record.put_u32(get<0>(remapped));
+        record.put_i64(get<1>(remapped));
+        record.put_i64(get<2>(remapped));
+    }
+    for (int l = 0; l < num_trees; l++) {
+        ORAM* tree = oram_trees[l];
+        vector<int64_t> indices, top;
+        string buckets;
+        tree->held_writes(indices, buckets, top);
+        record.put_i64(evict_counter[l]);
+        record.put_u64(indices.size());
+        for (int64_t index : indices) record.put_i64(index);
+        record.put_bytes(buckets.data(), buckets.size());
+        record.put_u64(top.size());
+        for (int64_t index : top) {
+            vector<block>& blocks = tree->top_buckets[index].getBlocks();
+            record.put_i64(index);
+            record.put_u32(blocks.size());
+            for (const block& b : blocks) putBlock(record, b, config);
+        }
+        record.put_u64(stashes[l].size());
+        for (size_t k = 0; k < stashes[l].size(); k++) {
+            putBlock(record, stashes[l].at(k), config);
+        }
+    }
+    journal->append(record);
+
+    // durable now, every tree file can have the group
+    vector<function<void()> > jobs;
+    for (int l = 0; l < num_trees; l++) {
+        jobs.push_back([this, l]() { oram_trees[l]->release_writes(); });
+    }
+    run_jobs(jobs);
+    journal_remaps.clear();
+    journal_accesses = 0;
+}
+
+void Client::replayRecord(StateReader& in) {
+    uint32_t kind = in.get_u32();
+    if (kind == JOURNAL_GROW) {
+        growTrees();
+        for (int l = 0; l < num_trees; l++) {
+            position_maps[l] = PackedPositionMap(in);
+            for (Bucket& bucket : oram_trees[l]->top_buckets) {
+                uint32_t count = in.get_u32();
+                if (count > (uint32_t)config.Z) {
+                    throw runtime_error("Corrupt journal record");
+                }
+                vector<block>& blocks = bucket.getBlocks();
+                blocks.clear();
+                for (uint32_t j = 0; j < count; j++) blocks.push_back(getBlock(in, config));
+            }
+            Stash& stash = stashes[l];
+            while (!stash.empty()) {
+                stash.erase(stash.at(stash.size() - 1).id);
+            }
+            uint64_t stashed = in.get_u64();
+            for (uint64_t k = 0; k < stashed; k++) {
+                stash.insert(getBlock(in, config));
+            }
+        }
+        return;
+    }
+    if (kind != JOURNAL_GROUP) {
+        throw runtime_error("Corrupt journal record");
+    }
+    uint64_t remaps = in.get_u64();
+    for (uint64_t k = 0; k < remaps; k++) {
+        uint32_t tree = in.get_u32();
+        int64_t index = in.get_i64();
+        int64_t leaf = in.get_i64();
+        if (tree >= (uint32_t)num_trees) {
+            throw runtime_error("Corrupt journal record");
+        }
+        position_maps[tree].set(index, leaf);
+    }
+    for (int l = 0; l < num_trees; l++) {
+        ORAM* tree = oram_trees[l];
+        evict_counter[l] = in.get_i64();
+        uint64_t count = in.get_u64();
+        vector<int64_t> indices;
+        for (uint64_t k = 0; k < count; k++) {
+            int64_t index = in.get_i64();
+            if (index < (int64_t)tree->top_buckets.size() || index >= num_buckets) {
+                throw runtime_error("Corrupt journal record");
+            }
+            indices.push_back(index);
+        }
+        for (int64_t index : indices) {
+            tree->updateBucket_physical(index, deserialize_bucket(in.get_bytes(tree->bucket_bytes), tree->bucket_bytes, config));
+        }
+        uint64_t top = in.get_u64();
+        for (uint64_t k = 0; k < top; k++) {
+            int64_t index = in.get_i64();
+            uint32_t blocks_in = in.get_u32();
+            if (index < 0 || index >= (int64_t)tree->top_buckets.size() || blocks_in > (uint32_t)config.Z) {
+                throw runtime_error("Corrupt journal record");
+            }
+            vector<block>& blocks = tree->top_buckets[index].getBlocks();
+            blocks.clear();
+            for (uint32_t j = 0; j < blocks_in; j++) blocks.push_back(getBlock(in, config));
+        }
+        // the stash as it was at the end of the group
+        Stash& stash = stashes[l];
+        while (!stash.empty()) {
+            stash.erase(stash.at(stash.size() - 1).id);
+        }
+        uint64_t stashed = in.get_u64();
+        for (uint64_t k = 0; k < stashed; k++) {
+            stash.insert(getBlock(in, config));
+        }
+    }
+}
+
+void Client::grow() {
+    // the tree files have every held write before they get longer
+    commit();
+    growTrees();
+    for (PackedPositionMap& position_map : position_maps) {
+        vector<unsigned char> coins((position_map.size() + 7) / 8);
+        if (RAND_bytes(coins.data(), coins.size()) != 1) {
+            throw runtime_error("Failed to generate random bytes");
+        }
+        position_map.widen(position_map.size(), coins.data());
+    }
+    // cached levels and stashes are in client memory, their blocks get new paths now
+    for (int l = 0; l < num_trees; l++) {
+        for (Bucket& bucket : oram_trees[l]->top_buckets) {
+            for (block& b : bucket.getBlocks()) {
+                if (!b.dummy) newPaths(b);
+            }
+        }
+        for (size_t k = 0; k < stashes[l].size(); k++) {
+            newPaths(stashes[l].at(k));
+        }
+    }
+    if (journal) {
+        // the new paths are random, so replay takes them from here
+        StateWriter record;
+        record.put_u32(JOURNAL_GROW);
+        for (int l = 0; l < num_trees; l++) {
+            position_maps[l].save(record);
+            for (Bucket& bucket : oram_trees[l]->top_buckets) {
+                vector<block>& blocks = bucket.getBlocks();
+                record.put_u32(blocks.size());
+                for (const block& b : blocks) putBlock(record, b, config);
+            }
+            record.put_u64(stashes[l].size());
+            for (size_t k = 0; k < stashes[l].size(); k++) {
+                putBlock(record, stashes[l].at(k), config);
+            }
+        }
+        journal->append(record);
+    }
+}
+
+void Client::growTrees() {
+    vector<function<void()> > jobs;
+    for (int l = 0; l < num_trees; l++) {
+        jobs.push_back([this, l]() { oram_trees[l]->grow(); });
+    }
+    run_jobs(jobs);
+    config.height++;
+    L = config.height;
+    num_buckets = config.num_buckets();
+    // one level more for an eviction to read back
+    for (Stash& stash : stashes) {
+        stash.reserve(stash.capacity() + config.Z);
+    }
+}
+
+void Client::newPaths(block& b) {
+    for (int t = 0; t < num_trees && t < (int)b.paths.size(); t++) {
+        b.paths[t] = getRandomLeafInRange(position_maps[t].get(b.id >> t), (int64_t)1 << t);
+    }
+}
+
+void Client::relabelStale(block& b) {
+    if (b.dummy || b.paths.empty() || b.paths[0] >= 0) return;
+    // the two range reads of an access run at once and remap as they go
+    lock_guard<mutex> lock(position_mutex);
+    newPaths(b);
+}
+
+void Client::start_workers(size_t worker_threads) {
+    if (worker_threads == 0) {
+        worker_threads = min<size_t>(num_trees, max(1u, thread::hardware_concurrency()));
+    }
+    if (worker_threads > 1) {
+        workers.reset(new ThreadPool(worker_threads));
+    }
+}
+
+void Client::run_jobs(vector<function<void()> >& jobs) {
+    if (workers) {
+        workers->run_all(jobs);
+        return;
+    }
+    for (function<void()>& job : jobs) {
+        job();
+    }
+}
+
+int64_t Client::getRandomLeaf() {
+    unsigned char buf[8];
     if (RAND_bytes(buf, sizeof(buf)) != 1) {
         throw runtime_error("Failed to generate random bytes");
     }
-    unsigned int random_value;
+    uint64_t random_value;
     memcpy(&random_value, buf, sizeof(random_value));
-    return random_value % (1 << (L - 1));
+    return (int64_t)(random_value & (((uint64_t)1 << (L - 1)) - 1));
 }
 
-int Client::getRandomLeafInRange(int start, int range_size) {
-    unsigned char buf[4];
+int64_t Client::getRandomLeafInRange(int64_t start, int64_t range_size) {
+    unsigned char buf[8];
     if (RAND_bytes(buf, sizeof(buf)) != 1) {
         throw runtime_error("Failed to generate random bytes");
     }
-    unsigned int random_value;
+    uint64_t random_value;
     memcpy(&random_value, buf, sizeof(random_value));
 
     int leaf_level = L - 1;
     
     // bit reverse
-    int start_br = 0;
-    int temp_start = start;
+    int64_t start_br = 0;
+    int64_t temp_start = start;
     for (int i = 0; i < leaf_level; i++) {
         start_br = (start_br << 1) | (temp_start & 1);
         temp_start >>= 1;
     }
     
-    int new_leaf_br = (start_br + (random_value % range_size)) % (1 << leaf_level);
+    int64_t new_leaf_br = (start_br + (int64_t)(random_value % (uint64_t)range_size)) % ((int64_t)1 << leaf_level);
     
     // Bit-reverse back 
-    int new_leaf = 0;
-    int temp_new = new_leaf_br;
+    int64_t new_leaf = 0;
+    int64_t temp_new = new_leaf_br;
     for (int i = 0; i < leaf_level; i++) {
         new_leaf = (new_leaf << 1) | (temp_new & 1);
         temp_new >>= 1;
@@ -446,6 +795,23 @@ int Client::getRandomLeafInRange(int start, int range_size) {
     return new_leaf;
 }
 
+void Client::print_cache_stats() {
+    for (int i = 0; i < num_trees; i++) {
+        size_t hits = oram_trees[i]->cache_hits();
+        size_t misses = oram_trees[i]->cache_misses();
+        if (hits + misses == 0) continue;
+        cout << "Bucket cache R" << i << ": " << hits << " hits, " << misses << " misses ("
+             << fixed << setprecision(1) << 100.0 * hits / (hits + misses) << "% hit rate)" << endl;
+    }
+}
+
+void Client::print_stash_stats() {
+    for (int i = 0; i < num_trees; i++) {
+        cout << "R" << i << " ";
+        stashes[i].print_stats();
+    }
+}
+
 void Client::print_stashes() {
     cout << "===== STASH STATES =====" << endl;
     for (int i = 0; i < stashes.size(); i++) {
@@ -453,8 +819,9 @@ void Client::print_stashes() {
         if (stashes[i].empty()) {
             cout << "  [empty]" << endl;
         } else {
-            for (const auto& [block_id, blk] : stashes[i]) {
-                cout << "  Block " << block_id << ": '" << blk.data << "'";
+            for (size_t k = 0; k < stashes[i].size(); k++) {
+                const block& blk = stashes[i].at(k);
+                cout << "  Block " << blk.id << ": '" << blk.data << "'";
                 if (!blk.paths.empty()) {
                     cout << ", paths: [";
                     for (size_t j = 0; j < blk.paths.size(); j++) {
@@ -473,12 +840,13 @@ void Client::print_stashes() {
 void Client::print_position_maps() {
     cout << "===== POSITION MAPS =====" << endl;
     for (int i = 0; i < position_maps.size(); i++) {
-        cout << "Position Map for ORAM R" << i << " (size: " << position_maps[i].size() << "):" << endl;
-        if (position_maps[i].empty()) {
+        cout << "Position Map for ORAM R" << i << " (size: " << position_maps[i].size()
+             << ", " << position_maps[i].memory_bytes() << " bytes):" << endl;
+        if (position_maps[i].size() == 0) {
             cout << "  [empty]" << endl;
         } else {
-            for (const auto& [addr, leaf] : position_maps[i]) {
-                cout << "  Block " << addr << " -> Leaf " << leaf << endl;
+            for (size_t j = 0; j < position_maps[i].size(); j++) {
+                cout << "  Block " << (j << i) << " -> Leaf " << position_maps[i].get(j) << endl;
             }
         }
         cout << endl;
@@ -494,12 +862,12 @@ void Client::print_tree_state(int tree_index, int max_level) {
     cout << "===== TREE R" << tree_index << " STATE =====" << endl;
     for (int level = 0; level <= max_level; level++) {
         cout << "Level " << level << ":" << endl;
-        int level_start = (1 << level) - 1;
-        int level_end = (1 << (level + 1)) - 1;
-        for (int i = level_start; i < level_end && i < tree->num_buckets; i++) {
+        int64_t level_start = ((int64_t)1 << level) - 1;
+        int64_t level_end = ((int64_t)1 << (level + 1)) - 1;
+        for (int64_t i = level_start; i < level_end && i < tree->num_buckets; i++) {
             cout << "  Bucket " << i << " (physical): ";
-            int normal_idx = tree->toNormalIndex(i);
-            int physical_index = toPhysicalIndex(normal_idx);
+            int64_t normal_idx = tree->toNormalIndex(i);
+            int64_t physical_index = toPhysicalIndex(normal_idx);
             Bucket bucket = tree->read_bucket(normal_idx);
             bool has_blocks = false;
             for (const block& b : bucket.getBlocks()) {
@@ -531,21 +899,21 @@ void Client::printLogicalTreeState(int tree_index, int max_level, bool decrypt)
     cout << "===== LOGICAL TREE R" << tree_index << " STATE =====" << endl;
     
     for (int level = 0; level <= max_level && level < height; level++) {
-        int level_start = (1 << level) - 1;
-        int level_end = min(tree->num_buckets, (1 << (level + 1)) - 1);
+        int64_t level_start = ((int64_t)1 << level) - 1;
+        int64_t level_end = min(tree->num_buckets, ((int64_t)1 << (level + 1)) - 1);
         
         cout << "Level " << level << " (logical indices " << level_start << " to " << level_end - 1 << "):" << endl;
         
-        for (int logical_index = level_start; logical_index < level_end; logical_index++) {
-            int physical_index = toPhysicalIndex(logical_index);
+        for (int64_t logical_index = level_start; logical_index < level_end; logical_index++) {
+            int64_t physical_index = toPhysicalIndex(logical_index);
             Bucket bucket = tree->read_bucket(logical_index);
             
             cout << "  Bucket " << logical_index << " (physical index " << physical_index << "): ";
             bool hasBlocks = false;
             
             for (block &b : bucket.getBlocks()) {
-                if (decrypt) {
-                    b = decryptBlock(b, key);
+                if (decrypt && !tree->level_cached(level)) {
+                    b = decryptBlock(b, key, config);
                 }
                 
                 if (!b.dummy) {
@@ -580,7 +948,7 @@ void Client::init_test_data() {
 }
 */
 
-void Client::print_path(int leaf, int tree_index) {
+void Client::print_path(int64_t leaf, int tree_index) {
     if (tree_index < 0 || tree_index >= oram_trees.size()) {
         cout << "Invalid tree index: " << tree_index << endl;
         return;
@@ -588,11 +956,11 @@ void Client::print_path(int leaf, int tree_index) {
     ORAM* tree = oram_trees[tree_index];
     cout << "===== PATH TO LEAF " << leaf << " IN TREE R" << tree_index << " =====" << endl;
     for (int j = 0; j <= (L + 1); j++) {
-        int level_size = 1 << j;
-        int r = leaf % level_size;
-        int levelStart = (1 << j) - 1;
-        int physicalIndex = levelStart + r;
-        int logicalIndex = tree->toNormalIndex(physicalIndex);
+        int64_t level_size = (int64_t)1 << j;
+        int64_t r = leaf % level_size;
+        int64_t levelStart = ((int64_t)1 << j) - 1;
+        int64_t physicalIndex = levelStart + r;
+        int64_t logicalIndex = tree->toNormalIndex(physicalIndex);
         cout << "Level " << j << ": Physical Bucket = " << physicalIndex 
              << ", Logical Bucket = " << logicalIndex << endl;
     }
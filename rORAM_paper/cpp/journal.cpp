@@ -0,0 +1,133 @@
+#include "../include/journal.h"
+#include <algorithm>
+#include <cerrno>
+#include <cstring>
+#include <stdexcept>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#include <unistd.h>
+
+using namespace std;
+
+static const uint32_t journal_magic = 0x4c4e524a;   // "JRNL"
+// magic, reserved, sequence, body length, body checksum
+static const size_t journal_header_size = 32;
+
+// FNV-1a, only has to catch a torn or partly written record
+static uint64_t checksum(const char* data, size_t length) {
+    uint64_t hash = 14695981039346656037ULL;
+    for (size_t i = 0; i < length; i++) {
+        hash = (hash ^ (unsigned char)data[i]) * 1099511628211ULL;
+    }
+    return hash;
+}
+
+Journal::Journal(const string& path) : path(path), fd(-1), end(0), sequence(0), records(0) {
+    fd = ::open(path.c_str(), O_RDWR | O_CREAT, 0600);
+    if (fd < 0) {
+        throw runtime_error("Failed to open journal " + path + ": " + strerror(errno));
+    }
+    struct stat st;
+    if (::fstat(fd, &st) != 0) {
+        ::close(fd);
+        throw runtime_error("Failed to stat journal " + path);
+    }
+    end = st.st_size;
+}
+
+Journal::~Journal() {
+    if (fd >= 0) ::close(fd);
+}
+
+void Journal::append(const StateWriter& record) {
+    const string& body = record.bytes();
+    char header[journal_header_size];
+    uint32_t reserved = 0;
+    uint64_t length = body.size();
+    uint64_t sum = checksum(body.data(), body.size());
+    memcpy(header, &journal_magic, 4);
+    memcpy(header + 4, &reserved, 4);
+    memcpy(header + 8, &sequence, 8);
+    memcpy(header + 16, &length, 8);
+    memcpy(header + 24, &sum, 8);
+
+    // header and body go out as one write
+    struct iovec parts[2];
+    parts[0].iov_base = header;
+    parts[0].iov_len = journal_header_size;
+    parts[1].iov_base = const_cast<char*>(body.data());
+    parts[1].iov_len = body.size();
+    size_t total = journal_header_size + body.size();
+    size_t done = 0;
+    while (done < total) {
+        ssize_t n = ::pwritev(fd, parts, 2, end + done);
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0) {
+            throw runtime_error("Failed to write journal " + path + ": " + strerror(errno));
+        }
+        done += n;
+        // a short write, carry on from where it stopped
+        size_t skip = n;
+        for (int i = 0; i < 2; i++) {
+            size_t used = min(skip, parts[i].iov_len);
+            parts[i].iov_base = static_cast<char*>(parts[i].iov_base) + used;
+            parts[i].iov_len -= used;
+            skip -= used;
+        }
+    }
+    if (::fdatasync(fd) != 0) {
+        throw runtime_error("Failed to sync journal " + path + ": " + strerror(errno));
+    }
+    end += total;
+    sequence++;
+    records++;
+}
+
+size_t Journal::replay(const function<void(StateReader&)>& apply) {
+    size_t replayed = 0;
+    uint64_t valid = 0;
+    if (end > 0) {
+        StateReader in(path);
+        bool first = true;
+        while (in.remaining() >= journal_header_size) {
+            const char* header = in.get_bytes(journal_header_size);
+            uint32_t magic;
+            uint64_t number, length, sum;
+            memcpy(&magic, header, 4);
+            memcpy(&number, header + 8, 8);
+            memcpy(&length, header + 16, 8);
+            memcpy(&sum, header + 24, 8);
+            if (magic != journal_magic || (!first && number != sequence) || length > in.remaining()) break;
+            const char* body = in.get_bytes(length);
+            if (checksum(body, length) != sum) break;
+
+            StateReader record(body, length);
+            apply(record);
+            if (!record.done()) {
+                throw runtime_error("Journal record " + to_string(number) + " was not read to the end");
+            }
+            first = false;
+            sequence = number + 1;
+            valid += journal_header_size + length;
+            replayed++;
+        }
+    }
+    // a torn last record is dropped, the next one is written over it
+    if (valid < end) {
+        if (::ftruncate(fd, valid) != 0 || ::fdatasync(fd) != 0) {
+            throw runtime_error("Failed to cut torn tail of journal " + path);
+        }
+        end = valid;
+    }
+    records = replayed;
+    return replayed;
+}
+
+void Journal::reset() {
+    if (::ftruncate(fd, 0) != 0 || ::fdatasync(fd) != 0) {
+        throw runtime_error("Failed to reset journal " + path + ": " + strerror(errno));
+    }
+    end = 0;
+    records = 0;
+}
@@ -41,6 +41,31 @@ int main(int argc, char* argv[]) {
     }
     int num_buckets = (1 << power) - 1;
     int bucket_capacity = 4;
+    // payload bytes per block, every block in the tree files is padded to this size
+    int block_data_size = 1600;
+    // CIPHER_GCM authenticates every block, CIPHER_CTR only encrypts it
+    CipherMode cipher = CIPHER_GCM;
+    // height 0 lets the client size the trees from the data
+    OramConfig config(block_data_size, bucket_capacity, 0, cipher);
+
+    // STORAGE_MMAP maps trees/<n> into memory instead of using pread/pwrite,
+    // STORAGE_DIRECT opens them with O_DIRECT (buckets padded to 4 KiB slots)
+    StorageMode storage_mode = STORAGE_FILE;
+    // recently used buckets kept in memory per tree, 0 turns the cache off
+    size_t cache_buckets = 0;
+    // top levels of every tree kept decrypted in memory (treetop caching), 0 keeps all on disk
+    int cached_levels = 0;
+    // threads evicting the trees in parallel, 0 uses one per tree, 1 evicts them one after another
+    size_t worker_threads = 0;
+    // client state (stashes, position maps, cached levels) is saved here at the end
+    // and reopened against the same tree files
+    string state_path = "client.state";
+    // > 0 logs every access to client.journal with a group commit every this many
+    // accesses, evicted buckets only reach the tree files once their group is durable
+    size_t journal_group = 0;
+    string journal_path = "client.journal";
+    // levels added to every tree online after loading, each one doubles the leaves
+    int grow_levels = 0;
     
     int max_range_power = 4; 
     int max_range = (1 << (max_range_power + 1)) + 1; 
@@ -52,17 +77,28 @@ int main(int argc, char* argv[]) {
          << ", max range = " << max_range << ")" << endl << endl;
     
     // Create test data
-    vector<pair<int, string>> data_to_add;
+    vector<pair<int64_t, string>> data_to_add;
     data_to_add.reserve(num_blocks);
-    for (int idx = 0; idx < num_blocks; idx++) {
+    for (int64_t idx = 0; idx < num_blocks; idx++) {
         data_to_add.emplace_back(idx, "Test " + to_string(idx));
     }
 
     // Initialize the ORAM client with the test data
     cout << "Initializing ORAM. ";
     cout.flush();
-    Client client(data_to_add, bucket_capacity, max_range);
+    Client client(data_to_add, config, max_range, storage_mode, cache_buckets, cached_levels, worker_threads);
+    if (journal_group > 0) {
+        // the journal starts from a saved state
+        client.save_state(state_path);
+        client.enable_journal(journal_path, journal_group);
+    }
     cout << "done." << endl << endl;
+    for (int level = 0; level < grow_levels; level++) {
+        auto grow_start = chrono::high_resolution_clock::now();
+        client.grow();
+        chrono::duration<double> grow_duration = chrono::high_resolution_clock::now() - grow_start;
+        cout << "Grew the trees to height " << client.L << " in " << fixed << setprecision(6) << grow_duration.count() << " s" << endl;
+    }
 
     // Store results for each range size
     struct QueryResult {
@@ -81,7 +117,7 @@ int main(int argc, char* argv[]) {
         cout << "\nTEST " << (test_idx + 1) << ": Range size = 2^" 
              << log2(range_size) << " = " << range_size << " blocks" << endl;
         
-        int start_id = (num_blocks / 2) - (range_size / 2);
+        int64_t start_id = (num_blocks / 2) - (range_size / 2);
         if (start_id < 0) start_id = 0;
         
         cout << "Query starting at block " << start_id 
@@ -96,7 +132,7 @@ int main(int argc, char* argv[]) {
         // Check correct blocks for data integrity check
         int correct_blocks = 0;
         for (auto& blk : result) {
-            int id = blk.id;
+            int64_t id = blk.id;
             if (id >= 0 && id < num_blocks) {
                 string expected_data = "Test " + to_string(id);
                 if (blk.data == expected_data) {
@@ -151,6 +187,20 @@ int main(int argc, char* argv[]) {
     }
     cout << "+---------------+---------------+---------------+---------------+" << endl;
 
+    client.print_cache_stats();
+    client.print_stash_stats();
+
+    // restart check, a new client picks the trees up from the saved state
+    client.save_state(state_path);
+    cout << "\nClient state saved to " << state_path << endl;
+    Client reopened(state_path, client.key, storage_mode, cache_buckets, worker_threads);
+    auto reread = reopened.simple_access(0, num_blocks, 0, {});
+    int reread_correct = 0;
+    for (auto& blk : reread) {
+        if (blk.data == "Test " + to_string(blk.id)) reread_correct++;
+    }
+    cout << "Reopened client read " << reread_correct << "/" << reread.size() << " blocks intact" << endl;
+
     cout << "\n=== All tests completed ===" << endl;
     return 0;
 }
@@ -10,35 +10,76 @@
 #include <unistd.h>
 #include <fcntl.h>  
 #include <cstring>
+#include <cstdio>
 
 using namespace std;
 
-#define bucket_char_size 16384
-
-ORAM::ORAM(int numBuckets, int bucketCapacity, const vector<unsigned char>& encryptionKey, int range_length, string file) {
+ORAM::ORAM(const OramConfig& config, const vector<unsigned char>& encryptionKey, int range_length, string file, StorageMode mode, size_t cache_buckets, int cached_levels, TreeInit init) {
+    validate_config(config);
+    this->config = config;
     this->encryptionKey = encryptionKey;
-    this->bucketCapacity = bucketCapacity;
-    this->num_buckets = numBuckets;
+    this->bucket_bytes = bucket_byte_size(config);
+    this->slot_bytes = slot_size(bucket_bytes, mode);
+    this->num_buckets = config.num_buckets();
     this->range_length = range_length;
     this->global_counter = 0;
+    int64_t numBuckets = num_buckets;
+    // the leaf level always stays on disk
+    this->cached_levels = max(0, min(cached_levels, config.height - 1));
+    this->top_buckets.assign(((int64_t)1 << this->cached_levels) - 1, Bucket(config.Z));
     this->file_path = "trees/" + file;
-    this->tree_file.open(file_path, std::ios::in | std::ios::out | std::ios::trunc | std::ios::binary);
+    // evictions and range reads walk each level front to back
+    this->storage.reset(open_storage(mode, file_path, (uint64_t)numBuckets * slot_bytes, init != TREE_OPEN, ACCESS_SEQUENTIAL));
+    if (cache_buckets > 0 && mode != STORAGE_MMAP) {
+        this->cache.reset(new BucketCache(cache_buckets, slot_bytes));
+    }
+    string bitmap_path = file_path + ".written";
+    if (init == TREE_OPEN) {
+        // a lazy tree left its bitmap next to the file, without one every bucket has to authenticate
+        if (access(bitmap_path.c_str(), F_OK) == 0) {
+            StateReader in(bitmap_path);
+            this->written.reset(new BucketBitmap(in, numBuckets));
+        }
+        // a tree built with another geometry or cipher fails here, not on the first access
+        read_bucket_physical(top_buckets.size());
+        return;
+    }
+    if (init == TREE_LAZY) {
+        // the file is one big hole, dummies are made when a bucket is first read
+        this->written.reset(new BucketBitmap(numBuckets));
+        save_written();
+        return;
+    }
+    // a bitmap of an earlier lazy tree would make filled buckets read as holes
+    remove(bitmap_path.c_str());
     
-    for (int i = 0; i < numBuckets; i++) {
-        tree_file << serialize_bucket(encrypt_bucket(Bucket(),encryptionKey));
+    // written a chunk of slots at a time, slot padding stays zero
+    const int chunk_buckets = 64;
+    AlignedBuffer chunk(chunk_buckets * slot_bytes);
+    memset(chunk.data(), 0, chunk.size());
+    for (int64_t start = 0; start < numBuckets; start += chunk_buckets) {
+        int count = (int)min((int64_t)chunk_buckets, numBuckets - start);
+        for (int i = 0; i < count; i++) {
+            dummy_slot(chunk.data() + i * slot_bytes);
+        }
+        storage->write((uint64_t)start * slot_bytes, chunk.data(), count * slot_bytes);
     }
     //tree_file.flush();
     //flushCache();
 }
 
 ORAM::~ORAM() {
-    if (tree_file.is_open()) {
-        tree_file.close();
-    }
 }
 
-int ORAM::bitReverse(int x, int bits) {
-    int y = 0;
+// one bucket of encrypted dummies with fresh ciphertext, in the slot layout
+void ORAM::dummy_slot(char* slot) {
+    string bucket_data = serialize_bucket(encrypt_bucket(Bucket(config.Z), encryptionKey, config), config);
+    memcpy(slot, bucket_data.data(), bucket_bytes);
+    memset(slot + bucket_bytes, 0, slot_bytes - bucket_bytes);
+}
+
+int64_t ORAM::bitReverse(int64_t x, int bits) {
+    int64_t y = 0;
     for (int i = 0; i < bits; i++) {
         y = (y << 1) | (x & 1);
         x >>= 1;
@@ -46,151 +87,187 @@ int ORAM::bitReverse(int x, int bits) {
     return y;
 }
 
-int ORAM::toNormalIndex(int physicalIndex) {
+int64_t ORAM::toNormalIndex(int64_t physicalIndex) {
     int level = 0;
-    int temp = physicalIndex + 1;
+    int64_t temp = physicalIndex + 1;
     while (temp >>= 1) {
         level++;
     }
-    int levelStart = (1 << level) - 1;
-    int pos_br = physicalIndex - levelStart;
-    int pos_normal = bitReverse(pos_br, level);
+    int64_t levelStart = ((int64_t)1 << level) - 1;
+    int64_t pos_br = physicalIndex - levelStart;
+    int64_t pos_normal = bitReverse(pos_br, level);
     return levelStart + pos_normal;
 }
 
-int ORAM::toPhysicalIndex(int normalIndex) {
+int64_t ORAM::toPhysicalIndex(int64_t normalIndex) {
     int level = 0;
-    int temp = normalIndex + 1;
+    int64_t temp = normalIndex + 1;
     while (temp >>= 1) {
         level++;
     }
-    int levelStart = (1 << level) - 1;
-    int pos_normal = normalIndex - levelStart;
-    int pos_br = bitReverse(pos_normal, level);
+    int64_t levelStart = ((int64_t)1 << level) - 1;
+    int64_t pos_normal = normalIndex - levelStart;
+    int64_t pos_br = bitReverse(pos_normal, level);
     return levelStart + pos_br;
 }
 
-int ORAM::leafToPhysicalIndex(int leaf) {
+int64_t ORAM::leafToPhysicalIndex(int64_t leaf) {
     int height = log2(num_buckets + 1);  
     int leafLevel = height - 1;
-    int firstLeafIndex = (1 << leafLevel) - 1;
-    int normalIndex = firstLeafIndex + leaf;
+    int64_t firstLeafIndex = ((int64_t)1 << leafLevel) - 1;
+    int64_t normalIndex = firstLeafIndex + leaf;
     return toPhysicalIndex(normalIndex);
 }
 
-int ORAM::parent(int i) {
+int64_t ORAM::parent(int64_t i) {
     if (i == 0) return -1;
-    int normal_index = toNormalIndex(i);
-    int normal_parent = (normal_index - 1) / 2;
+    int64_t normal_index = toNormalIndex(i);
+    int64_t normal_parent = (normal_index - 1) / 2;
     return toPhysicalIndex(normal_parent);
 }
 
-Bucket ORAM::read_bucket(int logical_index) {
+Bucket ORAM::read_bucket(int64_t logical_index) {
     //cout << "logical index in read_bucket" << logical_index << endl;
+    return read_bucket_physical(toPhysicalIndex(logical_index));
+}
 
-    tree_file.clear();
-    const std::streamoff offset = toPhysicalIndex(logical_index) * bucket_char_size;
-    tree_file.seekg(offset, std::ios::beg);
-    if (!tree_file) {
-        reopenFile();
-        if(!tree_file){
-            throw std::runtime_error("Seek failed.");
+bool ORAM::held_copy(int64_t physicalIndex, char* slot) {
+    lock_guard<mutex> lock(held->lock);
+    unordered_map<int64_t, size_t>::iterator it = held->offsets.find(physicalIndex);
+    if (it == held->offsets.end()) return false;
+    memcpy(slot, held->data.data() + it->second, slot_bytes);
+    return true;
+}
+
+// Fills out with one slot per physical index. Cached slots are copied, the rest
+// are read as one batch (the backend merges contiguous runs). Buckets of a
+// lazy tree that were never written are not read at all.
+void ORAM::read_slots(const vector<int64_t>& physical_indices, char* out) {
+    vector<IoRequest> requests;
+    vector<int64_t> missed;
+    // taken before the read, a write landing meanwhile keeps the stale slot out of the cache
+    uint64_t epoch = cache ? cache->epoch() : 0;
+    for (size_t i = 0; i < physical_indices.size(); i++) {
+        char* slot = out + i * slot_bytes;
+        // a held write is newer than anything in the file or the cache
+        if (held && held_copy(physical_indices[i], slot)) continue;
+        if (written && !written->test(physical_indices[i])) {
+            dummy_slot(slot);
+            continue;
+        }
+        if (cache && cache->lookup(physical_indices[i], slot)) continue;
+        IoRequest r = { (uint64_t)physical_indices[i] * slot_bytes, slot, slot_bytes };
+        requests.push_back(r);
+        missed.push_back(i);
+    }
+    if (requests.empty()) return;
+    storage->read_batch(requests);
+    if (cache) {
+        for (int64_t i : missed) {
+            cache->fill(physical_indices[i], out + i * slot_bytes, epoch);
         }
     }
-    char buffer[bucket_char_size];
-    tree_file.read(buffer, bucket_char_size);
-    //cout << "in read bucket" << endl;
-    //cout << tree_file.gcount() << endl;
-    if (tree_file.gcount() != bucket_char_size) {
-        throw std::runtime_error("Failed to read the full bucket.");
+}
+
+void ORAM::write_slots(const vector<int64_t>& physical_indices, const char* in) {
+    if (!held) {
+        store_slots(physical_indices, in);
+        return;
+    }
+    lock_guard<mutex> lock(held->lock);
+    for (size_t i = 0; i < physical_indices.size(); i++) {
+        unordered_map<int64_t, size_t>::iterator it = held->offsets.find(physical_indices[i]);
+        if (it != held->offsets.end()) {
+            memcpy(&held->data[it->second], in + i * slot_bytes, slot_bytes);
+        } else {
+            held->offsets[physical_indices[i]] = held->data.size();
+            held->data.append(in + i * slot_bytes, slot_bytes);
+        }
     }
-    string bucket_data(buffer, bucket_char_size);
-    Bucket result = deserialize_bucket(bucket_data);
-    //flushCache();
-    return result;
 }
 
-Bucket ORAM::read_bucket_physical(int physicalIndex) {
-    //cout << "logical index in read_bucket" << logical_index << endl;
-    tree_file.clear();
-    const std::streamoff offset = physicalIndex * bucket_char_size;
-    tree_file.seekg(offset, std::ios::beg);
-    if (!tree_file) {
-        reopenFile();
-        if(!tree_file){
-            throw std::runtime_error("Seek failed.");
+// Writes one slot per physical index as one batch, the cache is written through.
+void ORAM::store_slots(const vector<int64_t>& physical_indices, const char* in) {
+    vector<IoRequest> requests;
+    for (size_t i = 0; i < physical_indices.size(); i++) {
+        IoRequest r = { (uint64_t)physical_indices[i] * slot_bytes, const_cast<char*>(in) + i * slot_bytes, slot_bytes };
+        requests.push_back(r);
+    }
+    storage->write_batch(requests);
+    if (written) {
+        for (int64_t index : physical_indices) {
+            written->mark(index);
         }
     }
-    char buffer[bucket_char_size];
-    tree_file.read(buffer, bucket_char_size);
-    //cout << "in read bucket" << endl;
-    //cout << tree_file.gcount() << endl;
-    if (tree_file.gcount() != bucket_char_size) {
-        throw std::runtime_error("Failed to read the full bucket.");
+    if (cache) {
+        for (size_t i = 0; i < physical_indices.size(); i++) {
+            cache->insert(physical_indices[i], in + i * slot_bytes);
+        }
     }
-    string bucket_data(buffer, bucket_char_size);
-    Bucket result = deserialize_bucket(bucket_data);
-    //flushCache();
-    return result;
 }
 
-vector<Bucket> ORAM::read_bucket_physical_consecutive(int physicalIndex, int range) {
+Bucket ORAM::read_bucket_physical(int64_t physicalIndex) {
+    if (physicalIndex < (int64_t)top_buckets.size()) {
+        return top_buckets[physicalIndex];
+    }
+    const char* mapped = storage->view((uint64_t)physicalIndex * slot_bytes, bucket_bytes);
+    // an unwritten bucket of a lazy tree is still a hole in the mapping, a held
+    // one is only in memory
+    if (mapped != nullptr && !held && (!written || written->test(physicalIndex))) {
+        return deserialize_bucket(mapped, bucket_bytes, config);
+    }
+    AlignedBuffer buffer(slot_bytes);
+    read_slots(vector<int64_t>(1, physicalIndex), buffer.data());
+    return deserialize_bucket(buffer.data(), bucket_bytes, config);
+}
+
+vector<Bucket> ORAM::read_bucket_physical_consecutive(int64_t physicalIndex, int64_t range) {
     vector<Bucket> results;
     results.reserve(range); 
     if (range <= 0) return results;
     
     // Determine level info
     int level = 0;
-    int temp = physicalIndex + 1;
+    int64_t temp = physicalIndex + 1;
     while (temp >>= 1) {
         level++;
     }
-    int levelStart = (1 << level) - 1;
-    int levelSize = (1 << level);
-    int positionInLevel = physicalIndex - levelStart;
+    int64_t levelStart = ((int64_t)1 << level) - 1;
+    int64_t levelSize = ((int64_t)1 << level);
+    int64_t positionInLevel = physicalIndex - levelStart;
     
     range = min(range, levelSize);
     
-    int maxChunkSize = 64; 
-    
-    int remaining = range;
-    int currentPos = positionInLevel;
-    
-    while (remaining > 0) {
-        int chunkSize = min(remaining, maxChunkSize);
-        int continuousBucketsToRead = min(chunkSize, levelSize - currentPos);
-        
-        // Read continuous 
-        vector<char> buffer(continuousBucketsToRead * bucket_char_size);
-        
-        tree_file.clear();
-        const std::streamoff offset = (levelStart + currentPos) * bucket_char_size;
-        tree_file.seekg(offset, std::ios::beg);
-        
-        if (!tree_file) {
-            reopenFile();
-            if (!tree_file) {
-                throw std::runtime_error("Seek failed at position " + to_string(offset));
-            }
-            tree_file.seekg(offset, std::ios::beg);
+    // cached level, plaintext copies straight from memory
+    if (level_cached(level)) {
+        for (int64_t i = 0; i < range; i++) {
+            int64_t pos = (positionInLevel + i) % levelSize;
+            results.push_back(top_buckets[levelStart + pos]);
         }
-        
-        tree_file.read(buffer.data(), continuousBucketsToRead * bucket_char_size);
-        
-        if (tree_file.gcount() != continuousBucketsToRead * bucket_char_size) {
-            throw std::runtime_error("Failed to read continuous bucket range. " 
-                                    "Requested: " + to_string(continuousBucketsToRead * bucket_char_size) + 
-                                    " bytes, Got: " + to_string(tree_file.gcount()) + " bytes");
-        }
-        
-        for (int i = 0; i < continuousBucketsToRead; i++) {
-            char* bucketStart = buffer.data() + (i * bucket_char_size);
-            string bucket_data(bucketStart, bucket_char_size);
-            results.push_back(deserialize_bucket(bucket_data));
+        return results;
+    }
+    
+    // mapped tree, parse the buckets in place
+    if (storage->view(0, bucket_bytes) != nullptr) {
+        for (int64_t i = 0; i < range; i++) {
+            int64_t pos = (positionInLevel + i) % levelSize;
+            results.push_back(read_bucket_physical(levelStart + pos));
         }
-
-        remaining -= continuousBucketsToRead;
-        currentPos = (currentPos + continuousBucketsToRead) % levelSize;
+        return results;
+    }
+    
+    // one buffer for the whole range, one slot per bucket, the backend merges
+    // the contiguous run (two runs if the range wraps around the level)
+    AlignedBuffer buffer(range * slot_bytes);
+    vector<int64_t> indices;
+    for (int64_t i = 0; i < range; i++) {
+        int64_t pos = (positionInLevel + i) % levelSize;
+        indices.push_back(levelStart + pos);
+    }
+    read_slots(indices, buffer.data());
+    
+    for (int64_t i = 0; i < range; i++) {
+        results.push_back(deserialize_bucket(buffer.data() + i * slot_bytes, bucket_bytes, config));
     }
     
     return results;
@@ -198,16 +275,16 @@ vector<Bucket> ORAM::read_bucket_physical_consecutive(int physicalIndex, int ran
 
 
 //doesn't actually clear, we don't want to.
-vector<Bucket> ORAM::readBucketsAndClear(int level, int start_index, int count) {
-    int levelStart = (1 << level) - 1;
-    int levelSize = (1 << level);
+vector<Bucket> ORAM::readBucketsAndClear(int level, int64_t start_index, int count) {
+    int64_t levelStart = ((int64_t)1 << level) - 1;
+    int64_t levelSize = ((int64_t)1 << level);
     
     vector<Bucket> results;
     
-    vector<int> normalIndices;
-    for (int t = start_index; t < start_index + count; ++t) {
-        int offset = t % levelSize;
-        int normalIndex = levelStart + offset;
+    vector<int64_t> normalIndices;
+    for (int64_t t = start_index; t < start_index + count; ++t) {
+        int64_t offset = t % levelSize;
+        int64_t normalIndex = levelStart + offset;
         
         if (normalIndex < num_buckets && 
             find(normalIndices.begin(), normalIndices.end(), normalIndex) == normalIndices.end()) {
@@ -219,11 +296,11 @@ vector<Bucket> ORAM::readBucketsAndClear(int level, int start_index, int count)
     
     for (size_t i = 0; i < normalIndices.size(); i += CHUNK_SIZE) {
         size_t chunkEnd = min(i + CHUNK_SIZE, normalIndices.size());
-        vector<int> chunk(normalIndices.begin() + i, normalIndices.begin() + chunkEnd);
+        vector<int64_t> chunk(normalIndices.begin() + i, normalIndices.begin() + chunkEnd);
         
         sort(chunk.begin(), chunk.end());
         
-        for (int idx : chunk) {
+        for (int64_t idx : chunk) {
             try {
                 Bucket b = read_bucket(idx);
                 results.push_back(b);
@@ -231,7 +308,7 @@ vector<Bucket> ORAM::readBucketsAndClear(int level, int start_index, int count)
             catch (const exception& e) {
                 cerr << "Warning: Failed to read bucket at index " << idx 
                      << " during eviction: " << e.what() << endl;
-                results.push_back(Bucket(bucketCapacity));
+                results.push_back(Bucket(config.Z));
             }
         }
     }
@@ -239,119 +316,70 @@ vector<Bucket> ORAM::readBucketsAndClear(int level, int start_index, int count)
     return results;
 }
 
-void ORAM::updateBucketsAtLevel(int level, const vector<pair<int, Bucket>>& indexBucketPairs) {
+void ORAM::updateBucketsAtLevel(int level, const vector<pair<int64_t, Bucket>>& indexBucketPairs) {
     if (indexBucketPairs.empty()) return;
     
-    int levelStart = (1 << level) - 1;
+    int64_t levelStart = ((int64_t)1 << level) - 1;
     
-    vector<pair<int, string>> serializedBuckets;
+    vector<pair<int64_t, string>> serializedBuckets;
     serializedBuckets.reserve(indexBucketPairs.size());
     
     for (const auto& pair : indexBucketPairs) {
-        int offsetInLevel = pair.first;
-        int logicalIndex = levelStart + offsetInLevel;
-        int physicalIndex = toPhysicalIndex(logicalIndex);
+        int64_t offsetInLevel = pair.first;
+        int64_t logicalIndex = levelStart + offsetInLevel;
+        int64_t physicalIndex = toPhysicalIndex(logicalIndex);
         
         // Serialize the bucket once
-        string serialized = serialize_bucket(pair.second);
+        string serialized = serialize_bucket(pair.second, config);
         serializedBuckets.emplace_back(physicalIndex, std::move(serialized));
     }
     
     std::sort(serializedBuckets.begin(), serializedBuckets.end(), 
-             [](const pair<int, string>& a, const pair<int, string>& b) { 
+             [](const pair<int64_t, string>& a, const pair<int64_t, string>& b) { 
                  return a.first < b.first; 
              });
     
-    size_t i = 0;
-    while (i < serializedBuckets.size()) {
-        size_t rangeEnd = i + 1;
-        while (rangeEnd < serializedBuckets.size() && 
-               serializedBuckets[rangeEnd].first == serializedBuckets[rangeEnd-1].first + 1) {
-            rangeEnd++;
-        }
-        
-        // Get starting physical index
-        int startPhysicalIndex = serializedBuckets[i].first;
-        size_t rangeSize = rangeEnd - i;
-        
-        char* writeBuffer = new char[rangeSize * bucket_char_size];
-        
-        size_t bufferOffset = 0;
-        for (size_t k = i; k < rangeEnd; k++) {
-            memcpy(writeBuffer + bufferOffset, 
-                   serializedBuckets[k].second.data(), 
-                   bucket_char_size);
-            bufferOffset += bucket_char_size;
-        }
-        
-        tree_file.clear();
-        const std::streamoff offset = startPhysicalIndex * bucket_char_size;
-        
-        tree_file.seekp(offset, std::ios::beg);
-        if (!tree_file) {
-            tree_file.clear();
-            reopenFile();
-            tree_file.seekp(offset, std::ios::beg);
-        }
-        
-        tree_file.write(writeBuffer, rangeSize * bucket_char_size);
-        
-        delete[] writeBuffer;
-        
-        i = rangeEnd;
+    // one buffer, the backend turns each run of neighbouring slots into one write
+    AlignedBuffer writeBuffer(serializedBuckets.size() * slot_bytes);
+    memset(writeBuffer.data(), 0, writeBuffer.size());
+    vector<int64_t> indices;
+    for (size_t k = 0; k < serializedBuckets.size(); k++) {
+        memcpy(writeBuffer.data() + k * slot_bytes, 
+               serializedBuckets[k].second.data(), 
+               bucket_bytes);
+        indices.push_back(serializedBuckets[k].first);
     }
+    write_slots(indices, writeBuffer.data());
     
     //tree_file.flush();
 }
 
 
-void ORAM::updateBucket(int logicalIndex, const Bucket &newBucket) {
-    tree_file.clear();
-    const std::streamoff offset = toPhysicalIndex(logicalIndex) * bucket_char_size;
-    tree_file.seekp(offset, std::ios::beg);
-    if (!tree_file) {
-        reopenFile();
-        if(!tree_file){
-            throw std::runtime_error("Seek failed.");
-        }
-    }
-
-    std::string bucket_data = serialize_bucket(newBucket);
-    tree_file.write(bucket_data.data(), bucket_char_size);
-
-    if (!tree_file) {
-        throw std::runtime_error("Write failed.");
-    }
+void ORAM::updateBucket(int64_t logicalIndex, const Bucket &newBucket) {
+    updateBucket_physical(toPhysicalIndex(logicalIndex), newBucket);
     //flushCache();
 }
 
-void ORAM::updateBucketForInitialization(int logicalIndex, const Bucket &newBucket) {
-    tree_file.clear();
-    const std::streamoff offset = toPhysicalIndex(logicalIndex) * bucket_char_size;
-    tree_file.seekp(offset, std::ios::beg);
-    if (!tree_file) {
-        reopenFile();
-        if(!tree_file){
-            throw std::runtime_error("Seek failed.");
-        }
-    }
-
-    std::string bucket_data = serialize_bucket(newBucket);
-    tree_file.write(bucket_data.data(), bucket_char_size);
+void ORAM::updateBucket_physical(int64_t physicalIndex, const Bucket &newBucket) {
+    std::string bucket_data = serialize_bucket(newBucket, config);
+    AlignedBuffer buffer(slot_bytes);
+    memcpy(buffer.data(), bucket_data.data(), bucket_bytes);
+    memset(buffer.data() + bucket_bytes, 0, slot_bytes - bucket_bytes);
+    write_slots(vector<int64_t>(1, physicalIndex), buffer.data());
+}
 
-    if (!tree_file) {
-        throw std::runtime_error("Write failed.");
-    }
+void ORAM::updateBucketForInitialization(int64_t logicalIndex, const Bucket &newBucket) {
+    updateBucket_physical(toPhysicalIndex(logicalIndex), newBucket);
 }
 
-void ORAM::updateBucketAtLevel(int level, int index_in_level, const Bucket &newBucket) {
-    int levelStart = (1 << level) - 1;
-    int levelCount = (1 << level);
+void ORAM::updateBucketAtLevel(int level, int64_t index_in_level, const Bucket &newBucket) {
+    int64_t levelStart = ((int64_t)1 << level) - 1;
+    int64_t levelCount = ((int64_t)1 << level);
     if (index_in_level < 0 || index_in_level >= levelCount) {
         throw std::out_of_range("Bucket index out of range for the specified level");
     }
     
-    int normalIndex = levelStart + index_in_level;
+    int64_t normalIndex = levelStart + index_in_level;
     if (normalIndex >= num_buckets) {
         throw std::out_of_range("Bucket index exceeds tree size");
     }
@@ -359,40 +387,40 @@ void ORAM::updateBucketAtLevel(int level, int index_in_level, const Bucket &newB
     updateBucket(normalIndex, newBucket);
 }
 
-vector<Bucket> ORAM::try_buckets_at_level(int level, int leaf, int range_power) {
-    int physical_leaf = leafToPhysicalIndex(leaf);
-    int level_start = (1 << level) - 1;
-    int level_count = min((1 << level), num_buckets - level_start);
+vector<Bucket> ORAM::try_buckets_at_level(int level, int64_t leaf, int range_power) {
+    int64_t physical_leaf = leafToPhysicalIndex(leaf);
+    int64_t level_start = ((int64_t)1 << level) - 1;
+    int64_t level_count = min(((int64_t)1 << level), num_buckets - level_start);
     int height = log2(num_buckets + 1);
     int leaf_level = height - 1;
     
-    int physical_index_within_level;
+    int64_t physical_index_within_level;
     
     if (level == leaf_level) {
         physical_index_within_level = physical_leaf - level_start;
     } else {
-        int logical_leaf = toNormalIndex(physical_leaf);
-        int logical_ancestor = logical_leaf;
+        int64_t logical_leaf = toNormalIndex(physical_leaf);
+        int64_t logical_ancestor = logical_leaf;
         for (int i = 0; i < leaf_level - level; i++) {
             logical_ancestor = (logical_ancestor - 1) / 2;
         }
-        int physical_ancestor = toPhysicalIndex(logical_ancestor);
+        int64_t physical_ancestor = toPhysicalIndex(logical_ancestor);
         physical_index_within_level = physical_ancestor - level_start;
     }
     
     physical_index_within_level = physical_index_within_level % level_count;
-    int absolute_physical_index = level_start + physical_index_within_level;
+    int64_t absolute_physical_index = level_start + physical_index_within_level;
     
     return read_bucket_physical_consecutive(absolute_physical_index, 1 << range_power);
 }
 
-vector<int> ORAM::getpathindicies_ltor(int leaf) {
-    vector<int> path_indices;
-    int physical_leaf = leafToPhysicalIndex(leaf);
-    int current = physical_leaf;
+vector<int64_t> ORAM::getpathindicies_ltor(int64_t leaf) {
+    vector<int64_t> path_indices;
+    int64_t physical_leaf = leafToPhysicalIndex(leaf);
+    int64_t current = physical_leaf;
     
     while (current >= 0) {
-        int logical_index = toNormalIndex(current);
+        int64_t logical_index = toNormalIndex(current);
         path_indices.push_back(logical_index); 
         current = parent(current);
     }
@@ -400,25 +428,33 @@ vector<int> ORAM::getpathindicies_ltor(int leaf) {
     return path_indices;
 }
 
-block ORAM::writeBlockToPath(const block &b, int logicalLeaf, vector<unsigned char> key) {
+block ORAM::writeBlockToPath(const block &b, int64_t logicalLeaf, vector<unsigned char> key) {
     //cout << "writingblocktopath" << endl;
-    vector<int> path_indices = getpathindicies_ltor(logicalLeaf);
-    for (int logicalIndex : path_indices) {
+    vector<int64_t> path_indices = getpathindicies_ltor(logicalLeaf);
+    for (int64_t logicalIndex : path_indices) {
+        int64_t physicalIndex = toPhysicalIndex(logicalIndex);
+        if (physicalIndex < (int64_t)top_buckets.size()) {
+            // cached bucket, no crypto needed
+            if (top_buckets[physicalIndex].addBlock(b)) {
+                return block(-1, "", true, vector<int64_t>{});
+            }
+            continue;
+        }
         Bucket currentBucket = read_bucket(logicalIndex);
 
         // Decrypt the bucket blocks
         for (block &blocks_in_bucket: currentBucket.blocks){
-            blocks_in_bucket = decryptBlock(blocks_in_bucket, key);
+            blocks_in_bucket = decryptBlock(blocks_in_bucket, key, config);
         }
         
         if (currentBucket.addBlock(b)) {
             for (block &blocks_in_bucket: currentBucket.blocks){
-                blocks_in_bucket = encryptBlock(blocks_in_bucket, key);
+                blocks_in_bucket = encryptBlock(blocks_in_bucket, key, config);
             }
             updateBucketForInitialization(logicalIndex, currentBucket);
             
             // dummy for success
-            return block(-1, "", true, vector<int>{});
+            return block(-1, "", true, vector<int64_t>{});
         }
     }
     
@@ -426,37 +462,195 @@ block ORAM::writeBlockToPath(const block &b, int logicalLeaf, vector<unsigned ch
     return b;
 }
 
-// write the whole thing at once
-void ORAM::writeContiguousLevel(int physicalStart, int count, const string &data) {
-    tree_file.clear();
-    std::streamoff offset = physicalStart * bucket_char_size;
-    tree_file.seekp(offset, std::ios::beg);
-    if (!tree_file) {
-        reopenFile();
-        tree_file.seekp(offset, std::ios::beg);
+vector<block> ORAM::bulk_load(const vector<block>& blocks, int tree) {
+    int Z = config.Z;
+    int leaf_level = config.height - 1;
+    // only buckets that get a block are in the map, each with the blocks indices in it
+    unordered_map<int64_t, vector<size_t> > placed;
+    placed.reserve(blocks.size());
+    vector<block> overflow;
+    for (size_t i = 0; i < blocks.size(); i++) {
+        int64_t leaf = blocks[i].paths[tree];
+        bool done = false;
+        for (int level = leaf_level; level >= 0 && !done; level--) {
+            int64_t logical = (((int64_t)1 << level) - 1) + (leaf >> (leaf_level - level));
+            vector<size_t>& slots = placed[logical];
+            if ((int)slots.size() < Z) {
+                slots.push_back(i);
+                done = true;
+            }
+        }
+        if (!done) overflow.push_back(blocks[i]);
     }
-    tree_file.write(data.data(), count * bucket_char_size);
-    //tree_file.flush();
-}
 
+    // cached levels stay in memory in the clear
+    int64_t top_count = top_buckets.size();
+    for (Bucket& bucket : top_buckets) {
+        bucket = Bucket(Z);
+    }
+    // buckets that hold a block in physical order, the map is done after this
+    vector<int64_t> targets;
+    targets.reserve(placed.size());
+    for (auto& entry : placed) {
+        if (entry.second.empty()) continue;
+        int64_t physical = toPhysicalIndex(entry.first);
+        if (physical < top_count) {
+            for (size_t k = 0; k < entry.second.size(); k++) {
+                top_buckets[physical].blocks[k] = blocks[entry.second[k]];
+            }
+        } else {
+            targets.push_back(physical);
+        }
+    }
+    // a filled tree gets every bucket rewritten, so nothing of what it held
+    // before survives; a lazy tree only gets buckets with blocks, plus the ones
+    // it already wrote, the rest stay holes that read as dummies
+    bool every_bucket = !written;
+    if (written && written->count() > 0) {
+        for (int64_t physical = top_count; physical < num_buckets; physical++) {
+            if (written->test(physical)) targets.push_back(physical);
+        }
+    }
+    sort(targets.begin(), targets.end());
+    targets.erase(unique(targets.begin(), targets.end()), targets.end());
+
+    const int chunk_buckets = 256;
+    AlignedBuffer chunk(chunk_buckets * slot_bytes);
+    memset(chunk.data(), 0, chunk.size());
+    int64_t total = every_bucket ? num_buckets - top_count : (int64_t)targets.size();
+    for (int64_t start = 0; start < total; start += chunk_buckets) {
+        int count = (int)min((int64_t)chunk_buckets, total - start);
+        vector<Bucket> buckets;
+        vector<int64_t> indices;
+        for (int64_t k = start; k < start + count; k++) {
+            int64_t physical = every_bucket ? top_count + k : targets[k];
+            Bucket bucket(Z);
+            unordered_map<int64_t, vector<size_t> >::iterator it = placed.find(toNormalIndex(physical));
+            if (it != placed.end()) {
+                for (size_t j = 0; j < it->second.size(); j++) {
+                    bucket.blocks[j] = blocks[it->second[j]];
+                }
+            }
+            buckets.push_back(bucket);
+            indices.push_back(physical);
+        }
+        encrypt_path(buckets, encryptionKey, config);
+        for (size_t k = 0; k < buckets.size(); k++) {
+            string bucket_data = serialize_bucket(buckets[k], config);
+            memcpy(chunk.data() + k * slot_bytes, bucket_data.data(), bucket_bytes);
+        }
+        // ascending slots, the backend writes every contiguous run as one
+        write_slots(indices, chunk.data());
+    }
+    return overflow;
+}
 
+// write the whole thing at once, data holds count buckets back to back
+void ORAM::writeContiguousLevel(int64_t physicalStart, int64_t count, const string &data) {
+    AlignedBuffer buffer(count * slot_bytes);
+    memset(buffer.data(), 0, buffer.size());
+    vector<int64_t> indices;
+    for (int64_t i = 0; i < count; i++) {
+        memcpy(buffer.data() + i * slot_bytes, data.data() + i * bucket_bytes, bucket_bytes);
+        indices.push_back(physicalStart + i);
+    }
+    write_slots(indices, buffer.data());
+    //tree_file.flush();
+}
 
+// cached level counterpart of writeContiguousLevel, buckets are plaintext
+void ORAM::writeCachedLevel(int64_t physicalStart, const vector<Bucket> &buckets) {
+    for (size_t i = 0; i < buckets.size(); i++) {
+        top_buckets[physicalStart + i] = buckets[i];
+        if (held) held->top_written.push_back(physicalStart + i);
+    }
+}
 
+void ORAM::flushCache() {
+    storage->sync();
+    // only after the buckets it marks are on disk
+    if (written) save_written();
+}
 
+void ORAM::grow() {
+    if (held && !held->offsets.empty()) {
+        throw runtime_error("Release the held writes before growing the tree");
+    }
+    OramConfig grown = config;
+    grown.height++;
+    validate_config(grown);
+    int64_t old_buckets = num_buckets;
+    config = grown;
+    // every level keeps its place in the file, the new leaf level goes after the old one
+    num_buckets = config.num_buckets();
+    storage->extend((uint64_t)num_buckets * slot_bytes);
+    if (written) {
+        written->resize(num_buckets);
+    } else {
+        // the new level is a hole, from now on the tree tells holes apart like a lazy one
+        written.reset(new BucketBitmap(num_buckets, old_buckets));
+        save_written();
+    }
+}
 
+void ORAM::hold_writes(bool hold) {
+    if (hold) {
+        if (!held) held.reset(new HeldWrites());
+        return;
+    }
+    release_writes();
+    held.reset();
+}
 
+void ORAM::held_writes(vector<int64_t>& physical_indices, string& buckets, vector<int64_t>& top_indices) {
+    physical_indices.clear();
+    buckets.clear();
+    top_indices.clear();
+    if (!held) return;
+    lock_guard<mutex> lock(held->lock);
+    for (unordered_map<int64_t, size_t>::iterator it = held->offsets.begin(); it != held->offsets.end(); ++it) {
+        physical_indices.push_back(it->first);
+    }
+    sort(physical_indices.begin(), physical_indices.end());
+    buckets.reserve(physical_indices.size() * bucket_bytes);
+    for (int64_t index : physical_indices) {
+        buckets.append(held->data.data() + held->offsets[index], bucket_bytes);
+    }
+    top_indices.swap(held->top_written);
+    sort(top_indices.begin(), top_indices.end());
+    top_indices.erase(unique(top_indices.begin(), top_indices.end()), top_indices.end());
+}
 
-void ORAM::reopenFile() {
-    if (tree_file.is_open()) {
-        tree_file.close();
+// Held buckets go to the file in physical order a chunk at a time, so every
+// level is one sequential run. Reads keep getting the held copies until all
+// of them are written. Nothing is added meanwhile, no access is running
+void ORAM::release_writes() {
+    if (!held || held->offsets.empty()) return;
+    vector<int64_t> indices;
+    {
+        lock_guard<mutex> lock(held->lock);
+        for (unordered_map<int64_t, size_t>::iterator it = held->offsets.begin(); it != held->offsets.end(); ++it) {
+            indices.push_back(it->first);
+        }
     }
-    tree_file.open(file_path, std::ios::in | std::ios::out | std::ios::binary);
-    if (!tree_file.is_open()) {
-        throw std::runtime_error("Failed to reopen file");
+    sort(indices.begin(), indices.end());
+    const size_t chunk_buckets = 256;
+    AlignedBuffer chunk(chunk_buckets * slot_bytes);
+    for (size_t start = 0; start < indices.size(); start += chunk_buckets) {
+        size_t count = min(chunk_buckets, indices.size() - start);
+        vector<int64_t> part(indices.begin() + start, indices.begin() + start + count);
+        for (size_t k = 0; k < count; k++) {
+            memcpy(chunk.data() + k * slot_bytes, held->data.data() + held->offsets.at(part[k]), slot_bytes);
+        }
+        store_slots(part, chunk.data());
     }
+    lock_guard<mutex> lock(held->lock);
+    held->offsets.clear();
+    held->data.clear();
 }
 
-void ORAM::flushCache() {
-    tree_file.flush();
-    system("sync");
-}
\ No newline at end of file
+void ORAM::save_written() {
+    StateWriter out;
+    written->save(out);
+    out.commit(file_path + ".written");
+}
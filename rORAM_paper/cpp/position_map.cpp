@@ -0,0 +1,89 @@
+#include "../include/position_map.h"
+#include <cstring>
+#include <stdexcept>
+#include <string>
+
+using namespace std;
+
+PackedPositionMap::PackedPositionMap(size_t entries, int bits)
+    : entries(entries), bits(bits) {
+    if (bits < 1 || bits > 63) {
+        throw runtime_error("Leaf labels must be 1 to 63 bits");
+    }
+    mask = (1ULL << bits) - 1;
+    words.assign((entries * bits + 63) / 64, 0);
+}
+
+void PackedPositionMap::check(int64_t index) const {
+    if (index < 0 || (size_t)index >= entries) {
+        throw runtime_error("Index " + to_string(index) + " is outside the position map");
+    }
+}
+
+int64_t PackedPositionMap::get(int64_t index) const {
+    check(index);
+    uint64_t bit = (uint64_t)index * bits;
+    size_t w = bit >> 6;
+    unsigned offset = bit & 63;
+    uint64_t value = words[w] >> offset;
+    // label runs over into the next word
+    if (offset + bits > 64) value |= words[w + 1] << (64 - offset);
+    return (int64_t)(value & mask);
+}
+
+void PackedPositionMap::set(int64_t index, int64_t leaf) {
+    check(index);
+    uint64_t bit = (uint64_t)index * bits;
+    size_t w = bit >> 6;
+    unsigned offset = bit & 63;
+    uint64_t value = (uint64_t)leaf & mask;
+    words[w] = (words[w] & ~(mask << offset)) | (value << offset);
+    if (offset + bits > 64) {
+        unsigned spill = 64 - offset;
+        words[w + 1] = (words[w + 1] & ~(mask >> spill)) | (value >> spill);
+    }
+}
+
+int64_t PackedPositionMap::exchange(int64_t index, int64_t leaf) {
+    int64_t old_leaf = get(index);
+    set(index, leaf);
+    return old_leaf;
+}
+
+void PackedPositionMap::save(StateWriter& out) const {
+    out.put_u64(entries);
+    out.put_u32(bits);
+    out.put_u64(words.size());
+    out.put_bytes(words.data(), words.size() * sizeof(uint64_t));
+}
+
+// the words are copied out of the mapped state in one go
+PackedPositionMap::PackedPositionMap(StateReader& in) {
+    entries = in.get_u64();
+    bits = in.get_u32();
+    if (bits < 1 || bits > 63) {
+        throw runtime_error("Corrupt position map in client state");
+    }
+    mask = (1ULL << bits) - 1;
+    uint64_t count = in.get_u64();
+    if (count != (entries * bits + 63) / 64) {
+        throw runtime_error("Corrupt position map in client state");
+    }
+    words.resize(count);
+    memcpy(words.data(), in.get_bytes(count * sizeof(uint64_t)), count * sizeof(uint64_t));
+}
+
+void PackedPositionMap::widen(size_t new_entries, const unsigned char* coins) {
+    if (new_entries < entries) {
+        throw runtime_error("A position map can not shrink");
+    }
+    PackedPositionMap grown(new_entries, bits + 1);
+    for (size_t i = 0; i < entries; i++) {
+        int64_t coin = (coins[i >> 3] >> (i & 7)) & 1;
+        grown.set(i, (get(i) << 1) | coin);
+    }
+    entries = grown.entries;
+    bits = grown.bits;
+    mask = grown.mask;
+    words.swap(grown.words);
+}
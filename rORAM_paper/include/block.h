@@ -2,6 +2,7 @@
 #define BLOCK_H
 
 #include "config.h"
+#include <cstdint>
 #include <string>
 #include <vector>
 
@@ -9,14 +10,14 @@ using namespace std;
 
 
 struct block {
-    int id;
+    int64_t id;
     string data;
     bool dummy;
-    vector<int> paths;
+    vector<int64_t> paths;
 
     block();
     void print_block();
-    block(int id, const string& data, bool dummy, const vector<int>& paths);
+    block(int64_t id, const string& data, bool dummy, const vector<int64_t>& paths);
 
 };
 
@@ -0,0 +1,52 @@
+#ifndef BUCKET_CACHE_H
+#define BUCKET_CACHE_H
+
+#include <cstddef>
+#include <cstdint>
+#include <list>
+#include <mutex>
+#include <unordered_map>
+#include <vector>
+#include "storage.h"
+
+using namespace std;
+
+// Least recently used cache of raw (still encrypted) bucket slots, keyed by the
+// bucket's position in the tree file. Holds at most `capacity` buckets in one
+// preallocated aligned arena, so with O_DIRECT it is the only copy in memory.
+// Lookups and inserts may come from several threads at once.
+class BucketCache {
+private:
+    size_t capacity;
+    size_t slot_bytes;
+    AlignedBuffer arena;
+    list<size_t> lru;                    // arena slots, most recent first
+    vector<list<size_t>::iterator> lru_pos;
+    vector<uint64_t> slot_owner;
+    unordered_map<uint64_t, size_t> slots;
+    size_t hit_count;
+    size_t miss_count;
+    uint64_t write_count;
+    mutex cache_mutex;
+
+    void store(uint64_t index, const char* data);
+
+    BucketCache(const BucketCache&);
+    BucketCache& operator=(const BucketCache&);
+public:
+    BucketCache(size_t capacity, size_t slot_bytes);
+    // copies the slot into out and returns true on a hit
+    bool lookup(uint64_t index, char* out);
+    // write-through of a slot that was just written
+    void insert(uint64_t index, const char* data);
+    // Adds a slot that was read after a miss. A write from another thread can
+    // land between that read and this fill, so the slot is only added if no
+    // insert happened since epoch() was taken before the read.
+    uint64_t epoch();
+    void fill(uint64_t index, const char* data, uint64_t seen_epoch);
+    size_t hits() const { return hit_count; }
+    size_t misses() const { return miss_count; }
+    size_t size() const { return slots.size(); }
+};
+
+#endif
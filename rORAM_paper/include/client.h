@@ -6,8 +6,16 @@
 #include "oram.h"
 #include "server.h"
 #include "encryption.h"
+#include "config.h"
+#include "journal.h"
+#include "position_map.h"
+#include "stash.h"
+#include "state_file.h"
+#include "thread_pool.h"
+#include <functional>
 #include <map>
 #include <memory>
+#include <mutex>
 #include <random>
 #include <string>
 #include <vector>
@@ -17,39 +25,93 @@ using namespace std;
 
 class Client {
 private:
+    // trees are independent, evictions (and the two range reads of an access)
+    // run on these workers, every job touches a single tree
+    unique_ptr<ThreadPool> workers;
+    // the two range reads of one access share a position map
+    mutex position_mutex;
+    // write-ahead log, see enable_journal. Ranges remapped in the open group
+    // as (tree, index, new leaf)
+    unique_ptr<Journal> journal;
+    size_t journal_group;
+    size_t journal_accesses;
+    vector<tuple<int, int64_t, int64_t> > journal_remaps;
+    // opened from a saved state, so the journal applies on top of it
+    bool resumed;
 
+    void run_jobs(vector<function<void()> >& jobs);
+    void start_workers(size_t worker_threads);
+    void replayRecord(StateReader& in);
+    // every tree one level taller, the client's height and stashes follow
+    void growTrees();
+    // new paths in the current window of the block's range in every tree
+    void newPaths(block& b);
+    // blocks read back from before the trees grew come without paths, see deserializeBlock
+    void relabelStale(block& b);
     
 public:
     vector<unsigned char> key;
     int L;
-    vector<int> evict_counter;
+    vector<int64_t> evict_counter;
     Server* server;
     int max_range;
-    int num_blocks;
-    int num_buckets;
+    int64_t num_blocks;
+    int64_t num_buckets;
     int num_trees;
-    int bucket_capacity;
+    OramConfig config;
     vector<ORAM*> oram_trees;
-    vector<unordered_map<int, block> > stashes;
-    vector<map<int,int> > position_maps;
+    vector<Stash> stashes;
+    // tree l maps range start id to leaf at index id >> l
+    vector<PackedPositionMap> position_maps;
 
-    Client(vector<pair<int,string>> data_to_add, int bucket_capacity, int max_range);
-    tuple<vector<block>,int> read_range(int range_power, int leaf);
+    // every tree is built from config, config.height = 0 sizes the trees from the data
+    // worker_threads = 0 uses one per tree (at most one per core), 1 runs everything on the calling thread
+    Client(vector<pair<int64_t,string>> data_to_add, const OramConfig& config, int max_range, StorageMode storage_mode = STORAGE_FILE,
+           size_t cache_buckets = 0, int cached_levels = 0, size_t worker_threads = 0);
+    // Picks up where save_state left off, trees/<l> are reopened as they are and
+    // key has to be the key of the saved client. Only client state is read, so
+    // this takes time in the size of the stashes and position maps
+    Client(const string& state_path, const vector<unsigned char>& key, StorageMode storage_mode = STORAGE_FILE,
+           size_t cache_buckets = 0, size_t worker_threads = 0);
+    // Writes the geometry, a fingerprint of the key (not the key), and per tree
+    // the eviction counter, cached levels, stash and position map, after syncing
+    // every tree file. Cached levels and stashes are stored in the clear, the
+    // file belongs on the client like the key. Call it between accesses
+    void save_state(const string& path);
+    // Logs every access to a write-ahead journal at path. Bucket writes of all
+    // trees are held back until the group they belong to is in the journal, a
+    // group being group_accesses accesses with one fdatasync, and a crash loses
+    // at most the open group. The journal only holds what came after the last
+    // save_state: a client opened from a state replays it, a new client empties it
+    void enable_journal(const string& path, size_t group_accesses = 8);
+    // ends the open group, every access so far survives a crash
+    void commit();
+    // Grows every tree online by one level. Each range start in the position
+    // maps gets a random bit appended, which names a leaf under the old one, so
+    // every range window keeps its buckets in the old levels: the new level
+    // starts out empty and blocks move into it as they are evicted. A block
+    // still in a tree with paths of the smaller trees gets new ones in its
+    // range's window when it is read. The ids the client holds stay the same,
+    // only the trees have room for more. With a journal the growth is logged
+    void grow();
+    tuple<vector<block>,int64_t> read_range(int range_power, int64_t leaf);
     void batch_evict(int eviction_number, int range);
-    string access(int id, int range, int op, string data);
-    tuple<vector<block>,int> simple_read_range(int range_power, int leaf);
+    string access(int64_t id, int range, int op, string data);
+    tuple<vector<block>,int64_t> simple_read_range(int range_power, int64_t leaf);
     void simple_batch_evict(int eviction_number, int range);
-    vector<block> simple_access(int id, int range, int op, vector<string> data);
+    vector<block> simple_access(int64_t id, int range, int op, vector<string> data);
     void printRangeTree(int range);
-    int getRandomLeaf();
+    int64_t getRandomLeaf();
     void print_stashes();
+    void print_cache_stats();
+    void print_stash_stats();
     void print_position_maps();
     void print_tree_state(int tree_index, int max_level);
     void printLogicalTreeState(int tree_index, int max_level, bool decrypt);
     void init_test_data();
-    void print_path(int leaf, int tree_n);
-    int getRandomLeafInRange(int start, int range_size);
-    void i_am_an_idiot(vector<pair<int,string>> data_to_add, int bucket_capacity, int max_range);
+    void print_path(int64_t leaf, int tree_n);
+    int64_t getRandomLeafInRange(int64_t start, int64_t range_size);
+    void i_am_an_idiot(vector<pair<int64_t,string>> data_to_add, int bucket_capacity, int max_range);
 
 
     
@@ -1,7 +1,40 @@
 #ifndef CONFIG_H
 #define CONFIG_H
 
-const int bucket_size = 4;
-const int block_size = 2;
+#include <cstddef>
+#include <cstdint>
+
+// binary header in front of every block's payload
+// (64-bit id, 32-bit flags, payload length and path count, 4 reserved bytes,
+// then one 8 byte leaf per tree)
+const int max_block_paths = 32;
+const int block_header_size = 24 + 8 * max_block_paths;
+
+// on disk every bucket is a small header followed by Z raw nonce+ciphertext(+tag) records
+const unsigned char bucket_format_version = 4;
+const int bucket_header_size = 4;
+
+// stash slots on top of what one range access brings in, using more than that counts as an overflow
+const int default_stash_blocks = 128;
+
+// bumped whenever the layout of a saved client state changes
+const uint32_t client_state_version = 1;
+
+// AES-256-GCM authenticates every block, AES-256-CTR only encrypts it
+enum CipherMode { CIPHER_GCM = 1, CIPHER_CTR = 2 };
+
+// Geometry of the ORAM, picked at runtime. Block and bucket serialization and
+// all tree file offsets are derived from it.
+struct OramConfig {
+    int block_data_size;    // payload bytes per block
+    int Z;                  // blocks per bucket
+    int height;             // levels per tree, 2^height - 1 buckets (at most 62); 0 sizes the trees from the data
+    CipherMode cipher;
+
+    OramConfig(int block_data_size = 1600, int Z = 4, int height = 0, CipherMode cipher = CIPHER_GCM)
+        : block_data_size(block_data_size), Z(Z), height(height), cipher(cipher) {}
+    size_t block_plaintext_size() const { return block_header_size + block_data_size; }
+    int64_t num_buckets() const { return ((int64_t)1 << height) - 1; }
+};
 
 #endif
@@ -1,3 +1,5 @@
-int toNormalIndex(int physicalIndex);
-int bitReverse(int x, int bits);
-int toPhysicalIndex(int normalIndex);
\ No newline at end of file
+#include <cstdint>
+
+int64_t toNormalIndex(int64_t physicalIndex);
+int64_t bitReverse(int64_t x, int bits);
+int64_t toPhysicalIndex(int64_t normalIndex);
\ No newline at end of file
@@ -2,68 +2,141 @@
 #define ORAM_H
 
 #include <vector>
-#include <fstream>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <unordered_map>
 #include "bucket.h"
+#include "storage.h"
+#include "bucket_cache.h"
+#include "bucket_bitmap.h"
+#include "config.h"
 
 using namespace std;
 
+// How a tree file is set up when it is opened. TREE_FILL writes Z encrypted
+// dummies into every bucket, TREE_LAZY creates the file sparse and makes the
+// dummies when an unwritten bucket is read, TREE_OPEN keeps the file of an
+// earlier run as it is. Only a lazy tree (one with a <file>.written bitmap)
+// has holes, in any other tree a zeroed bucket fails to authenticate.
+enum TreeInit { TREE_FILL, TREE_LAZY, TREE_OPEN };
+
+// bucket writes kept back from the tree file, see ORAM::hold_writes
+struct HeldWrites {
+    mutex lock;
+    unordered_map<int64_t, size_t> offsets;     // physical index to its slot in data
+    string data;
+    // cached buckets rewritten since the writes were last taken
+    vector<int64_t> top_written;
+};
+
 class ORAM {
 private:
     vector<unsigned char> encryptionKey;
+    unique_ptr<BucketCache> cache;
+    // buckets written so far, only for a lazily created or grown tree
+    unique_ptr<BucketBitmap> written;
+    unique_ptr<HeldWrites> held;
     
-    int parent(int i);
-    int leftChild(int i);
-    int rightChild(int i);
+    void dummy_slot(char* slot);
+    // commits the bitmap to <file_path>.written
+    void save_written();
+    // copies a held bucket into slot, false if it is not held
+    bool held_copy(int64_t physicalIndex, char* slot);
+    void read_slots(const vector<int64_t>& physical_indices, char* out);
+    void write_slots(const vector<int64_t>& physical_indices, const char* in);
+    // write_slots straight to the file
+    void store_slots(const vector<int64_t>& physical_indices, const char* in);
+    int64_t parent(int64_t i);
+    int64_t leftChild(int64_t i);
+    int64_t rightChild(int64_t i);
 public:
     ~ORAM();
-    fstream tree_file;
+    unique_ptr<StorageBackend> storage;
     string file_path;
-    int bucketCapacity;
+    OramConfig config;
+    size_t bucket_bytes;
+    size_t slot_bytes;      // bucket_bytes rounded up to 4 KiB with O_DIRECT
     
     int global_counter;
-    int num_buckets;
+    int64_t num_buckets;
     int range_length;
-    ORAM(int numBuckets, int bucketCapacity, const vector<unsigned char>& encryptionKey, int range_length, string file);
+    // top levels kept decrypted in memory, indexed by physical index (the top
+    // k levels are physical indices 0 .. 2^k - 2 in both layouts)
+    int cached_levels;
+    vector<Bucket> top_buckets;
+    bool level_cached(int level) const { return level < cached_levels; }
+    // trees/<file> is opened with the chosen backend (pread/pwrite file, O_DIRECT file or mmap),
+    // cache_buckets > 0 keeps that many recently used buckets in memory (not for mmap),
+    // cached_levels = k keeps the top k levels decrypted in memory, they are never read or written on disk.
+    // config.height levels of config.Z blocks each, every block padded to config.block_data_size.
+    // A bucket the bitmap of a lazy tree has as never written reads as
+    // dummies. TREE_OPEN needs the config the file was built with, the cached levels
+    // start out empty and are filled in by the caller
+    ORAM(const OramConfig& config, const vector<unsigned char>& encryptionKey, int range_length, string file,
+         StorageMode mode = STORAGE_FILE, size_t cache_buckets = 0, int cached_levels = 0, TreeInit init = TREE_FILL);
 
 
-    int bitReverse(int x, int bits);
+    int64_t bitReverse(int64_t x, int bits);
     void print_physical_oram(bool split_levels = false);
-    int toNormalIndex(int physicalIndex);
-    int toPhysicalIndex(int normalIndex);
-    void updateBucket(int normalIndex, const Bucket &newBucket);
+    int64_t toNormalIndex(int64_t physicalIndex);
+    int64_t toPhysicalIndex(int64_t normalIndex);
+    void updateBucket(int64_t normalIndex, const Bucket &newBucket);
     void print_logical_oram();
-    vector<int> getpathindicies_ltor(int leaf);
-    vector<int> getpathindicies_rtol(int leaf);
-    Bucket read_bucket(int logical_index);
-    vector<Bucket> read_level_range(int level, int physical_node, int range_length);
-    vector<vector<Bucket> > read_range(int leaf);
-    bool stashContains(int address);
+    vector<int64_t> getpathindicies_ltor(int64_t leaf);
+    vector<int64_t> getpathindicies_rtol(int64_t leaf);
+    Bucket read_bucket(int64_t logical_index);
+    vector<Bucket> read_level_range(int level, int64_t physical_node, int range_length);
+    vector<vector<Bucket> > read_range(int64_t leaf);
+    bool stashContains(int64_t address);
     void removeFromStash(vector<block>& S);
-    vector<int> get_path_labels_mod(int leaf);
-    Bucket get_bucket_at_level(int level, int index_in_level);
-    int leafToPhysicalIndex(int leaf);
-    void updateBucketAtLevel(int level, int index_in_level, const Bucket &newBucket);
-    vector<Bucket> readBucketsAndClear(int level, int start_index, int count);
-    vector<Bucket> readBucketsAtLevel(int level, int start_index, int count);
+    vector<int64_t> get_path_labels_mod(int64_t leaf);
+    Bucket get_bucket_at_level(int level, int64_t index_in_level);
+    int64_t leafToPhysicalIndex(int64_t leaf);
+    void updateBucketAtLevel(int level, int64_t index_in_level, const Bucket &newBucket);
+    vector<Bucket> readBucketsAndClear(int level, int64_t start_index, int count);
+    vector<Bucket> readBucketsAtLevel(int level, int64_t start_index, int count);
 
-    vector<Bucket> simple_buckets_at_level(int level, int leaf, int range_power);
-    void simple_update_bucket(int level, int inx_in_level, Bucket updated_bucket);
+    vector<Bucket> simple_buckets_at_level(int level, int64_t leaf, int range_power);
+    void simple_update_bucket(int level, int64_t inx_in_level, Bucket updated_bucket);
 
-    int simple_toPhysical(int index, int level);
-    block writeBlockToPath(const block &b, int logicalLeaf, vector<unsigned char> key);
-    vector<Bucket> try_buckets_at_level(int level, int leaf, int range_power);
+    int64_t simple_toPhysical(int64_t index, int level);
+    block writeBlockToPath(const block &b, int64_t logicalLeaf, vector<unsigned char> key);
+    // Rewrites the whole tree with these blocks in it, each in the deepest bucket
+    // on its path (paths[tree]) with room. Memory goes with the blocks, not the
+    // tree. Buckets are encrypted and written a chunk at a time in physical
+    // order; a lazy tree only writes the buckets that hold blocks (and ones it
+    // wrote before), the rest stay holes. Returns the blocks that did not fit
+    vector<block> bulk_load(const vector<block>& blocks, int tree);
+    vector<Bucket> try_buckets_at_level(int level, int64_t leaf, int range_power);
 
-    Bucket read_bucket_physical(int physicalIndex);
-    Bucket read_bucket_physical_clear(int physicalIndex);
+    Bucket read_bucket_physical(int64_t physicalIndex);
+    Bucket read_bucket_physical_clear(int64_t physicalIndex);
 
-    void updateBucket_physical(int physicalIndex, const Bucket &newBucket);
-    vector<Bucket> read_bucket_physical_consecutive(int physicalIndex, int range);
+    void updateBucket_physical(int64_t physicalIndex, const Bucket &newBucket);
+    vector<Bucket> read_bucket_physical_consecutive(int64_t physicalIndex, int64_t range);
 
-    void reopenFile();
+    // syncs the file, then saves the bitmap of a lazy tree
     void flushCache();
-    void updateBucketForInitialization(int logicalIndex, const Bucket &newBucket);
-    void updateBucketsAtLevel(int level, const vector<pair<int, Bucket>>& indexBucketPairs);
-    void writeContiguousLevel(int physicalStart, int count, const string &data);
+    // While writes are held every written bucket stays in memory, where reads
+    // find it, until release_writes puts them all in the file. A journal makes
+    // them durable in between, so the file never has half of a group
+    void hold_writes(bool hold);
+    // the held buckets in physical order, bucket_bytes each back to back, and the
+    // cached buckets written since the last call
+    void held_writes(vector<int64_t>& physical_indices, string& buckets, vector<int64_t>& top_indices);
+    void release_writes();
+    // Adds a leaf level under the current one at the end of the file, every
+    // level is bit reversed on its own so no bucket moves. The new level is a
+    // hole and reads as dummies until written, a filled tree gets a bitmap for
+    // it. No writes may be held
+    void grow();
+    size_t cache_hits() const { return cache ? cache->hits() : 0; }
+    size_t cache_misses() const { return cache ? cache->misses() : 0; }
+    void updateBucketForInitialization(int64_t logicalIndex, const Bucket &newBucket);
+    void updateBucketsAtLevel(int level, const vector<pair<int64_t, Bucket>>& indexBucketPairs);
+    void writeContiguousLevel(int64_t physicalStart, int64_t count, const string &data);
+    void writeCachedLevel(int64_t physicalStart, const vector<Bucket> &buckets);
 
 };
 
@@ -0,0 +1,39 @@
+#ifndef POSITION_MAP_H
+#define POSITION_MAP_H
+
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+#include "state_file.h"
+
+using namespace std;
+
+// Leaf labels packed back to back in one flat array, `bits` bits per entry
+// (the leaf level of the tree), so a map of N entries takes N * bits / 8 bytes.
+// Every entry starts out at leaf 0.
+class PackedPositionMap {
+private:
+    size_t entries;
+    int bits;
+    uint64_t mask;
+    vector<uint64_t> words;
+
+    void check(int64_t index) const;
+public:
+    PackedPositionMap(size_t entries, int bits);
+    // a map written by save
+    explicit PackedPositionMap(StateReader& in);
+    size_t size() const { return entries; }
+    size_t memory_bytes() const { return words.size() * sizeof(uint64_t); }
+    int64_t get(int64_t index) const;
+    void set(int64_t index, int64_t leaf);
+    // stores the new leaf and returns the old one in a single lookup
+    int64_t exchange(int64_t index, int64_t leaf);
+    void save(StateWriter& out) const;
+    // One more bit per label, for a tree grown by a level: the label at index i
+    // becomes label * 2 + bit i of coins (one bit per current entry). Entries
+    // added past the current ones start at leaf 0
+    void widen(size_t entries, const unsigned char* coins);
+};
+
+#endif
@@ -15,8 +15,8 @@ private:
     int Z;
 public:
     Server(int num_blocks, int bucket_size, int biggest_range);
-    vector<Bucket> give_path(int leaf);
-    void write_bucket(const Bucket& path, int bucket_index);
+    vector<Bucket> give_path(int64_t leaf);
+    void write_bucket(const Bucket& path, int64_t bucket_index);
     void printHeap();
 };
 
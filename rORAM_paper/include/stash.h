@@ -0,0 +1,56 @@
+#ifndef STASH_H
+#define STASH_H
+
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+#include "block.h"
+
+using namespace std;
+
+// Client stash. Blocks live in a preallocated arena (payload strings reserved
+// up front, so copying a block in reuses its slot's buffer) and are found by id
+// through an open addressed table of arena slots with linear probing.
+// Dummy blocks are never stored. Going over capacity counts an overflow and
+// doubles the stash rather than losing blocks.
+class Stash {
+private:
+    vector<block> arena;
+    vector<int> table;          // arena slot or -1
+    size_t table_mask;
+    vector<int> live;           // arena slots in use, dense
+    vector<int> live_pos;       // index of each arena slot in live
+    vector<int> free_slots;
+    size_t payload_bytes;
+    size_t peak;
+    size_t overflows;
+    vector<size_t> histogram;   // stash size after each eviction
+
+    size_t home(int64_t id) const;
+    // table index holding id, or the empty index where it would go
+    size_t probe(int64_t id) const;
+    void rebuild(size_t capacity);
+public:
+    Stash(size_t capacity, size_t payload_bytes = 0);
+    size_t size() const { return live.size(); }
+    bool empty() const { return live.empty(); }
+    size_t capacity() const { return arena.size(); }
+    // grows ahead of a known large batch, not counted as an overflow
+    void reserve(size_t capacity);
+    // pointers stay valid until the next insert
+    block* find(int64_t id);
+    // copies b in, replacing the block with the same id
+    void insert(const block& b);
+    bool erase(int64_t id);
+    // blocks in no particular order, erasing at(i) while walking i downwards is safe
+    block& at(size_t i) { return arena[live[i]]; }
+
+    // called once per access after eviction
+    void record_occupancy();
+    size_t peak_size() const { return peak; }
+    size_t overflow_count() const { return overflows; }
+    const vector<size_t>& occupancy_histogram() const { return histogram; }
+    void print_stats();
+};
+
+#endif
@@ -0,0 +1,58 @@
+#ifndef STATE_FILE_H
+#define STATE_FILE_H
+
+#include <cstddef>
+#include <cstdint>
+#include <string>
+
+using namespace std;
+
+// Client state is a flat binary file, fields are appended in order and read
+// back in the same order. Integers are stored as they are in memory (little endian).
+
+// Builds the whole state in memory and writes it in one go.
+class StateWriter {
+private:
+    string data;
+public:
+    void put_u32(uint32_t value) { put_bytes(&value, sizeof(value)); }
+    void put_u64(uint64_t value) { put_bytes(&value, sizeof(value)); }
+    void put_i64(int64_t value) { put_bytes(&value, sizeof(value)); }
+    void put_bytes(const void* bytes, size_t length);
+    // length prefixed
+    void put_string(const string& s);
+    size_t size() const { return data.size(); }
+    const string& bytes() const { return data; }
+    // writes path.tmp, syncs it and renames it over path, so a crash leaves
+    // either the old state or the new one
+    void commit(const string& path);
+};
+
+// The file is mapped read only and fields are taken straight from the mapping.
+// Reading past the end throws, so a truncated file is caught.
+class StateReader {
+private:
+    string path;
+    int fd;
+    const char* map;
+    size_t length;
+    size_t pos;
+
+    StateReader(const StateReader&);
+    StateReader& operator=(const StateReader&);
+public:
+    explicit StateReader(const string& path);
+    // reads a buffer owned by someone else
+    StateReader(const char* bytes, size_t length);
+    ~StateReader();
+    uint32_t get_u32();
+    uint64_t get_u64();
+    int64_t get_i64();
+    // points into the mapping, valid as long as the reader
+    const char* get_bytes(size_t count);
+    string get_string();
+    bool done() const { return pos == length; }
+    size_t remaining() const { return length - pos; }
+};
+
+#endif
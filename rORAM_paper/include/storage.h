@@ -0,0 +1,150 @@
+#ifndef STORAGE_H
+#define STORAGE_H
+
+#include <cstddef>
+#include <cstdint>
+#include <mutex>
+#include <string>
+#include <vector>
+
+using namespace std;
+
+// One piece of a batched read/write. The buffer belongs to the caller.
+struct IoRequest {
+    uint64_t offset;
+    char* buffer;
+    size_t length;
+};
+
+// STORAGE_DIRECT is STORAGE_FILE opened with O_DIRECT, bypassing the page cache
+enum StorageMode { STORAGE_FILE, STORAGE_MMAP, STORAGE_DIRECT };
+
+// O_DIRECT needs offsets, lengths and buffers on this boundary
+const size_t direct_io_alignment = 4096;
+
+// bytes between the starts of two buckets in the tree file, buckets get
+// rounded up to whole 4 KiB slots when the file is opened with O_DIRECT
+size_t slot_size(size_t bucket_bytes, StorageMode mode);
+
+// How the tree will be walked, passed on to madvise for mapped files.
+enum AccessHint { ACCESS_RANDOM, ACCESS_SEQUENTIAL };
+
+// Where the encrypted tree file lives. Offsets are bytes from the start of the file.
+class StorageBackend {
+public:
+    virtual ~StorageBackend() {}
+    virtual void read(uint64_t offset, char* buffer, size_t length) = 0;
+    virtual void write(uint64_t offset, const char* buffer, size_t length) = 0;
+    // default is one read/write per request, backends can do better
+    virtual void read_batch(vector<IoRequest>& requests);
+    virtual void write_batch(vector<IoRequest>& requests);
+    // pointer straight into the backing memory, nullptr if the backend has none
+    virtual const char* view(uint64_t offset, size_t length) { return nullptr; }
+    // fd of the tree file for engines that submit I/O themselves, -1 if there is none
+    virtual int file_descriptor() const { return -1; }
+    // durability point, everything written so far is on disk when this returns
+    virtual void sync() = 0;
+    // makes the file at least length bytes long, what is added is a hole that
+    // reads as zeros. Nothing may be read or written meanwhile
+    virtual void extend(uint64_t length) = 0;
+};
+
+// Plain file descriptor, pread/pwrite and preadv/pwritev for batches.
+// With direct set the file is opened O_DIRECT and every request must be aligned.
+// A truncated file is sized to length up front, sparse until written.
+class FileStorage : public StorageBackend {
+private:
+    int fd;
+    string path;
+    bool direct;
+
+    void check_aligned(uint64_t offset, const char* buffer, size_t length);
+    void vectored(vector<IoRequest>& requests, bool is_write);
+public:
+    FileStorage(const string& path, bool truncate, bool direct = false, uint64_t length = 0);
+    ~FileStorage();
+    void read(uint64_t offset, char* buffer, size_t length);
+    void write(uint64_t offset, const char* buffer, size_t length);
+    void read_batch(vector<IoRequest>& requests);
+    void write_batch(vector<IoRequest>& requests);
+    int file_descriptor() const { return fd; }
+    void sync();
+    void extend(uint64_t length);
+};
+
+// Whole tree file mapped into memory. Reads can skip the copy through view(),
+// sync() is an msync of the mapping.
+class MmapStorage : public StorageBackend {
+private:
+    int fd;
+    string path;
+    char* map;
+    uint64_t length;
+    AccessHint hint;
+
+    void map_file();
+    void check_range(uint64_t offset, size_t length);
+public:
+    MmapStorage(const string& path, uint64_t length, bool truncate, AccessHint hint);
+    ~MmapStorage();
+    void read(uint64_t offset, char* buffer, size_t length);
+    void write(uint64_t offset, const char* buffer, size_t length);
+    const char* view(uint64_t offset, size_t length);
+    void sync();
+    // the file is mapped again at its new length, earlier views are invalid
+    void extend(uint64_t length);
+};
+
+// Opens the tree file at path with the chosen backend. length is the full tree
+// size in bytes, a truncated file is created that long with nothing allocated.
+StorageBackend* open_storage(StorageMode mode, const string& path, uint64_t length, bool truncate, AccessHint hint);
+
+// Heap buffer aligned for direct I/O, freed on destruction.
+class AlignedBuffer {
+private:
+    char* ptr;
+    size_t length;
+
+    AlignedBuffer(const AlignedBuffer&);
+    AlignedBuffer& operator=(const AlignedBuffer&);
+public:
+    explicit AlignedBuffer(size_t length, size_t alignment = 4096);
+    ~AlignedBuffer();
+    char* data() { return ptr; }
+    const char* data() const { return ptr; }
+    size_t size() const { return length; }
+};
+
+// Aligned buffers of one fixed size that get handed out again instead of
+// allocating a fresh one for every path.
+class BufferPool {
+private:
+    size_t buffer_bytes;
+    vector<AlignedBuffer*> free_buffers;
+    mutex pool_mutex;
+
+    BufferPool(const BufferPool&);
+    BufferPool& operator=(const BufferPool&);
+public:
+    explicit BufferPool(size_t buffer_bytes) : buffer_bytes(buffer_bytes) {}
+    ~BufferPool();
+    size_t buffer_size() const { return buffer_bytes; }
+    AlignedBuffer* acquire();
+    void release(AlignedBuffer* buffer);
+};
+
+// Borrows a buffer from a pool for one scope.
+class PooledBuffer {
+private:
+    BufferPool& pool;
+    AlignedBuffer* buffer;
+
+    PooledBuffer(const PooledBuffer&);
+    PooledBuffer& operator=(const PooledBuffer&);
+public:
+    explicit PooledBuffer(BufferPool& pool) : pool(pool), buffer(pool.acquire()) {}
+    ~PooledBuffer() { pool.release(buffer); }
+    char* data() { return buffer->data(); }
+};
+
+#endif
@@ -0,0 +1,35 @@
+#ifndef THREAD_POOL_H
+#define THREAD_POOL_H
+
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+using namespace std;
+
+// Fixed set of worker threads pulling tasks off one queue.
+class ThreadPool {
+private:
+    vector<thread> workers;
+    deque<function<void()> > tasks;
+    mutex queue_mutex;
+    condition_variable queue_cv;
+    bool stopping;
+
+    void worker_loop();
+
+    ThreadPool(const ThreadPool&);
+    ThreadPool& operator=(const ThreadPool&);
+public:
+    explicit ThreadPool(size_t num_threads);
+    ~ThreadPool();
+    size_t size() const { return workers.size(); }
+    void submit(function<void()> task);
+    // runs every job on the pool and waits for all of them, rethrows the first exception
+    void run_all(vector<function<void()> >& jobs);
+};
+
+#endif